@@ -0,0 +1,433 @@
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "bcache.h"
+
+/* blocks per background read */
+#define BCACHE_PREFETCH_RUN 64
+
+struct bcache_entry
+{
+    u64 blk;
+    int refs;
+    bcache_verify_fn verify;    /* what the block was checked with */
+    u64 bad;
+    int loading;                /* being read; wait on bc->loaded */
+    int err;                    /* the read failed, as errno */
+
+    struct bcache_entry *hnext;
+    /* unpinned entries, least recently used first */
+    struct bcache_entry *lru_prev, *lru_next;
+
+    u8 data[] __attribute__((aligned(16)));
+};
+
+struct bcache
+{
+    struct bdev *dev;
+    int block_size;
+
+    pthread_mutex_t lock;
+    struct bcache_entry **hash;
+    u32 hash_mask;
+    int nentries;
+    int max_entries;
+    struct bcache_entry *lru_head, *lru_tail;
+    pthread_cond_t loaded;
+
+    /* background reads still to finish */
+    int prefetching;
+    pthread_cond_t prefetch_done;
+};
+
+struct bcache_prefetch
+{
+    struct bdev_aio aio;
+    struct bcache *bc;
+    u32 count;
+    struct bcache_entry *entries[BCACHE_PREFETCH_RUN];
+    u8 owned[BCACHE_PREFETCH_RUN];  /* inserted by us, not already there */
+    struct iovec iov[BCACHE_PREFETCH_RUN];
+};
+
+static inline struct bcache_entry *bcache_entry(const u8 *data)
+{
+    return (struct bcache_entry *) (data - offsetof(struct bcache_entry,
+                                                    data));
+}
+
+static inline u32 bcache_hash(struct bcache *bc, u64 blk)
+{
+    return (u32) ((blk * 0x9e3779b97f4a7c15ULL) >> 32) & bc->hash_mask;
+}
+
+static void lru_remove(struct bcache *bc, struct bcache_entry *e)
+{
+    if (e->lru_prev)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        bc->lru_head = e->lru_next;
+    if (e->lru_next)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        bc->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void lru_append(struct bcache *bc, struct bcache_entry *e)
+{
+    e->lru_prev = bc->lru_tail;
+    e->lru_next = NULL;
+    if (bc->lru_tail)
+        bc->lru_tail->lru_next = e;
+    else
+        bc->lru_head = e;
+    bc->lru_tail = e;
+}
+
+static struct bcache_entry *hash_find(struct bcache *bc, u64 blk)
+{
+    struct bcache_entry *e;
+
+    for (e = bc->hash[bcache_hash(bc, blk)]; e; e = e->hnext)
+        if (e->blk == blk)
+            return e;
+    return NULL;
+}
+
+static void hash_remove(struct bcache *bc, struct bcache_entry *e)
+{
+    struct bcache_entry **p = &bc->hash[bcache_hash(bc, e->blk)];
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+}
+
+static int bcache_destroy(struct bcache *bc)
+{
+    struct bcache_entry *e, *next;
+    int i;
+
+    pthread_mutex_lock(&bc->lock);
+    while (bc->prefetching)
+        pthread_cond_wait(&bc->prefetch_done, &bc->lock);
+    pthread_mutex_unlock(&bc->lock);
+
+    for (i=0; i <= bc->hash_mask; i++)
+        for (e = bc->hash[i]; e; e = next)
+        {
+            next = e->hnext;
+            talloc_free(e);
+        }
+    pthread_cond_destroy(&bc->loaded);
+    pthread_cond_destroy(&bc->prefetch_done);
+    pthread_mutex_destroy(&bc->lock);
+    return 0;
+}
+
+struct bcache *bcache_new(void *mem_ctx, struct bdev *dev, int block_size,
+                          int nblocks)
+{
+    struct bcache *bc = talloc_zero(mem_ctx, struct bcache);
+    u32 nbuckets = 16;
+
+    while (nbuckets < 2 * nblocks)
+        nbuckets *= 2;
+
+    bc->dev = dev;
+    bc->block_size = block_size;
+    bc->max_entries = nblocks;
+    bc->hash = talloc_zero_array(bc, struct bcache_entry *, nbuckets);
+    bc->hash_mask = nbuckets - 1;
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->loaded, NULL);
+    pthread_cond_init(&bc->prefetch_done, NULL);
+    talloc_set_destructor(bc, bcache_destroy);
+    return bc;
+}
+
+/* with the lock held: add an unpinned block, evicting if full */
+static struct bcache_entry *bcache_insert(struct bcache *bc,
+                                          struct bcache_entry *e)
+{
+    struct bcache_entry *victim = NULL;
+
+    e->hnext = bc->hash[bcache_hash(bc, e->blk)];
+    bc->hash[bcache_hash(bc, e->blk)] = e;
+
+    if (!e->refs)
+        lru_append(bc, e);
+
+    if (++bc->nentries > bc->max_entries && bc->lru_head)
+    {
+        victim = bc->lru_head;
+        lru_remove(bc, victim);
+        hash_remove(bc, victim);
+        bc->nentries--;
+    }
+    return victim;
+}
+
+/* with the lock held: pin a cached block, or NULL */
+static struct bcache_entry *bcache_pin(struct bcache *bc, u64 blk)
+{
+    struct bcache_entry *e = hash_find(bc, blk);
+
+    if (e && !e->refs++)
+        lru_remove(bc, e);
+    return e;
+}
+
+static struct bcache_entry *bcache_alloc(struct bcache *bc, u64 blk)
+{
+    struct bcache_entry *e = talloc_size(NULL, sizeof(*e) + bc->block_size);
+
+    memset(e, 0, sizeof(*e));
+    e->blk = blk;
+    return e;
+}
+
+/*
+ * With the lock held: a read into a loading entry has finished, with
+ * err 0 or an errno.  Whoever was waiting for it gets the result; a
+ * failed entry leaves the cache, freed by whoever unpins it last.  The
+ * caller's own pin is dropped; returns the entry if it is to be freed.
+ */
+static struct bcache_entry *bcache_loaded(struct bcache *bc,
+                                          struct bcache_entry *e, int err)
+{
+    e->loading = 0;
+    e->err = err;
+    pthread_cond_broadcast(&bc->loaded);
+
+    if (err)
+    {
+        hash_remove(bc, e);
+        bc->nentries--;
+        return --e->refs ? NULL : e;
+    }
+    if (!--e->refs)
+        lru_append(bc, e);
+    return NULL;
+}
+
+/*
+ * Returns the block pinned, or NULL with errno set if it could not be
+ * read.  *bad gets the verify callback's mask.
+ *
+ * Only one thread reads a block that isn't cached: it goes into the
+ * cache as loading first, and anyone else who wants it meanwhile waits
+ * for that read rather than issuing their own.
+ */
+const u8 *bcache_get(struct bcache *bc, u64 blk, bcache_verify_fn verify,
+                     void *arg, u64 *bad)
+{
+    struct bcache_entry *e, *fresh = NULL, *victim = NULL;
+    ssize_t ret;
+    int stale;
+    int err;
+    u64 mask;
+
+    pthread_mutex_lock(&bc->lock);
+    while (!(e = bcache_pin(bc, blk)) && !fresh)
+    {
+        pthread_mutex_unlock(&bc->lock);
+        fresh = bcache_alloc(bc, blk);
+        pthread_mutex_lock(&bc->lock);
+    }
+
+    if (!e)
+    {
+        e = fresh;
+        fresh = NULL;
+        e->refs = 2;        /* ours, and the one bcache_loaded() drops */
+        e->loading = 1;
+        victim = bcache_insert(bc, e);
+        pthread_mutex_unlock(&bc->lock);
+        talloc_free(victim);
+
+        ret = bdev_pread(bc->dev, e->data, bc->block_size,
+                         (u64) blk * bc->block_size);
+        err = ret == bc->block_size ? 0 : ret < 0 ? -ret : EIO;
+        if (!err && verify)
+        {
+            e->bad = verify(arg, blk, e->data);
+            e->verify = verify;
+        }
+
+        pthread_mutex_lock(&bc->lock);
+        bcache_loaded(bc, e, err);
+    }
+    else
+    {
+        while (e->loading)
+            pthread_cond_wait(&bc->loaded, &bc->lock);
+        err = e->err;
+    }
+
+    if (err)
+    {
+        victim = --e->refs ? NULL : e;
+        pthread_mutex_unlock(&bc->lock);
+        talloc_free(victim);
+        talloc_free(fresh);
+        errno = err;
+        return NULL;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    talloc_free(fresh);
+
+    /* cached before under another (or no) verifier */
+    pthread_mutex_lock(&bc->lock);
+    stale = verify && e->verify != verify;
+    mask = e->bad;
+    pthread_mutex_unlock(&bc->lock);
+
+    if (stale)
+    {
+        mask = verify(arg, blk, e->data);
+
+        pthread_mutex_lock(&bc->lock);
+        e->bad = mask;
+        e->verify = verify;
+        pthread_mutex_unlock(&bc->lock);
+    }
+
+    if (bad)
+        *bad = verify ? mask : 0;
+    return e->data;
+}
+
+void bcache_put(struct bcache *bc, const u8 *data)
+{
+    struct bcache_entry *e = bcache_entry(data);
+
+    pthread_mutex_lock(&bc->lock);
+    if (!--e->refs)
+        lru_append(bc, e);
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/* the blocks now cached, up to max of them, in no particular order */
+u32 bcache_blocks(struct bcache *bc, u64 *blks, u32 max)
+{
+    struct bcache_entry *e;
+    u32 i, n = 0;
+
+    pthread_mutex_lock(&bc->lock);
+    for (i=0; i <= bc->hash_mask && n < max; i++)
+        for (e = bc->hash[i]; e && n < max; e = e->hnext)
+            blks[n++] = e->blk;
+    pthread_mutex_unlock(&bc->lock);
+    return n;
+}
+
+static void bcache_prefetch_done(struct bdev_aio *aio, ssize_t ret)
+{
+    struct bcache_prefetch *p = aio->arg;
+    struct bcache *bc = p->bc;
+    struct bcache_entry *victims[BCACHE_PREFETCH_RUN];
+    int err = ret == (ssize_t) p->count * bc->block_size ? 0 : EIO;
+    int nvictims = 0;
+    u32 i;
+
+    pthread_mutex_lock(&bc->lock);
+    for (i=0; i < p->count; i++)
+    {
+        /* someone else had the block already */
+        if (!p->owned[i])
+            victims[nvictims++] = p->entries[i];
+        else if ((victims[nvictims] = bcache_loaded(bc, p->entries[i], err)))
+            nvictims++;
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    while (nvictims--)
+        talloc_free(victims[nvictims]);
+    talloc_free(p);
+
+    pthread_mutex_lock(&bc->lock);
+    if (!--bc->prefetching)
+        pthread_cond_broadcast(&bc->prefetch_done);
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/* read entries for blocks blk.. into the cache with one aio */
+static void bcache_prefetch_run(struct bcache *bc, u64 blk, u32 count)
+{
+    struct bcache_prefetch *p = talloc_zero(NULL, struct bcache_prefetch);
+    struct bcache_entry *e, *victims[BCACHE_PREFETCH_RUN];
+    int nvictims = 0;
+    u32 i;
+
+    p->bc = bc;
+    p->count = count;
+    for (i=0; i < count; i++)
+    {
+        e = bcache_alloc(bc, blk + i);
+        p->entries[i] = e;
+        p->iov[i].iov_base = e->data;
+        p->iov[i].iov_len = bc->block_size;
+    }
+
+    /* in the cache as loading, so that gets wait for this read */
+    pthread_mutex_lock(&bc->lock);
+    for (i=0; i < count; i++)
+    {
+        e = p->entries[i];
+        if (hash_find(bc, e->blk))
+            continue;
+        p->owned[i] = 1;
+        e->refs = 1;
+        e->loading = 1;
+        if ((victims[nvictims] = bcache_insert(bc, e)))
+            nvictims++;
+    }
+    pthread_mutex_unlock(&bc->lock);
+
+    while (nvictims--)
+        talloc_free(victims[nvictims]);
+
+    p->aio.iov = p->iov;
+    p->aio.iovcnt = count;
+    p->aio.off = blk * bc->block_size;
+    p->aio.done = bcache_prefetch_done;
+    p->aio.arg = p;
+
+    pthread_mutex_lock(&bc->lock);
+    bc->prefetching++;
+    pthread_mutex_unlock(&bc->lock);
+
+    if (bdev_read_async(bc->dev, &p->aio))
+        bcache_prefetch_done(&p->aio, -EIO);
+}
+
+void bcache_prefetch(struct bcache *bc, u64 blk, u32 count)
+{
+    u64 start = 0, end = blk + count;
+    u32 run = 0;
+    int cached = 0;
+
+    for (; blk <= end; blk++)
+    {
+        if (blk < end)
+        {
+            pthread_mutex_lock(&bc->lock);
+            cached = hash_find(bc, blk) != NULL;
+            pthread_mutex_unlock(&bc->lock);
+        }
+
+        if (run && (blk == end || cached || run == BCACHE_PREFETCH_RUN))
+        {
+            bcache_prefetch_run(bc, start, run);
+            run = 0;
+        }
+        if (blk < end && !cached && !run++)
+            start = blk;
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef _BCACHE_H
+#define _BCACHE_H
+
+#include "config.h"
+#include "bdev.h"
+
+/*
+ * A block cache for filesystem metadata.  Blocks are read from a bdev
+ * and handed out pinned until bcache_put(); unpinned blocks are evicted
+ * least recently used first once the cache is full.  A block is only
+ * read once however many threads want it at the same time: the first
+ * reads it and the rest wait for that read, sharing its result.
+ *
+ * A verify callback can be given to bcache_get().  It runs once, when
+ * the block enters the cache (or is first asked for with that callback),
+ * and returns a mask of bad parts of the block which is kept with it;
+ * zero means the block is good.
+ *
+ * bcache_prefetch() reads blocks into the cache in the background, a
+ * run at a time, skipping any already there.  They are verified when
+ * first asked for.
+ */
+typedef u64 (*bcache_verify_fn)(void *arg, u64 blk, const u8 *data);
+
+struct bcache;
+
+struct bcache *bcache_new(void *mem_ctx, struct bdev *dev, int block_size,
+                          int nblocks);
+const u8 *bcache_get(struct bcache *bc, u64 blk, bcache_verify_fn verify,
+                     void *arg, u64 *bad);
+void bcache_put(struct bcache *bc, const u8 *data);
+void bcache_prefetch(struct bcache *bc, u64 blk, u32 count);
+u32 bcache_blocks(struct bcache *bc, u64 *blks, u32 max);
+
+#endif /* _BCACHE_H */
@@ -0,0 +1,601 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <talloc.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "bdev.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/* the background work queue gets a thread per CPU, within these */
+#define BDEV_MIN_WORK_THREADS 2
+#define BDEV_MAX_WORK_THREADS 16
+
+/* largest bounce buffer for O_DIRECT reads */
+#define BDEV_DIRECT_CHUNK (1 << 20)
+#define BDEV_DIRECT_ALIGN 4096
+
+/* helpers for backends on a file descriptor */
+
+u64 bdev_fd_size(int fd)
+{
+    struct stat st;
+    u64 size;
+
+    if (fstat(fd, &st))
+        return 0;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == 0)
+        return size;
+    return st.st_size;
+}
+
+static u64 fd_size(struct bdev *bdev)
+{
+    return bdev_fd_size(bdev->fd);
+}
+
+static void fd_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    static const int advice[] = {
+        [BDEV_HINT_NORMAL] = POSIX_FADV_NORMAL,
+        [BDEV_HINT_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+        [BDEV_HINT_RANDOM] = POSIX_FADV_RANDOM,
+        [BDEV_HINT_WILLNEED] = POSIX_FADV_WILLNEED,
+        [BDEV_HINT_DONTNEED] = POSIX_FADV_DONTNEED,
+    };
+
+    posix_fadvise(bdev->fd, off, len, advice[hint]);
+}
+
+static void fd_close(struct bdev *bdev)
+{
+    if (bdev->fd >= 0)
+        close(bdev->fd);
+}
+
+size_t bdev_iov_length(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i=0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
+
+/* scatter n bytes of src into iov, starting at byte pos of it */
+void bdev_iov_scatter(const struct iovec *iov, int iovcnt, size_t pos,
+                      const u8 *src, size_t n)
+{
+    size_t len;
+    int i;
+
+    for (i=0; i < iovcnt && n; i++)
+    {
+        if (pos >= iov[i].iov_len)
+        {
+            pos -= iov[i].iov_len;
+            continue;
+        }
+
+        len = min(n, iov[i].iov_len - pos);
+        memcpy((u8 *) iov[i].iov_base + pos, src, len);
+        src += len;
+        n -= len;
+        pos = 0;
+    }
+}
+
+/*
+ * the iovecs covering bytes [pos, pos + len) of iov, in out; returns how
+ * many, or -1 if that takes more than max
+ */
+int bdev_iov_slice(const struct iovec *iov, int iovcnt, size_t pos,
+                   size_t len, struct iovec *out, int max)
+{
+    int i, n = 0;
+
+    for (i=0; i < iovcnt && len; i++)
+    {
+        if (pos >= iov[i].iov_len)
+        {
+            pos -= iov[i].iov_len;
+            continue;
+        }
+        if (n == max)
+            return -1;
+
+        out[n].iov_base = (u8 *) iov[i].iov_base + pos;
+        out[n].iov_len = min(len, iov[i].iov_len - pos);
+        len -= out[n].iov_len;
+        pos = 0;
+        n++;
+    }
+    return n;
+}
+
+/* file: stdio */
+
+struct bdev_file
+{
+    FILE *fp;
+    pthread_mutex_t lock;   /* the stream position is shared */
+};
+
+static int file_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_file *f = talloc_zero(bdev, struct bdev_file);
+
+    f->fp = fopen(bdev->path, "r");
+    if (!f->fp)
+        return -errno;
+
+    pthread_mutex_init(&f->lock, NULL);
+    bdev->fd = fileno(f->fp);
+    bdev->priv = f;
+    return 0;
+}
+
+static ssize_t file_readv(struct bdev *bdev, const struct iovec *iov,
+                          int iovcnt, u64 off)
+{
+    struct bdev_file *f = bdev->priv;
+    ssize_t ret = 0;
+    size_t n;
+    int i;
+
+    pthread_mutex_lock(&f->lock);
+    if (fseeko(f->fp, off, SEEK_SET))
+    {
+        ret = -errno;
+        goto out;
+    }
+
+    for (i=0; i < iovcnt; i++)
+    {
+        n = fread(iov[i].iov_base, 1, iov[i].iov_len, f->fp);
+        ret += n;
+        if (n < iov[i].iov_len)
+        {
+            if (ferror(f->fp))
+                ret = -EIO;
+            clearerr(f->fp);
+            break;
+        }
+    }
+out:
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+static void file_close(struct bdev *bdev)
+{
+    struct bdev_file *f = bdev->priv;
+
+    if (f && f->fp)
+        fclose(f->fp);
+}
+
+static const struct bdev_ops bdev_file_ops = {
+    .name = "file",
+    .help = "buffered stdio",
+    .open = file_open,
+    .readv = file_readv,
+    .size = fd_size,
+    .hint = fd_hint,
+    .close = file_close,
+};
+
+/* pread */
+
+static int pread_open(struct bdev *bdev, const char *args)
+{
+    bdev->fd = open(bdev->path, O_RDONLY);
+    return bdev->fd < 0 ? -errno : 0;
+}
+
+static ssize_t pread_readv(struct bdev *bdev, const struct iovec *iov,
+                           int iovcnt, u64 off)
+{
+    ssize_t ret;
+
+    ret = preadv(bdev->fd, iov, iovcnt, off);
+    return ret < 0 ? -errno : ret;
+}
+
+static const struct bdev_ops bdev_pread_ops = {
+    .name = "pread",
+    .help = "pread/preadv on the page cache (default)",
+    .open = pread_open,
+    .readv = pread_readv,
+    .size = fd_size,
+    .hint = fd_hint,
+    .close = fd_close,
+};
+
+/* mmap */
+
+struct bdev_mmap
+{
+    u8 *map;
+    u64 size;
+};
+
+static int mmap_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_mmap *m = talloc_zero(bdev, struct bdev_mmap);
+
+    bdev->fd = open(bdev->path, O_RDONLY);
+    if (bdev->fd < 0)
+        return -errno;
+
+    bdev->priv = m;
+    m->size = bdev_fd_size(bdev->fd);
+    if (!m->size)
+        return 0;
+
+    m->map = mmap(NULL, m->size, PROT_READ, MAP_SHARED, bdev->fd, 0);
+    if (m->map == MAP_FAILED)
+    {
+        m->map = NULL;
+        return -errno;
+    }
+    return 0;
+}
+
+static ssize_t mmap_readv(struct bdev *bdev, const struct iovec *iov,
+                          int iovcnt, u64 off)
+{
+    struct bdev_mmap *m = bdev->priv;
+    size_t len;
+
+    if (off >= m->size)
+        return 0;
+
+    len = min(bdev_iov_length(iov, iovcnt), m->size - off);
+    bdev_iov_scatter(iov, iovcnt, 0, m->map + off, len);
+    return len;
+}
+
+static u64 mmap_size(struct bdev *bdev)
+{
+    struct bdev_mmap *m = bdev->priv;
+
+    return m->size;
+}
+
+static void mmap_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    static const int advice[] = {
+        [BDEV_HINT_NORMAL] = MADV_NORMAL,
+        [BDEV_HINT_SEQUENTIAL] = MADV_SEQUENTIAL,
+        [BDEV_HINT_RANDOM] = MADV_RANDOM,
+        [BDEV_HINT_WILLNEED] = MADV_WILLNEED,
+        [BDEV_HINT_DONTNEED] = MADV_DONTNEED,
+    };
+    struct bdev_mmap *m = bdev->priv;
+    u64 start = off & ~(u64) (getpagesize() - 1);
+
+    if (!m->map || off >= m->size)
+        return;
+
+    /* a zero length means to the end, as for posix_fadvise */
+    if (!len || len > m->size - off)
+        len = m->size - off;
+    madvise(m->map + start, off + len - start, advice[hint]);
+}
+
+static void mmap_close(struct bdev *bdev)
+{
+    struct bdev_mmap *m = bdev->priv;
+
+    if (m && m->map)
+        munmap(m->map, m->size);
+    fd_close(bdev);
+}
+
+static const struct bdev_ops bdev_mmap_ops = {
+    .name = "mmap",
+    .help = "mapped read-only and copied",
+    .open = mmap_open,
+    .readv = mmap_readv,
+    .size = mmap_size,
+    .hint = mmap_hint,
+    .close = mmap_close,
+};
+
+/* direct: O_DIRECT */
+
+struct bdev_direct
+{
+    u64 align;
+};
+
+static int direct_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_direct *d = talloc_zero(bdev, struct bdev_direct);
+
+    d->align = BDEV_DIRECT_ALIGN;
+    if (args && strncmp(args, "align=", 6) == 0)
+        d->align = strtoul(args + 6, NULL, 0);
+    if (!d->align || (d->align & (d->align - 1)))
+        return -EINVAL;
+
+    bdev->priv = d;
+    bdev->fd = open(bdev->path, O_RDONLY | O_DIRECT);
+    return bdev->fd < 0 ? -errno : 0;
+}
+
+static int direct_aligned(struct bdev_direct *d, const struct iovec *iov,
+                          int iovcnt, u64 off)
+{
+    int i;
+
+    if (off & (d->align - 1))
+        return 0;
+    for (i=0; i < iovcnt; i++)
+        if (((unsigned long) iov[i].iov_base | iov[i].iov_len) &
+            (d->align - 1))
+            return 0;
+    return 1;
+}
+
+static ssize_t direct_readv(struct bdev *bdev, const struct iovec *iov,
+                            int iovcnt, u64 off)
+{
+    struct bdev_direct *d = bdev->priv;
+    size_t len = bdev_iov_length(iov, iovcnt);
+    size_t pos = 0, lead, want, n;
+    u64 start;
+    ssize_t ret;
+    void *bounce;
+
+    if (direct_aligned(d, iov, iovcnt, off))
+    {
+        ret = preadv(bdev->fd, iov, iovcnt, off);
+        return ret < 0 ? -errno : ret;
+    }
+
+    /* otherwise read aligned chunks covering the range and copy out */
+    if (posix_memalign(&bounce, d->align, BDEV_DIRECT_CHUNK))
+        return -ENOMEM;
+
+    while (pos < len)
+    {
+        start = (off + pos) & ~(d->align - 1);
+        lead = off + pos - start;
+        want = min((lead + len - pos + d->align - 1) & ~(d->align - 1),
+                   BDEV_DIRECT_CHUNK);
+
+        ret = pread(bdev->fd, bounce, want, start);
+        if (ret < 0)
+        {
+            ret = -errno;
+            goto out;
+        }
+        if (ret <= lead)
+            break;
+
+        n = min(ret - lead, len - pos);
+        bdev_iov_scatter(iov, iovcnt, pos, (u8 *) bounce + lead, n);
+        pos += n;
+
+        if (ret < want)
+            break;
+    }
+    ret = pos;
+out:
+    free(bounce);
+    return ret;
+}
+
+static const struct bdev_ops bdev_direct_ops = {
+    .name = "direct",
+    .help = "O_DIRECT, bypassing the page cache [align=<bytes>]",
+    .open = direct_open,
+    .readv = direct_readv,
+    .size = fd_size,
+    .hint = fd_hint,
+    .close = fd_close,
+};
+
+static const struct bdev_ops *bdev_backends[] = {
+    &bdev_pread_ops,
+    &bdev_file_ops,
+    &bdev_mmap_ops,
+    &bdev_direct_ops,
+    &bdev_sparse_ops,
+#ifdef FSZOO_ZSTD
+    &bdev_zstd_ops,
+#endif
+    &bdev_dedup_ops,
+    &bdev_fault_ops,
+};
+
+#define NBACKENDS (sizeof(bdev_backends) / sizeof(bdev_backends[0]))
+
+/*
+ * A queue of work served by a few threads, started on first use: the
+ * asynchronous reads of backends without their own, and whatever else
+ * backends want done in the background.  Across fork() the queue is
+ * drained first and the child starts its own threads.
+ */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static struct bdev_work *work_head, *work_tail;
+static int work_pending;
+static int work_threads;
+
+static void *bdev_work_thread(void *arg)
+{
+    struct bdev_work *work;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&work_lock);
+        while (!work_head)
+            pthread_cond_wait(&work_cond, &work_lock);
+        work = work_head;
+        work_head = work->next;
+        if (!work_head)
+            work_tail = NULL;
+        pthread_mutex_unlock(&work_lock);
+
+        work->fn(work);
+
+        pthread_mutex_lock(&work_lock);
+        if (!--work_pending)
+            pthread_cond_broadcast(&work_cond);
+        pthread_mutex_unlock(&work_lock);
+    }
+    return NULL;
+}
+
+static void bdev_atfork_prepare(void)
+{
+    pthread_mutex_lock(&work_lock);
+    while (work_pending)
+        pthread_cond_wait(&work_cond, &work_lock);
+}
+
+static void bdev_atfork_parent(void)
+{
+    pthread_mutex_unlock(&work_lock);
+}
+
+static void bdev_atfork_child(void)
+{
+    work_threads = 0;
+    pthread_mutex_unlock(&work_lock);
+}
+
+int bdev_queue_work(struct bdev_work *work)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    long nthreads;
+    int err = 0;
+
+    work->next = NULL;
+
+    pthread_mutex_lock(&work_lock);
+    if (!work_threads)
+    {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = min(max(nthreads, BDEV_MIN_WORK_THREADS),
+                       BDEV_MAX_WORK_THREADS);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        while (work_threads < nthreads &&
+               !pthread_create(&thread, &attr, bdev_work_thread, NULL))
+            work_threads++;
+        pthread_attr_destroy(&attr);
+        if (!work_threads)
+            err = -EAGAIN;
+    }
+
+    if (!err)
+    {
+        if (work_tail)
+            work_tail->next = work;
+        else
+            work_head = work;
+        work_tail = work;
+        work_pending++;
+        pthread_cond_signal(&work_cond);
+    }
+    pthread_mutex_unlock(&work_lock);
+    return err;
+}
+
+static void bdev_aio_work(struct bdev_work *work)
+{
+    struct bdev_aio *aio = (struct bdev_aio *) ((u8 *) work -
+        offsetof(struct bdev_aio, work));
+
+    aio->done(aio, bdev_readv(aio->bdev, aio->iov, aio->iovcnt, aio->off));
+}
+
+int bdev_queue_async(struct bdev *bdev, struct bdev_aio *aio)
+{
+    aio->bdev = bdev;
+    aio->work.fn = bdev_aio_work;
+    return bdev_queue_work(&aio->work);
+}
+
+static void bdev_atfork_init(void)
+{
+    pthread_atfork(bdev_atfork_prepare, bdev_atfork_parent,
+                   bdev_atfork_child);
+}
+
+static int bdev_destructor(struct bdev *bdev)
+{
+    if (bdev->ops->close)
+        bdev->ops->close(bdev);
+    return 0;
+}
+
+struct bdev *bdev_open(void *mem_ctx, const char *path, const char *spec)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    const char *args;
+    struct bdev *bdev;
+    size_t len;
+    int err;
+    int i;
+
+    pthread_once(&once, bdev_atfork_init);
+
+    if (!spec)
+        spec = bdev_backends[0]->name;
+
+    args = strchr(spec, ':');
+    len = args ? args++ - spec : strlen(spec);
+
+    for (i=0; i < NBACKENDS; i++)
+        if (strlen(bdev_backends[i]->name) == len &&
+            strncmp(bdev_backends[i]->name, spec, len) == 0)
+            break;
+
+    if (i == NBACKENDS)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    bdev = talloc_zero(mem_ctx, struct bdev);
+    bdev->ops = bdev_backends[i];
+    bdev->path = talloc_strdup(bdev, path);
+    bdev->fd = -1;
+    talloc_set_destructor(bdev, bdev_destructor);
+
+    err = bdev->ops->open(bdev, args);
+    if (err)
+    {
+        talloc_free(bdev);
+        errno = -err;
+        return NULL;
+    }
+    return bdev;
+}
+
+void bdev_usage(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "block device backends (-b <backend>[:<args>]):\n");
+    for (i=0; i < NBACKENDS; i++)
+        fprintf(fp, "  %-8s %s\n", bdev_backends[i]->name,
+                bdev_backends[i]->help);
+}
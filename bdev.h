@@ -0,0 +1,140 @@
+#ifndef _BDEV_H
+#define _BDEV_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "config.h"
+
+/*
+ * Block devices (image files, really) for the filesystems to read from.
+ * A backend is picked by name when the device is opened, optionally with
+ * arguments after a colon, e.g. "mmap" or "direct:align=512":
+ *
+ *  file     stdio, buffered
+ *  pread    pread()/preadv() on a file descriptor (the default)
+ *  mmap     the whole device mapped read-only and copied out of
+ *  direct   O_DIRECT through aligned bounce buffers
+ *  sparse   an Android sparse image, read in place through another
+ *           backend ("sparse:mmap"; pread by default)
+ *  zstd     a seekable zstd image, when built with libzstd
+ *  dedup    a content addressed block cache shared by every image open
+ *           in the process, over another backend ("dedup:mmap")
+ *  fault    another backend made slow and unreliable, as configured in
+ *           a file ("fault:conf=hdd.conf,mmap"), for testing
+ *
+ * Reads return the number of bytes read, short only at the end of the
+ * device, or -errno.
+ */
+enum bdev_hint
+{
+    BDEV_HINT_NORMAL,
+    BDEV_HINT_SEQUENTIAL,
+    BDEV_HINT_RANDOM,
+    BDEV_HINT_WILLNEED,
+    BDEV_HINT_DONTNEED,
+};
+
+struct bdev;
+
+/* work for the background threads; fn runs on one of them */
+struct bdev_work
+{
+    void (*fn)(struct bdev_work *work);
+    struct bdev_work *next;
+};
+
+/*
+ * An asynchronous read.  done() is called from another thread once the
+ * read has finished, with what readv would have returned.
+ */
+struct bdev_aio
+{
+    const struct iovec *iov;
+    int iovcnt;
+    u64 off;
+    void (*done)(struct bdev_aio *aio, ssize_t ret);
+    void *arg;
+
+    /* private */
+    struct bdev *bdev;
+    struct bdev_work work;
+};
+
+struct bdev_ops
+{
+    const char *name;
+    const char *help;
+
+    int (*open)(struct bdev *bdev, const char *args);
+    ssize_t (*readv)(struct bdev *bdev, const struct iovec *iov, int iovcnt,
+                     u64 off);
+    u64 (*size)(struct bdev *bdev);
+
+    /* optional; without read_async reads go to the background threads */
+    int (*read_async)(struct bdev *bdev, struct bdev_aio *aio);
+    void (*hint)(struct bdev *bdev, int hint, u64 off, u64 len);
+    void (*close)(struct bdev *bdev);
+};
+
+struct bdev
+{
+    const struct bdev_ops *ops;
+    const char *path;
+    int fd;
+    void *priv;
+};
+
+struct bdev *bdev_open(void *mem_ctx, const char *path, const char *spec);
+void bdev_usage(FILE *fp);
+
+/* for backends */
+extern const struct bdev_ops bdev_sparse_ops;
+extern const struct bdev_ops bdev_zstd_ops;
+extern const struct bdev_ops bdev_dedup_ops;
+extern const struct bdev_ops bdev_fault_ops;
+
+int bdev_queue_work(struct bdev_work *work);
+int bdev_queue_async(struct bdev *bdev, struct bdev_aio *aio);
+u64 bdev_fd_size(int fd);
+size_t bdev_iov_length(const struct iovec *iov, int iovcnt);
+int bdev_iov_slice(const struct iovec *iov, int iovcnt, size_t pos,
+                   size_t len, struct iovec *out, int max);
+void bdev_iov_scatter(const struct iovec *iov, int iovcnt, size_t pos,
+                      const u8 *src, size_t n);
+
+static inline ssize_t bdev_readv(struct bdev *bdev, const struct iovec *iov,
+                                 int iovcnt, u64 off)
+{
+    return bdev->ops->readv(bdev, iov, iovcnt, off);
+}
+
+static inline ssize_t bdev_pread(struct bdev *bdev, void *buf, size_t len,
+                                 u64 off)
+{
+    struct iovec iov = { buf, len };
+
+    return bdev->ops->readv(bdev, &iov, 1, off);
+}
+
+static inline int bdev_read_async(struct bdev *bdev, struct bdev_aio *aio)
+{
+    aio->bdev = bdev;
+    if (bdev->ops->read_async)
+        return bdev->ops->read_async(bdev, aio);
+    return bdev_queue_async(bdev, aio);
+}
+
+static inline u64 bdev_size(struct bdev *bdev)
+{
+    return bdev->ops->size(bdev);
+}
+
+static inline void bdev_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    if (bdev->ops->hint)
+        bdev->ops->hint(bdev, hint, off, len);
+}
+
+#endif /* _BDEV_H */
@@ -0,0 +1,198 @@
+/*
+ * Read an image through one block device backend and report throughput,
+ * so the backends can be compared against each other on the same file.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <talloc.h>
+
+#include "bdev.h"
+
+struct bench_slot
+{
+    struct bdev_aio aio;
+    struct iovec iov;
+    int busy;
+};
+
+static pthread_mutex_t bench_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static u64 bench_bytes;
+static int bench_errors;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64 next_offset(u64 i, u64 nblocks, int block_size, int random)
+{
+    /* a fixed pseudo-random order, so runs are repeatable */
+    if (random)
+        i = (i * 0x9e3779b97f4a7c15ULL >> 16) % nblocks;
+    return i * block_size;
+}
+
+static void bench_done(struct bdev_aio *aio, ssize_t ret)
+{
+    struct bench_slot *slot = aio->arg;
+
+    pthread_mutex_lock(&bench_lock);
+    if (ret < 0)
+        bench_errors++;
+    else
+        bench_bytes += ret;
+    slot->busy = 0;
+    pthread_cond_broadcast(&bench_cond);
+    pthread_mutex_unlock(&bench_lock);
+}
+
+static void bench_async(struct bdev *dev, u8 *buf, int block_size,
+                        u64 nblocks, int random, int depth)
+{
+    struct bench_slot *slots = talloc_zero_array(NULL, struct bench_slot,
+                                                 depth);
+    u64 i = 0;
+    int s;
+
+    while (i < nblocks)
+    {
+        pthread_mutex_lock(&bench_lock);
+        for (;;)
+        {
+            for (s=0; s < depth && slots[s].busy; s++)
+                ;
+            if (s < depth)
+                break;
+            pthread_cond_wait(&bench_cond, &bench_lock);
+        }
+        slots[s].busy = 1;
+        pthread_mutex_unlock(&bench_lock);
+
+        slots[s].iov.iov_base = buf + (size_t) s * block_size;
+        slots[s].iov.iov_len = block_size;
+        slots[s].aio.iov = &slots[s].iov;
+        slots[s].aio.iovcnt = 1;
+        slots[s].aio.off = next_offset(i++, nblocks, block_size, random);
+        slots[s].aio.done = bench_done;
+        slots[s].aio.arg = &slots[s];
+
+        if (bdev_read_async(dev, &slots[s].aio))
+        {
+            bench_errors++;
+            slots[s].busy = 0;
+        }
+    }
+
+    /* wait for the stragglers */
+    pthread_mutex_lock(&bench_lock);
+    for (s=0; s < depth; s++)
+        while (slots[s].busy)
+            pthread_cond_wait(&bench_cond, &bench_lock);
+    pthread_mutex_unlock(&bench_lock);
+
+    talloc_free(slots);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *backend = NULL;
+    const char *path = NULL;
+    int block_size = 4096;
+    int random = 0;
+    int depth = 0;
+    int cold = 0;
+    u64 size, nblocks, i;
+    struct bdev *dev;
+    double start, t;
+    ssize_t ret;
+    u8 *buf;
+    int a;
+
+    for (a=1; a < argc; a++)
+    {
+        if ((strcmp(argv[a], "-b") == 0) && a + 1 < argc)
+            backend = argv[++a];
+        else if ((strcmp(argv[a], "-s") == 0) && a + 1 < argc)
+            block_size = atoi(argv[++a]);
+        else if ((strcmp(argv[a], "-q") == 0) && a + 1 < argc)
+            depth = atoi(argv[++a]);
+        else if (strcmp(argv[a], "-r") == 0)
+            random = 1;
+        else if (strcmp(argv[a], "-c") == 0)
+            cold = 1;
+        else
+            path = argv[a];
+    }
+
+    if (!path || block_size <= 0 || depth < 0)
+    {
+        fprintf(stderr, "Usage: %s [-b <backend>] [-s <read size>] [-r] "
+                "[-q <async depth>] [-c] <image>\n"
+                "  -r  random order instead of sequential\n"
+                "  -c  drop the image from the page cache first\n",
+                argv[0]);
+        bdev_usage(stderr);
+        return 1;
+    }
+
+    dev = bdev_open(NULL, path, backend);
+    if (!dev)
+    {
+        perror("bdev_bench");
+        return 2;
+    }
+
+    size = bdev_size(dev);
+    nblocks = size / block_size;
+    if (!nblocks)
+    {
+        fprintf(stderr, "%s: smaller than one read\n", path);
+        return 3;
+    }
+
+    if (cold)
+        bdev_hint(dev, BDEV_HINT_DONTNEED, 0, 0);
+    bdev_hint(dev, random ? BDEV_HINT_RANDOM : BDEV_HINT_SEQUENTIAL, 0, 0);
+
+    /* aligned, so the direct backend can skip its bounce buffer */
+    if (posix_memalign((void **) &buf, 4096,
+                       (size_t) block_size * (depth ? depth : 1)))
+        return 4;
+
+    start = now();
+    if (depth)
+        bench_async(dev, buf, block_size, nblocks, random, depth);
+    else
+    {
+        for (i=0; i < nblocks; i++)
+        {
+            ret = bdev_pread(dev, buf, block_size,
+                             next_offset(i, nblocks, block_size, random));
+            if (ret < 0)
+                bench_errors++;
+            else
+                bench_bytes += ret;
+        }
+    }
+    t = now() - start;
+
+    printf("%s: %s %s %d byte reads%s: %.1f MB/s, %.0f reads/s",
+           path, dev->ops->name, random ? "random" : "sequential",
+           block_size, depth ? " async" : "",
+           bench_bytes / t / 1e6, nblocks / t);
+    if (bench_errors)
+        printf(", %d errors", bench_errors);
+    printf("\n");
+
+    free(buf);
+    talloc_free(dev);
+    return bench_errors ? 5 : 0;
+}
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <talloc.h>
+
+#include "bdev.h"
+#include "hash.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/*
+ * A content addressed block cache over another backend, shared by every
+ * dedup device in the process.  Devices are read in blocks, and each
+ * block read is kept in the store under a hash of its contents (the first
+ * 16 bytes of its BLAKE3 digest), so blocks with the same data in any
+ * number of images, or several times over in one, take the memory of one.
+ *
+ * Each device maps its blocks to hashes as it reads them; a block whose
+ * hash is known and still in the store is served from memory, whichever
+ * image it was read from.  With map=<file> the map is kept across runs,
+ * so that an image doesn't have to read a block once to find out that
+ * another image already brought the same data in.
+ *
+ * Arguments are comma separated: block=<bytes> (4096 by default),
+ * cache=<MB> bounds the store (the largest asked for by any device),
+ * map=<file> keeps the block map, and anything else is the backend the
+ * image is read through ("dedup:cache=512,map=a.map,mmap").
+ */
+#define DEDUP_MAGIC         "FSZOODDP"
+#define DEDUP_VERSION       1
+
+#define DEDUP_HASH_LEN      16
+#define DEDUP_BLOCK_SIZE    4096
+#define DEDUP_CACHE_MB      256
+
+/* misses are read from the device this many blocks at a time, at most */
+#define DEDUP_RUN_BLOCKS    32
+
+#define DEDUP_MIN_BUCKETS   1024
+
+/* a block's data, as kept in the store */
+struct dedup_block
+{
+    u8 hash[DEDUP_HASH_LEN];
+    u32 len;
+    int refs;
+    struct dedup_block *next;       /* hash chain */
+    struct dedup_block *lru_prev, *lru_next;
+    u8 data[];
+};
+
+/*
+ * The store, and every device's map, under one lock.  Unpinned blocks
+ * are on the LRU list and are freed from its head past max_bytes.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    struct dedup_block **buckets;
+    u32 mask;
+    u32 nblocks;
+    u64 bytes;
+    u64 max_bytes;
+    struct dedup_block *lru_head, *lru_tail;
+    int users;
+} store = { PTHREAD_MUTEX_INITIALIZER };
+
+/* on disk, little endian: the header, then a hash per block */
+struct dedup_header
+{
+    char magic[8];
+    u32 version;
+    u32 block_size;
+    u64 dev_size;
+    u64 mtime;              /* of the image, in ns */
+};
+
+struct bdev_dedup
+{
+    struct bdev *file;
+    u64 size;
+    u32 block_size;
+
+    /* a hash per block; all zero until the block has been read */
+    u8 (*map)[DEDUP_HASH_LEN];
+    u64 nblocks;
+    const char *map_path;
+    u64 mtime;
+    int dirty;
+    int open;               /* counted in store.users */
+
+    /* blocks served from the store, read, and read but already stored */
+    u64 hits;
+    u64 reads;
+    u64 dups;
+};
+
+static u32 dedup_bucket(const u8 *hash)
+{
+    u32 h;
+
+    memcpy(&h, hash, sizeof(h));
+    return h & store.mask;
+}
+
+static int dedup_known(const u8 *hash)
+{
+    static const u8 zero[DEDUP_HASH_LEN];
+
+    return memcmp(hash, zero, DEDUP_HASH_LEN) != 0;
+}
+
+static void dedup_hash(const u8 *data, size_t len, u8 *hash)
+{
+    struct hash_ctx ctx;
+    u8 digest[HASH_MAX_DIGEST];
+
+    hash_init(&ctx, &hash_blake3);
+    hash_update(&ctx, data, len);
+    hash_final(&ctx, digest);
+    memcpy(hash, digest, DEDUP_HASH_LEN);
+
+    /* all zero means unknown in the map; not going to happen, but */
+    if (!dedup_known(hash))
+        hash[0] = 1;
+}
+
+static void lru_unlink(struct dedup_block *b)
+{
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        store.lru_head = b->lru_next;
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        store.lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_append(struct dedup_block *b)
+{
+    b->lru_prev = store.lru_tail;
+    b->lru_next = NULL;
+    if (store.lru_tail)
+        store.lru_tail->lru_next = b;
+    else
+        store.lru_head = b;
+    store.lru_tail = b;
+}
+
+static struct dedup_block *store_find(const u8 *hash)
+{
+    struct dedup_block *b;
+
+    for (b = store.buckets[dedup_bucket(hash)]; b; b = b->next)
+        if (memcmp(b->hash, hash, DEDUP_HASH_LEN) == 0)
+            return b;
+    return NULL;
+}
+
+static void store_unlink(struct dedup_block *b)
+{
+    struct dedup_block **p = &store.buckets[dedup_bucket(b->hash)];
+
+    while (*p != b)
+        p = &(*p)->next;
+    *p = b->next;
+}
+
+static void store_evict(void)
+{
+    struct dedup_block *b;
+
+    while (store.bytes > store.max_bytes && (b = store.lru_head))
+    {
+        lru_unlink(b);
+        store_unlink(b);
+        store.bytes -= b->len;
+        store.nblocks--;
+        free(b);
+    }
+}
+
+/* double the buckets once there are as many blocks as buckets */
+static void store_grow(void)
+{
+    struct dedup_block **old = store.buckets, *b, *next;
+    u32 i, n = store.mask + 1;
+
+    store.buckets = calloc(n * 2, sizeof(*store.buckets));
+    if (!store.buckets)
+    {
+        store.buckets = old;
+        return;
+    }
+    store.mask = n * 2 - 1;
+
+    for (i=0; i < n; i++)
+        for (b = old[i]; b; b = next)
+        {
+            next = b->next;
+            b->next = store.buckets[dedup_bucket(b->hash)];
+            store.buckets[dedup_bucket(b->hash)] = b;
+        }
+    free(old);
+}
+
+/* the stored data for block blk, pinned, if it is there */
+static struct dedup_block *dedup_get(struct bdev_dedup *d, u64 blk)
+{
+    struct dedup_block *b = NULL;
+
+    pthread_mutex_lock(&store.lock);
+    if (dedup_known(d->map[blk]))
+        b = store_find(d->map[blk]);
+    if (b)
+    {
+        if (!b->refs++)
+            lru_unlink(b);
+        d->hits++;
+    }
+    pthread_mutex_unlock(&store.lock);
+    return b;
+}
+
+static void dedup_put(struct dedup_block *b)
+{
+    pthread_mutex_lock(&store.lock);
+    if (!--b->refs)
+    {
+        lru_append(b);
+        store_evict();
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+static int dedup_cached(struct bdev_dedup *d, u64 blk)
+{
+    int ret;
+
+    pthread_mutex_lock(&store.lock);
+    ret = dedup_known(d->map[blk]) && store_find(d->map[blk]);
+    pthread_mutex_unlock(&store.lock);
+    return ret;
+}
+
+/* a block just read from the device: map it, and store it unless it is */
+static void dedup_add(struct bdev_dedup *d, u64 blk, const u8 *data,
+                      u32 len)
+{
+    struct dedup_block *b;
+    u8 hash[DEDUP_HASH_LEN];
+    int stored;
+
+    dedup_hash(data, len, hash);
+
+    pthread_mutex_lock(&store.lock);
+    d->reads++;
+    if (memcmp(d->map[blk], hash, DEDUP_HASH_LEN))
+    {
+        memcpy(d->map[blk], hash, DEDUP_HASH_LEN);
+        d->dirty = 1;
+    }
+    stored = store_find(hash) != NULL;
+    if (stored)
+        d->dups++;
+    pthread_mutex_unlock(&store.lock);
+
+    if (stored)
+        return;
+
+    /* copied outside the lock, and looked for again after */
+    b = malloc(sizeof(*b) + len);
+    if (!b)
+        return;
+    memset(b, 0, sizeof(*b));
+    memcpy(b->hash, hash, DEDUP_HASH_LEN);
+    b->len = len;
+    memcpy(b->data, data, len);
+
+    pthread_mutex_lock(&store.lock);
+    if (store_find(hash))
+    {
+        pthread_mutex_unlock(&store.lock);
+        free(b);
+        return;
+    }
+    b->next = store.buckets[dedup_bucket(hash)];
+    store.buckets[dedup_bucket(hash)] = b;
+    lru_append(b);
+    store.bytes += len;
+    if (++store.nblocks > store.mask)
+        store_grow();
+    store_evict();
+    pthread_mutex_unlock(&store.lock);
+}
+
+/*
+ * Read run blocks from blk on, store them, and copy out the part from
+ * skip on that the caller wants, up to len bytes.  Returns the bytes
+ * copied or -errno.
+ */
+static ssize_t dedup_fill(struct bdev_dedup *d, u64 blk, u64 run,
+                          const struct iovec *iov, int iovcnt, size_t pos,
+                          size_t skip, size_t len)
+{
+    u64 off = blk * d->block_size;
+    size_t want = min((u64) run * d->block_size, d->size - off);
+    ssize_t ret;
+    u64 i;
+    u8 *buf;
+
+    buf = malloc(want);
+    if (!buf)
+        return -ENOMEM;
+
+    ret = bdev_pread(d->file, buf, want, off);
+    if (ret >= 0 && ret != want)
+        ret = -EIO;
+    if (ret < 0)
+    {
+        free(buf);
+        return ret;
+    }
+
+    for (i=0; i < run; i++)
+        dedup_add(d, blk + i, buf + i * d->block_size,
+                  min(d->block_size, want - i * d->block_size));
+
+    ret = min(want - skip, len);
+    bdev_iov_scatter(iov, iovcnt, pos, buf + skip, ret);
+    free(buf);
+    return ret;
+}
+
+static ssize_t dedup_readv(struct bdev *bdev, const struct iovec *iov,
+                           int iovcnt, u64 off)
+{
+    struct bdev_dedup *d = bdev->priv;
+    struct dedup_block *b;
+    size_t len, pos = 0, skip, n;
+    u64 blk, last, run;
+    ssize_t ret;
+
+    if (off >= d->size)
+        return 0;
+    len = min(bdev_iov_length(iov, iovcnt), d->size - off);
+    last = (off + len - 1) / d->block_size;
+
+    while (pos < len)
+    {
+        blk = (off + pos) / d->block_size;
+        skip = (off + pos) % d->block_size;
+
+        b = dedup_get(d, blk);
+        if (b)
+        {
+            n = min(b->len - skip, len - pos);
+            bdev_iov_scatter(iov, iovcnt, pos, b->data + skip, n);
+            dedup_put(b);
+            pos += n;
+            continue;
+        }
+
+        /* misses are read together, up to the next block in the store */
+        for (run=1; run < DEDUP_RUN_BLOCKS && blk + run <= last &&
+                    !dedup_cached(d, blk + run); run++)
+            ;
+
+        ret = dedup_fill(d, blk, run, iov, iovcnt, pos, skip, len - pos);
+        if (ret < 0)
+            return ret;
+        pos += ret;
+    }
+    return len;
+}
+
+static u64 dedup_mtime(struct bdev *bdev)
+{
+    struct stat st;
+
+    if (stat(bdev->path, &st))
+        return 0;
+    return (u64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+/* a map saved for this image as it is now, if there is one */
+static int dedup_load_map(struct bdev_dedup *d)
+{
+    struct dedup_header hdr;
+    FILE *fp = fopen(d->map_path, "r");
+    int err = 0;
+
+    if (!fp)
+        return -errno;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, DEDUP_MAGIC, sizeof(hdr.magic)) ||
+        le32_to_cpu(hdr.version) != DEDUP_VERSION ||
+        le32_to_cpu(hdr.block_size) != d->block_size ||
+        le64_to_cpu(hdr.dev_size) != d->size ||
+        le64_to_cpu(hdr.mtime) != d->mtime ||
+        fread(d->map, DEDUP_HASH_LEN, d->nblocks, fp) != d->nblocks)
+    {
+        memset(d->map, 0, d->nblocks * DEDUP_HASH_LEN);
+        err = -EINVAL;
+    }
+
+    fclose(fp);
+    return err;
+}
+
+static int dedup_save_map(struct bdev_dedup *d)
+{
+    struct dedup_header hdr = { DEDUP_MAGIC };
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", d->map_path);
+    FILE *fp = fopen(tmp, "w");
+    int err = 0;
+
+    if (!fp)
+    {
+        talloc_free(tmp);
+        return -errno;
+    }
+
+    hdr.version = cpu_to_le32(DEDUP_VERSION);
+    hdr.block_size = cpu_to_le32(d->block_size);
+    hdr.dev_size = cpu_to_le64(d->size);
+    hdr.mtime = cpu_to_le64(d->mtime);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(d->map, DEDUP_HASH_LEN, d->nblocks, fp);
+
+    if (ferror(fp))
+        err = -EIO;
+    if (fclose(fp) && !err)
+        err = -errno;
+
+    if (!err && rename(tmp, d->map_path))
+        err = -errno;
+    if (err)
+        unlink(tmp);
+    talloc_free(tmp);
+    return err;
+}
+
+static int dedup_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_dedup *d = talloc_zero(bdev, struct bdev_dedup);
+    char *opts, *opt, *save;
+    char *lower = NULL;
+    u64 max_bytes = (u64) DEDUP_CACHE_MB << 20;
+
+    bdev->priv = d;
+    d->block_size = DEDUP_BLOCK_SIZE;
+
+    opts = talloc_strdup(d, args ? args : "");
+    for (opt = strtok_r(opts, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save))
+    {
+        if (strncmp(opt, "block=", 6) == 0)
+            d->block_size = atoi(opt + 6);
+        else if (strncmp(opt, "cache=", 6) == 0)
+            max_bytes = strtoull(opt + 6, NULL, 0) << 20;
+        else if (strncmp(opt, "map=", 4) == 0)
+            d->map_path = opt + 4;
+        else if (strncmp(opt, "dedup", 5) == 0)
+            return -EINVAL;
+        else
+            lower = opt;
+    }
+
+    if (d->block_size < 512 || d->block_size > (16 << 20))
+        return -EINVAL;
+
+    d->file = bdev_open(d, bdev->path, lower);
+    if (!d->file)
+        return -errno;
+
+    d->size = bdev_size(d->file);
+    d->nblocks = (d->size + d->block_size - 1) / d->block_size;
+    d->map = talloc_zero_size(d, max(d->nblocks, 1) * DEDUP_HASH_LEN);
+    if (!d->map)
+        return -ENOMEM;
+
+    if (d->map_path)
+    {
+        d->mtime = dedup_mtime(bdev);
+        dedup_load_map(d);
+    }
+
+    pthread_mutex_lock(&store.lock);
+    if (!store.buckets)
+    {
+        store.buckets = calloc(DEDUP_MIN_BUCKETS, sizeof(*store.buckets));
+        store.mask = DEDUP_MIN_BUCKETS - 1;
+    }
+    store.max_bytes = max(store.max_bytes, max_bytes);
+    if (store.buckets)
+    {
+        store.users++;
+        d->open = 1;
+    }
+    pthread_mutex_unlock(&store.lock);
+
+    return d->open ? 0 : -ENOMEM;
+}
+
+static u64 dedup_size(struct bdev *bdev)
+{
+    struct bdev_dedup *d = bdev->priv;
+
+    return d->size;
+}
+
+static void dedup_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    struct bdev_dedup *d = bdev->priv;
+
+    bdev_hint(d->file, hint, off, len);
+}
+
+static void dedup_close(struct bdev *bdev)
+{
+    struct bdev_dedup *d = bdev->priv;
+    struct dedup_block *b, *next;
+    u32 i;
+
+    if (!d || !d->open)
+        return;
+
+    if (d->map_path && d->dirty && dedup_save_map(d))
+        fprintf(stderr, "dedup: could not save %s\n", d->map_path);
+
+    pthread_mutex_lock(&store.lock);
+    fprintf(stderr, "dedup: %s: %llu blocks from the store, %llu read "
+            "(%llu already stored); %llu MB stored in all\n", bdev->path,
+            (unsigned long long) d->hits, (unsigned long long) d->reads,
+            (unsigned long long) d->dups,
+            (unsigned long long) store.bytes >> 20);
+
+    /* the last one out frees the store */
+    if (!--store.users)
+    {
+        for (i=0; i <= store.mask; i++)
+            for (b = store.buckets[i]; b; b = next)
+            {
+                next = b->next;
+                free(b);
+            }
+        free(store.buckets);
+        store.buckets = NULL;
+        store.lru_head = store.lru_tail = NULL;
+        store.nblocks = 0;
+        store.bytes = 0;
+        store.max_bytes = 0;
+    }
+    pthread_mutex_unlock(&store.lock);
+}
+
+const struct bdev_ops bdev_dedup_ops = {
+    .name = "dedup",
+    .help = "content addressed cache shared across images "
+            "[block=<bytes>,cache=<MB>,map=<file>,<backend>]",
+    .open = dedup_open,
+    .readv = dedup_readv,
+    .size = dedup_size,
+    .hint = dedup_hint,
+    .close = dedup_close,
+};
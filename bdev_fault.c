@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "bdev.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/*
+ * A slow, unreliable disk for testing, over another backend: reads are
+ * delayed as a configured device would delay them, and some fail.  The
+ * data itself comes from the backend beneath as usual.
+ *
+ * Arguments are comma separated: conf=<file> names the configuration,
+ * and anything else is the backend beneath ("fault:conf=hdd.conf,mmap").
+ * The configuration has a setting per line, # for comments:
+ *
+ *  latency fixed <us>              every read takes this long
+ *  latency uniform <min> <max>     evenly spread, in us
+ *  latency pareto <min> <alpha>    long tailed: rarely many times min
+ *  latency_max <us>                pareto is cut off here (1s)
+ *  seek <us>                       added when a read doesn't follow on
+ *                                  from the one before
+ *  bandwidth <MB/s>                transfers share this between them
+ *  queue_depth <n>                 reads in flight at once, at most
+ *  eio <probability>               reads that fail with EIO
+ *  short <probability>             reads that come back short
+ *  seed <n>                        for repeatable runs
+ *
+ * Latency and seeking happen in parallel up to the queue depth; the
+ * transfers after them are serialised at the bandwidth.
+ */
+#define FAULT_LATENCY_MAX_US    1000000
+
+enum
+{
+    FAULT_LAT_NONE,
+    FAULT_LAT_FIXED,
+    FAULT_LAT_UNIFORM,
+    FAULT_LAT_PARETO,
+};
+
+struct bdev_fault
+{
+    struct bdev *file;
+
+    /* the configuration */
+    int lat_kind;
+    double lat_a, lat_b;
+    u64 lat_max;            /* ns */
+    u64 seek;               /* ns */
+    u64 bandwidth;          /* bytes per second */
+    int queue_depth;
+    double eio;
+    double shrt;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    u64 rng;
+    int inflight;
+    u64 next_off;           /* where the last read ended */
+    u64 bus_free;           /* when the last transfer ends */
+
+    /* what happened */
+    u64 reads;
+    u64 bytes;
+    u64 delay;              /* ns, summed */
+    u64 eios;
+    u64 shorts;
+};
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(u64 t)
+{
+    struct timespec ts = { t / 1000000000, t % 1000000000 };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+/* uniform in [0, 1), xorshift64*; under f->lock */
+static double fault_random(struct bdev_fault *f)
+{
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return ((f->rng * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* the device's own latency for one read, in ns */
+static u64 fault_latency(struct bdev_fault *f)
+{
+    double us = 0;
+
+    switch (f->lat_kind)
+    {
+        case FAULT_LAT_FIXED:
+            us = f->lat_a;
+            break;
+        case FAULT_LAT_UNIFORM:
+            us = f->lat_a + (f->lat_b - f->lat_a) * fault_random(f);
+            break;
+        case FAULT_LAT_PARETO:
+            us = f->lat_a / pow(1 - fault_random(f), 1 / f->lat_b);
+            break;
+    }
+    return min((u64) (us * 1000), f->lat_max);
+}
+
+static ssize_t fault_readv(struct bdev *bdev, const struct iovec *iov,
+                           int iovcnt, u64 off)
+{
+    struct bdev_fault *f = bdev->priv;
+    size_t len = bdev_iov_length(iov, iovcnt);
+    u64 start, done, xfer;
+    int eio, shrt;
+    double cut = 0;
+    ssize_t ret;
+
+    pthread_mutex_lock(&f->lock);
+    while (f->queue_depth && f->inflight >= f->queue_depth)
+        pthread_cond_wait(&f->cond, &f->lock);
+    f->inflight++;
+
+    start = now_ns();
+    done = start + fault_latency(f);
+    if (off != f->next_off)
+        done += f->seek;
+    f->next_off = off + len;
+
+    /* the transfer waits for the bus, and holds it for its length */
+    if (f->bandwidth)
+    {
+        xfer = (u64) len * 1000000000 / f->bandwidth;
+        done = max(done, f->bus_free) + xfer;
+        f->bus_free = done;
+    }
+
+    eio = fault_random(f) < f->eio;
+    shrt = !eio && fault_random(f) < f->shrt;
+    if (shrt)
+        cut = fault_random(f);
+
+    f->reads++;
+    f->delay += done - start;
+    f->eios += eio;
+    f->shorts += shrt;
+    pthread_mutex_unlock(&f->lock);
+
+    ret = eio ? -EIO : bdev_readv(f->file, iov, iovcnt, off);
+    if (shrt && ret > 1)
+        ret = max(1, (ssize_t) (ret * cut));
+
+    sleep_until(done);
+
+    pthread_mutex_lock(&f->lock);
+    f->inflight--;
+    if (ret > 0)
+        f->bytes += ret;
+    pthread_cond_signal(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+}
+
+static int fault_config(struct bdev_fault *f, const char *path)
+{
+    char line[256], *key, *a, *b, *save;
+    FILE *fp = fopen(path, "r");
+    int n = 0, err = 0;
+
+    if (!fp)
+        return -errno;
+
+    while (!err && fgets(line, sizeof(line), fp))
+    {
+        n++;
+        line[strcspn(line, "#\n")] = 0;
+        key = strtok_r(line, " \t", &save);
+        if (!key)
+            continue;
+        a = strtok_r(NULL, " \t", &save);
+        b = a ? strtok_r(NULL, " \t", &save) : NULL;
+
+        if (strcmp(key, "latency") == 0 && a && b)
+        {
+            f->lat_a = atof(b);
+            b = strtok_r(NULL, " \t", &save);
+            if (strcmp(a, "fixed") == 0)
+                f->lat_kind = FAULT_LAT_FIXED;
+            else if (strcmp(a, "uniform") == 0 && b)
+                f->lat_kind = FAULT_LAT_UNIFORM;
+            else if (strcmp(a, "pareto") == 0 && b && atof(b) > 0)
+                f->lat_kind = FAULT_LAT_PARETO;
+            else
+                err = -EINVAL;
+            f->lat_b = b ? atof(b) : 0;
+        }
+        else if (strcmp(key, "latency_max") == 0 && a)
+            f->lat_max = strtoull(a, NULL, 0) * 1000;
+        else if (strcmp(key, "seek") == 0 && a)
+            f->seek = strtoull(a, NULL, 0) * 1000;
+        else if (strcmp(key, "bandwidth") == 0 && a)
+            f->bandwidth = atof(a) * (1 << 20);
+        else if (strcmp(key, "queue_depth") == 0 && a)
+            f->queue_depth = atoi(a);
+        else if (strcmp(key, "eio") == 0 && a)
+            f->eio = atof(a);
+        else if (strcmp(key, "short") == 0 && a)
+            f->shrt = atof(a);
+        else if (strcmp(key, "seed") == 0 && a)
+            f->rng = strtoull(a, NULL, 0);
+        else
+            err = -EINVAL;
+    }
+
+    if (err)
+        fprintf(stderr, "fault: %s:%d: not understood\n", path, n);
+    fclose(fp);
+    return err;
+}
+
+static int fault_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_fault *f = talloc_zero(bdev, struct bdev_fault);
+    char *opts, *opt, *save;
+    char *lower = NULL;
+    int err;
+
+    bdev->priv = f;
+    f->lat_max = (u64) FAULT_LATENCY_MAX_US * 1000;
+    f->rng = now_ns();
+    f->next_off = ~0ULL;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+
+    opts = talloc_strdup(f, args ? args : "");
+    for (opt = strtok_r(opts, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save))
+    {
+        if (strncmp(opt, "conf=", 5) == 0)
+        {
+            err = fault_config(f, opt + 5);
+            if (err)
+                return err;
+        }
+        else if (strncmp(opt, "fault", 5) == 0)
+            return -EINVAL;
+        else
+            lower = opt;
+    }
+
+    /* xorshift sticks at zero */
+    if (!f->rng)
+        f->rng = 1;
+
+    f->file = bdev_open(f, bdev->path, lower);
+    if (!f->file)
+        return -errno;
+    return 0;
+}
+
+static u64 fault_size(struct bdev *bdev)
+{
+    struct bdev_fault *f = bdev->priv;
+
+    return bdev_size(f->file);
+}
+
+static void fault_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    struct bdev_fault *f = bdev->priv;
+
+    bdev_hint(f->file, hint, off, len);
+}
+
+static void fault_close(struct bdev *bdev)
+{
+    struct bdev_fault *f = bdev->priv;
+
+    if (!f || !f->file)
+        return;
+
+    fprintf(stderr, "fault: %llu reads, %llu MB, %.2f ms added on average, "
+            "%llu EIO, %llu short\n", (unsigned long long) f->reads,
+            (unsigned long long) f->bytes >> 20,
+            f->reads ? f->delay / 1e6 / f->reads : 0.0,
+            (unsigned long long) f->eios, (unsigned long long) f->shorts);
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+}
+
+const struct bdev_ops bdev_fault_ops = {
+    .name = "fault",
+    .help = "slow and failing reads, for testing [conf=<file>,<backend>]",
+    .open = fault_open,
+    .readv = fault_readv,
+    .size = fault_size,
+    .hint = fault_hint,
+    .close = fault_close,
+};
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <talloc.h>
+
+#include "bdev.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+/*
+ * Android sparse images, as written by img2simg and friends: a file
+ * header, then chunks which are each raw data, a 32 bit fill pattern,
+ * "don't care" (unwritten, read as zeros) or a CRC of what came before.
+ * The chunks are indexed once at open and reads are served from the
+ * index: raw chunks from the file beneath, everything else from memory.
+ */
+#define SPARSE_MAGIC            0xed26ff3a
+#define SPARSE_MAJOR_VERSION    1
+
+#define CHUNK_TYPE_RAW          0xcac1
+#define CHUNK_TYPE_FILL         0xcac2
+#define CHUNK_TYPE_DONT_CARE    0xcac3
+#define CHUNK_TYPE_CRC32        0xcac4
+
+struct sparse_header
+{
+    u32 magic;
+    u16 major_version;
+    u16 minor_version;
+    u16 file_hdr_sz;
+    u16 chunk_hdr_sz;
+    u32 blk_sz;
+    u32 total_blks;
+    u32 total_chunks;
+    u32 image_checksum;
+};
+
+struct sparse_chunk_header
+{
+    u16 chunk_type;
+    u16 reserved1;
+    u32 chunk_sz;           /* in blocks */
+    u32 total_sz;           /* in bytes, header included */
+};
+
+struct sparse_chunk
+{
+    u64 start;              /* image offset */
+    u64 len;
+    int type;
+    union {
+        u64 file_off;       /* raw */
+        u32 fill;           /* fill */
+    };
+};
+
+struct bdev_sparse
+{
+    struct bdev *file;
+    u64 size;
+    struct sparse_chunk *chunks;
+    u32 nchunks;
+};
+
+static int sparse_index(struct bdev_sparse *s)
+{
+    struct sparse_header hdr;
+    struct sparse_chunk_header ch;
+    struct sparse_chunk *c;
+    u64 pos, blk = 0;
+    u32 data_sz, fill;
+    int i;
+
+    if (bdev_pread(s->file, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        le32_to_cpu(hdr.magic) != SPARSE_MAGIC ||
+        le16_to_cpu(hdr.major_version) != SPARSE_MAJOR_VERSION ||
+        le16_to_cpu(hdr.file_hdr_sz) < sizeof(hdr) ||
+        le16_to_cpu(hdr.chunk_hdr_sz) < sizeof(ch) ||
+        !le32_to_cpu(hdr.blk_sz) || le32_to_cpu(hdr.blk_sz) % 4)
+        return -EINVAL;
+
+    s->size = (u64) le32_to_cpu(hdr.total_blks) * le32_to_cpu(hdr.blk_sz);
+    s->chunks = talloc_array(s, struct sparse_chunk,
+                             le32_to_cpu(hdr.total_chunks) + 1);
+    pos = le16_to_cpu(hdr.file_hdr_sz);
+
+    for (i=0; i < le32_to_cpu(hdr.total_chunks); i++)
+    {
+        if (bdev_pread(s->file, &ch, sizeof(ch), pos) != sizeof(ch))
+            return -EINVAL;
+
+        if (le32_to_cpu(ch.total_sz) < le16_to_cpu(hdr.chunk_hdr_sz))
+            return -EINVAL;
+        pos += le16_to_cpu(hdr.chunk_hdr_sz);
+        data_sz = le32_to_cpu(ch.total_sz) - le16_to_cpu(hdr.chunk_hdr_sz);
+
+        c = &s->chunks[s->nchunks];
+        c->start = blk * le32_to_cpu(hdr.blk_sz);
+        c->len = (u64) le32_to_cpu(ch.chunk_sz) * le32_to_cpu(hdr.blk_sz);
+        c->type = le16_to_cpu(ch.chunk_type);
+
+        switch (c->type)
+        {
+            case CHUNK_TYPE_RAW:
+                if (data_sz != c->len)
+                    return -EINVAL;
+                c->file_off = pos;
+                break;
+            case CHUNK_TYPE_FILL:
+                if (data_sz != sizeof(fill) ||
+                    bdev_pread(s->file, &fill, sizeof(fill), pos) !=
+                    sizeof(fill))
+                    return -EINVAL;
+                c->fill = fill;
+                break;
+            case CHUNK_TYPE_DONT_CARE:
+                if (data_sz)
+                    return -EINVAL;
+                break;
+            case CHUNK_TYPE_CRC32:
+                /* covers no blocks; we don't check it */
+                pos += data_sz;
+                continue;
+            default:
+                return -EINVAL;
+        }
+
+        pos += data_sz;
+        blk += le32_to_cpu(ch.chunk_sz);
+        if (c->len)
+            s->nchunks++;
+    }
+
+    if (blk > le32_to_cpu(hdr.total_blks))
+        return -EINVAL;
+
+    /* anything the chunks stop short of was never written */
+    if (blk < le32_to_cpu(hdr.total_blks))
+    {
+        c = &s->chunks[s->nchunks++];
+        c->start = blk * le32_to_cpu(hdr.blk_sz);
+        c->len = s->size - c->start;
+        c->type = CHUNK_TYPE_DONT_CARE;
+    }
+    return 0;
+}
+
+static int sparse_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_sparse *s = talloc_zero(bdev, struct bdev_sparse);
+
+    bdev->priv = s;
+
+    /* the sparse file itself is read through another backend */
+    if (args && strncmp(args, "sparse", 6) == 0)
+        return -EINVAL;
+    s->file = bdev_open(s, bdev->path, args);
+    if (!s->file)
+        return -errno;
+
+    return sparse_index(s);
+}
+
+/* the last chunk starting at or before off */
+static struct sparse_chunk *sparse_find(struct bdev_sparse *s, u64 off)
+{
+    u32 lo = 0, hi = s->nchunks;
+    u32 mid;
+
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (s->chunks[mid].start <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &s->chunks[lo];
+}
+
+/* fill with the pattern as it lies at image offset off */
+static void sparse_fill(struct iovec *iov, int iovcnt, u32 fill, u64 off)
+{
+    u8 pattern[4];
+    size_t i;
+    int k;
+
+    memcpy(pattern, &fill, sizeof(pattern));
+
+    for (k=0; k < iovcnt; k++)
+    {
+        u8 *p = iov[k].iov_base;
+
+        if (!fill)
+            memset(p, 0, iov[k].iov_len);
+        else
+            for (i=0; i < iov[k].iov_len; i++)
+                p[i] = pattern[(off + i) & 3];
+        off += iov[k].iov_len;
+    }
+}
+
+static ssize_t sparse_readv(struct bdev *bdev, const struct iovec *iov,
+                            int iovcnt, u64 off)
+{
+    struct bdev_sparse *s = bdev->priv;
+    struct iovec slice[IOV_MAX];
+    struct sparse_chunk *c;
+    size_t len, pos = 0, n;
+    ssize_t ret;
+    int nslice;
+
+    if (off >= s->size)
+        return 0;
+    len = min(bdev_iov_length(iov, iovcnt), s->size - off);
+
+    while (pos < len)
+    {
+        c = sparse_find(s, off + pos);
+        n = min(len - pos, c->start + c->len - (off + pos));
+
+        nslice = bdev_iov_slice(iov, iovcnt, pos, n, slice, IOV_MAX);
+        if (nslice < 0)
+            return -EINVAL;
+
+        switch (c->type)
+        {
+            case CHUNK_TYPE_RAW:
+                ret = bdev_readv(s->file, slice, nslice,
+                                 c->file_off + off + pos - c->start);
+                if (ret < 0)
+                    return ret;
+                if (ret != n)
+                    return -EIO;
+                break;
+            case CHUNK_TYPE_FILL:
+                sparse_fill(slice, nslice, c->fill, off + pos);
+                break;
+            default:
+                sparse_fill(slice, nslice, 0, off + pos);
+                break;
+        }
+        pos += n;
+    }
+    return len;
+}
+
+static u64 sparse_size(struct bdev *bdev)
+{
+    struct bdev_sparse *s = bdev->priv;
+
+    return s->size;
+}
+
+/* hints on a range pass down to the raw chunks it covers */
+static void sparse_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    struct bdev_sparse *s = bdev->priv;
+    struct sparse_chunk *c;
+    u64 end, from, to;
+
+    if (hint == BDEV_HINT_NORMAL || hint == BDEV_HINT_SEQUENTIAL ||
+        hint == BDEV_HINT_RANDOM)
+    {
+        bdev_hint(s->file, hint, 0, 0);
+        return;
+    }
+
+    end = len ? min(off + len, s->size) : s->size;
+    for (c = sparse_find(s, off); c < s->chunks + s->nchunks &&
+                                  c->start < end; c++)
+    {
+        if (c->type != CHUNK_TYPE_RAW)
+            continue;
+        from = off > c->start ? off - c->start : 0;
+        to = min(end - c->start, c->len);
+        bdev_hint(s->file, hint, c->file_off + from, to - from);
+    }
+}
+
+const struct bdev_ops bdev_sparse_ops = {
+    .name = "sparse",
+    .help = "Android sparse image [<backend> beneath]",
+    .open = sparse_open,
+    .readv = sparse_readv,
+    .size = sparse_size,
+    .hint = sparse_hint,
+};
@@ -0,0 +1,527 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <talloc.h>
+#include <zstd.h>
+
+#include "bdev.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+
+/*
+ * Images compressed in the zstd seekable format: independent zstd frames
+ * followed by a skippable frame holding a table of every frame's
+ * compressed and decompressed size.  Frames are decompressed on demand
+ * into a bounded cache; sequential reads have the frames after them
+ * decompressed ahead on the background threads.
+ *
+ * Arguments are comma separated: cache=<MB> bounds the cache, ra=<frames>
+ * sets the read ahead, and anything else is the backend the compressed
+ * file is read through ("zstd:cache=256,mmap").
+ */
+#define ZSTD_SEEKABLE_MAGIC     0x8f92eab1
+#define ZSTD_SKIPPABLE_MAGIC    0x184d2a5e
+#define ZSTD_SEEK_FOOTER_SIZE   9
+#define ZSTD_SEEK_CHECKSUM_FL   0x80
+
+#define ZSTD_CACHE_MB           64
+#define ZSTD_READAHEAD          4
+
+struct zstd_frame
+{
+    u64 comp_off;
+    u64 off;
+    u32 comp_len;
+    u32 len;
+};
+
+enum
+{
+    FRAME_LOADING,
+    FRAME_READY,
+    FRAME_FAILED,
+};
+
+struct zstd_cached
+{
+    u32 frame;
+    int refs;
+    int state;
+    struct zstd_cached *lru_prev, *lru_next;
+    u8 data[];
+};
+
+struct bdev_zstd
+{
+    struct bdev *file;
+    struct zstd_frame *frames;
+    u32 nframes;
+    u64 size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct zstd_cached **cached;    /* by frame */
+    u64 cached_bytes;
+    u64 max_bytes;
+    /* unpinned frames, least recently used first */
+    struct zstd_cached *lru_head, *lru_tail;
+
+    /* read ahead */
+    int readahead;
+    u32 last_frame;
+    u32 ra_next;
+    int jobs;
+};
+
+struct zstd_job
+{
+    struct bdev_work work;
+    struct bdev_zstd *z;
+    u32 frame;
+};
+
+/* one decompression context per thread */
+static pthread_key_t dctx_key;
+static pthread_once_t dctx_once = PTHREAD_ONCE_INIT;
+
+static void dctx_free(void *dctx)
+{
+    ZSTD_freeDCtx(dctx);
+}
+
+static void dctx_init(void)
+{
+    pthread_key_create(&dctx_key, dctx_free);
+}
+
+static ZSTD_DCtx *zstd_dctx(void)
+{
+    ZSTD_DCtx *dctx;
+
+    pthread_once(&dctx_once, dctx_init);
+    dctx = pthread_getspecific(dctx_key);
+    if (!dctx)
+    {
+        dctx = ZSTD_createDCtx();
+        pthread_setspecific(dctx_key, dctx);
+    }
+    return dctx;
+}
+
+static int zstd_read_seek_table(struct bdev_zstd *z)
+{
+    u64 fsize = bdev_size(z->file);
+    u8 footer[ZSTD_SEEK_FOOTER_SIZE];
+    u32 magic, len, entry_size;
+    u64 table_size, comp_off = 0, off = 0;
+    u8 *table, *e;
+    int i;
+
+    if (fsize < ZSTD_SEEK_FOOTER_SIZE + 8 ||
+        bdev_pread(z->file, footer, sizeof(footer),
+                   fsize - sizeof(footer)) != sizeof(footer))
+        return -EINVAL;
+
+    memcpy(&magic, footer + 5, 4);
+    if (le32_to_cpu(magic) != ZSTD_SEEKABLE_MAGIC || (footer[4] & 0x7c))
+        return -EINVAL;
+
+    memcpy(&z->nframes, footer, 4);
+    z->nframes = le32_to_cpu(z->nframes);
+    entry_size = footer[4] & ZSTD_SEEK_CHECKSUM_FL ? 12 : 8;
+    table_size = (u64) z->nframes * entry_size + ZSTD_SEEK_FOOTER_SIZE;
+    if (table_size + 8 > fsize)
+        return -EINVAL;
+
+    /* the table is the payload of a skippable frame */
+    table = talloc_size(z, table_size + 8);
+    if (!table || bdev_pread(z->file, table, table_size + 8,
+                             fsize - table_size - 8) != table_size + 8)
+        return -EINVAL;
+
+    memcpy(&magic, table, 4);
+    memcpy(&len, table + 4, 4);
+    if (le32_to_cpu(magic) != ZSTD_SKIPPABLE_MAGIC ||
+        le32_to_cpu(len) != table_size)
+        return -EINVAL;
+
+    z->frames = talloc_array(z, struct zstd_frame, z->nframes + 1);
+    for (i=0; i < z->nframes; i++)
+    {
+        e = table + 8 + (size_t) i * entry_size;
+        memcpy(&z->frames[i].comp_len, e, 4);
+        memcpy(&z->frames[i].len, e + 4, 4);
+        z->frames[i].comp_len = le32_to_cpu(z->frames[i].comp_len);
+        z->frames[i].len = le32_to_cpu(z->frames[i].len);
+        z->frames[i].comp_off = comp_off;
+        z->frames[i].off = off;
+        comp_off += z->frames[i].comp_len;
+        off += z->frames[i].len;
+    }
+    talloc_free(table);
+
+    if (comp_off > fsize - table_size - 8)
+        return -EINVAL;
+
+    /* a sentinel, so the search never runs off the end */
+    z->frames[i].comp_off = comp_off;
+    z->frames[i].off = off;
+    z->frames[i].comp_len = z->frames[i].len = 0;
+    z->size = off;
+    return 0;
+}
+
+static int zstd_open(struct bdev *bdev, const char *args)
+{
+    struct bdev_zstd *z = talloc_zero(bdev, struct bdev_zstd);
+    char *opts, *opt, *save;
+    char *lower = NULL;
+    int err;
+
+    bdev->priv = z;
+    z->max_bytes = (u64) ZSTD_CACHE_MB << 20;
+    z->readahead = ZSTD_READAHEAD;
+    pthread_mutex_init(&z->lock, NULL);
+    pthread_cond_init(&z->cond, NULL);
+
+    opts = talloc_strdup(z, args ? args : "");
+    for (opt = strtok_r(opts, ",", &save); opt;
+         opt = strtok_r(NULL, ",", &save))
+    {
+        if (strncmp(opt, "cache=", 6) == 0)
+            z->max_bytes = strtoull(opt + 6, NULL, 0) << 20;
+        else if (strncmp(opt, "ra=", 3) == 0)
+            z->readahead = atoi(opt + 3);
+        else if (strncmp(opt, "zstd", 4) == 0)
+            return -EINVAL;
+        else
+            lower = opt;
+    }
+
+    z->file = bdev_open(z, bdev->path, lower);
+    if (!z->file)
+        return -errno;
+
+    err = zstd_read_seek_table(z);
+    if (err)
+        return err;
+
+    z->cached = talloc_zero_array(z, struct zstd_cached *, z->nframes);
+    z->last_frame = ~0;
+    return 0;
+}
+
+static void lru_remove(struct bdev_zstd *z, struct zstd_cached *c)
+{
+    if (c->lru_prev)
+        c->lru_prev->lru_next = c->lru_next;
+    else
+        z->lru_head = c->lru_next;
+    if (c->lru_next)
+        c->lru_next->lru_prev = c->lru_prev;
+    else
+        z->lru_tail = c->lru_prev;
+    c->lru_prev = c->lru_next = NULL;
+}
+
+static void zstd_drop(struct bdev_zstd *z, struct zstd_cached *c)
+{
+    z->cached[c->frame] = NULL;
+    z->cached_bytes -= z->frames[c->frame].len;
+    free(c);
+}
+
+static int zstd_decompress(struct bdev_zstd *z, struct zstd_cached *c)
+{
+    struct zstd_frame *f = &z->frames[c->frame];
+    ZSTD_DCtx *dctx = zstd_dctx();
+    size_t ret;
+    u8 *comp;
+
+    comp = malloc(f->comp_len);
+    if (!comp || !dctx ||
+        bdev_pread(z->file, comp, f->comp_len, f->comp_off) != f->comp_len)
+    {
+        free(comp);
+        return -EIO;
+    }
+
+    ret = ZSTD_decompressDCtx(dctx, c->data, f->len, comp, f->comp_len);
+    free(comp);
+
+    return ZSTD_isError(ret) || ret != f->len ? -EIO : 0;
+}
+
+/*
+ * Frame f, decompressed and pinned, or NULL if it could not be.  A frame
+ * being decompressed by another thread is waited for rather than done
+ * twice.  With ahead set a frame that is already there is left alone.
+ */
+static struct zstd_cached *zstd_get(struct bdev_zstd *z, u32 f, int ahead)
+{
+    struct zstd_cached *c;
+    int state;
+
+    pthread_mutex_lock(&z->lock);
+    c = z->cached[f];
+    if (c)
+    {
+        if (ahead)
+        {
+            pthread_mutex_unlock(&z->lock);
+            return NULL;
+        }
+
+        if (!c->refs++ && c->state == FRAME_READY)
+            lru_remove(z, c);
+        while (c->state == FRAME_LOADING)
+            pthread_cond_wait(&z->cond, &z->lock);
+        pthread_mutex_unlock(&z->lock);
+        return c;
+    }
+
+    /* make room: whatever is unpinned goes, oldest first */
+    while (z->lru_head &&
+           z->cached_bytes + z->frames[f].len > z->max_bytes)
+    {
+        c = z->lru_head;
+        lru_remove(z, c);
+        zstd_drop(z, c);
+    }
+
+    c = malloc(sizeof(*c) + z->frames[f].len);
+    if (!c)
+    {
+        pthread_mutex_unlock(&z->lock);
+        return NULL;
+    }
+    memset(c, 0, sizeof(*c));
+    c->frame = f;
+    c->refs = 1;
+    c->state = FRAME_LOADING;
+    z->cached[f] = c;
+    z->cached_bytes += z->frames[f].len;
+    pthread_mutex_unlock(&z->lock);
+
+    state = zstd_decompress(z, c) ? FRAME_FAILED : FRAME_READY;
+
+    pthread_mutex_lock(&z->lock);
+    c->state = state;
+    pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    return c;
+}
+
+static void zstd_put(struct bdev_zstd *z, struct zstd_cached *c)
+{
+    pthread_mutex_lock(&z->lock);
+    if (!--c->refs)
+    {
+        /* failed frames are forgotten, so a later read tries again */
+        if (c->state == FRAME_FAILED)
+            zstd_drop(z, c);
+        else
+        {
+            c->lru_prev = z->lru_tail;
+            if (z->lru_tail)
+                z->lru_tail->lru_next = c;
+            else
+                z->lru_head = c;
+            z->lru_tail = c;
+        }
+    }
+    pthread_mutex_unlock(&z->lock);
+}
+
+static void zstd_ahead_work(struct bdev_work *work)
+{
+    struct zstd_job *job = (struct zstd_job *) work;
+    struct bdev_zstd *z = job->z;
+    struct zstd_cached *c;
+
+    c = zstd_get(z, job->frame, 1);
+    if (c)
+        zstd_put(z, c);
+
+    pthread_mutex_lock(&z->lock);
+    if (!--z->jobs)
+        pthread_cond_broadcast(&z->cond);
+    pthread_mutex_unlock(&z->lock);
+    free(job);
+}
+
+/* decompress frames f..end-1 in the background */
+static void zstd_queue(struct bdev_zstd *z, u32 f, u32 end)
+{
+    struct zstd_job *job;
+
+    for (; f < end; f++)
+    {
+        job = malloc(sizeof(*job));
+        if (!job)
+            break;
+        job->work.fn = zstd_ahead_work;
+        job->z = z;
+        job->frame = f;
+
+        pthread_mutex_lock(&z->lock);
+        z->jobs++;
+        pthread_mutex_unlock(&z->lock);
+
+        if (bdev_queue_work(&job->work))
+        {
+            pthread_mutex_lock(&z->lock);
+            z->jobs--;
+            pthread_mutex_unlock(&z->lock);
+            free(job);
+            break;
+        }
+    }
+}
+
+/* after a sequential read ending in frame last, start on what follows */
+static void zstd_read_ahead(struct bdev_zstd *z, u32 first, u32 last)
+{
+    u32 f, end;
+
+    pthread_mutex_lock(&z->lock);
+    if (first != z->last_frame && first != z->last_frame + 1)
+    {
+        z->last_frame = last;
+        z->ra_next = last + 1;
+        pthread_mutex_unlock(&z->lock);
+        return;
+    }
+    z->last_frame = last;
+
+    end = min((u64) last + 1 + z->readahead, z->nframes);
+    f = max(z->ra_next, last + 1);
+    z->ra_next = max(f, end);
+    pthread_mutex_unlock(&z->lock);
+
+    zstd_queue(z, f, end);
+}
+
+/* the frame holding image offset off */
+static u32 zstd_find(struct bdev_zstd *z, u64 off)
+{
+    u32 lo = 0, hi = z->nframes;
+    u32 mid;
+
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (z->frames[mid].off <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static ssize_t zstd_readv(struct bdev *bdev, const struct iovec *iov,
+                          int iovcnt, u64 off)
+{
+    struct bdev_zstd *z = bdev->priv;
+    struct zstd_cached *c;
+    struct zstd_frame *fr;
+    size_t len, pos = 0, n;
+    u32 f, first;
+
+    if (off >= z->size)
+        return 0;
+    len = min(bdev_iov_length(iov, iovcnt), z->size - off);
+
+    first = f = zstd_find(z, off);
+    for (; pos < len; f++)
+    {
+        /* empty frames are allowed, and hold nothing */
+        fr = &z->frames[f];
+        if (!fr->len)
+            continue;
+
+        c = zstd_get(z, f, 0);
+        if (!c)
+            return -ENOMEM;
+        if (c->state == FRAME_FAILED)
+        {
+            zstd_put(z, c);
+            return -EIO;
+        }
+
+        n = min(len - pos, fr->off + fr->len - (off + pos));
+        bdev_iov_scatter(iov, iovcnt, pos, c->data + (off + pos - fr->off),
+                         n);
+        zstd_put(z, c);
+        pos += n;
+    }
+
+    if (z->readahead > 0)
+        zstd_read_ahead(z, first, f - 1);
+    return len;
+}
+
+static u64 zstd_size(struct bdev *bdev)
+{
+    struct bdev_zstd *z = bdev->priv;
+
+    return z->size;
+}
+
+/*
+ * WILLNEED decompresses the frames covering the range ahead of time, as
+ * many as fit in half the cache.
+ */
+static void zstd_hint(struct bdev *bdev, int hint, u64 off, u64 len)
+{
+    struct bdev_zstd *z = bdev->priv;
+    u64 end, bytes = 0;
+    u32 first, last;
+
+    if (hint != BDEV_HINT_WILLNEED)
+    {
+        bdev_hint(z->file, hint, 0, 0);
+        return;
+    }
+
+    if (off >= z->size)
+        return;
+    end = len ? min(off + len, z->size) : z->size;
+
+    first = zstd_find(z, off);
+    for (last = first; last < z->nframes && z->frames[last].off < end &&
+                       bytes + z->frames[last].len <= z->max_bytes / 2;
+         last++)
+        bytes += z->frames[last].len;
+    zstd_queue(z, first, last);
+}
+
+static void zstd_close(struct bdev *bdev)
+{
+    struct bdev_zstd *z = bdev->priv;
+    u32 f;
+
+    if (!z || !z->cached)
+        return;
+
+    /* read ahead still running holds on to z */
+    pthread_mutex_lock(&z->lock);
+    while (z->jobs)
+        pthread_cond_wait(&z->cond, &z->lock);
+    pthread_mutex_unlock(&z->lock);
+
+    for (f=0; f < z->nframes; f++)
+        free(z->cached[f]);
+}
+
+const struct bdev_ops bdev_zstd_ops = {
+    .name = "zstd",
+    .help = "seekable zstd image [cache=<MB>,ra=<frames>,<backend>]",
+    .open = zstd_open,
+    .readv = zstd_readv,
+    .size = zstd_size,
+    .hint = zstd_hint,
+    .close = zstd_close,
+};
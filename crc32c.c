@@ -0,0 +1,139 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+/*
+ * Software CRC-32C is slice-by-8.  On x86-64 with SSE4.2 the crc32
+ * instruction is used instead, on three independent streams at once to
+ * cover its latency; the streams are merged by advancing the earlier
+ * ones over CRC32C_STRIDE zero bytes, which is linear in the CRC and so
+ * a four table lookup.
+ */
+#define CRC32C_POLY     0x82f63b78      /* reflected */
+#define CRC32C_STRIDE   256
+
+static u32 crc32c_table[8][256];
+static u32 crc32c_shift_table[4][256];
+
+static u32 (*crc32c_impl)(u32 crc, const u8 *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static u32 crc32c_sw(u32 crc, const u8 *p, size_t len)
+{
+    u64 w;
+
+    while (len && ((uintptr_t) p & 7))
+    {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        memcpy(&w, p, sizeof(w));
+        w = le64_to_cpu(w) ^ crc;
+        crc = crc32c_table[7][w & 0xff] ^
+              crc32c_table[6][(w >> 8) & 0xff] ^
+              crc32c_table[5][(w >> 16) & 0xff] ^
+              crc32c_table[4][(w >> 24) & 0xff] ^
+              crc32c_table[3][(w >> 32) & 0xff] ^
+              crc32c_table[2][(w >> 40) & 0xff] ^
+              crc32c_table[1][(w >> 48) & 0xff] ^
+              crc32c_table[0][w >> 56];
+    }
+
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* crc advanced over CRC32C_STRIDE zero bytes */
+static inline u32 crc32c_shift(u32 crc)
+{
+    return crc32c_shift_table[0][crc & 0xff] ^
+           crc32c_shift_table[1][(crc >> 8) & 0xff] ^
+           crc32c_shift_table[2][(crc >> 16) & 0xff] ^
+           crc32c_shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+static inline u64 load64(const u8 *p)
+{
+    u64 w;
+
+    memcpy(&w, p, sizeof(w));
+    return w;
+}
+
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *p, size_t len)
+{
+    u64 c0 = crc, c1, c2;
+    int i;
+
+    while (len && ((uintptr_t) p & 7))
+    {
+        c0 = __builtin_ia32_crc32qi(c0, *p++);
+        len--;
+    }
+
+    for (; len >= 3 * CRC32C_STRIDE; p += 3 * CRC32C_STRIDE,
+                                     len -= 3 * CRC32C_STRIDE)
+    {
+        c1 = c2 = 0;
+        for (i=0; i < CRC32C_STRIDE; i += 8)
+        {
+            c0 = __builtin_ia32_crc32di(c0, load64(p + i));
+            c1 = __builtin_ia32_crc32di(c1, load64(p + CRC32C_STRIDE + i));
+            c2 = __builtin_ia32_crc32di(c2,
+                                        load64(p + 2 * CRC32C_STRIDE + i));
+        }
+        c0 = crc32c_shift(crc32c_shift(c0) ^ c1) ^ c2;
+    }
+
+    for (; len >= 8; p += 8, len -= 8)
+        c0 = __builtin_ia32_crc32di(c0, load64(p));
+
+    while (len--)
+        c0 = __builtin_ia32_crc32qi(c0, *p++);
+    return c0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    u8 zeros[CRC32C_STRIDE] = { 0 };
+    u32 crc;
+    int i, j;
+
+    for (i=0; i < 256; i++)
+    {
+        crc = i;
+        for (j=0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (j=1; j < 8; j++)
+        for (i=0; i < 256; i++)
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+                crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+    for (j=0; j < 4; j++)
+        for (i=0; i < 256; i++)
+            crc32c_shift_table[j][i] =
+                crc32c_sw((u32) i << (8 * j), zeros, sizeof(zeros));
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_sse42;
+#endif
+}
+
+u32 crc32c(u32 crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_impl(crc, buf, len);
+}
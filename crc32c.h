@@ -0,0 +1,14 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+
+#include "config.h"
+
+/*
+ * CRC-32C (Castagnoli), raw: the caller supplies the starting value and
+ * nothing is inverted on the way in or out, as ext4 uses it.
+ */
+u32 crc32c(u32 crc, const void *buf, size_t len);
+
+#endif /* _CRC32C_H */
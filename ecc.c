@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <talloc.h>
+
+#include "ecc.h"
+
+/*
+ * Hamming code, byte compatible with yaffs_ecc_calc() and the Linux
+ * nand_ecc software code.  Bit k of the line parity is the parity of
+ * every byte whose index has bit k set; the primes are the parities of
+ * the rest.  The column parities come from the XOR of all 256 bytes.
+ *
+ * The data is reduced with 32 byte vectors (SSE2/AVX2/NEON, whatever the
+ * compiler targets), keeping separate sums of the vectors whose index has
+ * bit 0, 1 or 2 set; the rest of the index bits are lanes and bytes of
+ * the final words.  Words are loaded little endian.
+ */
+typedef u64 v4u64 __attribute__((vector_size(32)));
+
+static inline int parity64(u64 x)
+{
+    return __builtin_parityll(x);
+}
+
+/* interleave the low nibbles of p and q as p3 q3 p2 q2 p1 q1 p0 q0 */
+static inline u8 interleave_parity(u8 p, u8 q)
+{
+    u8 t = 0;
+    int i;
+
+    for (i=3; i >= 0; i--)
+        t = (t << 2) | (((p >> i) & 1) << 1) | ((q >> i) & 1);
+    return t;
+}
+
+void ecc_hamming_calc(const u8 *data, u8 *ecc)
+{
+    v4u64 v, all = { 0 }, odd1 = { 0 }, odd2 = { 0 }, odd4 = { 0 };
+    u8 lp, lpp, col, c;
+    u64 t;
+    int i;
+
+    for (i=0; i < ECC_HAMMING_STEP / sizeof(v); i++)
+    {
+        memcpy(&v, data + i * sizeof(v), sizeof(v));
+        all ^= v;
+        if (i & 1)
+            odd1 ^= v;
+        if (i & 2)
+            odd2 ^= v;
+        if (i & 4)
+            odd4 ^= v;
+    }
+
+    t = all[0] ^ all[1] ^ all[2] ^ all[3];
+
+    /* byte index bits 0-2 select a byte of a word, 3-4 a lane, 5-7 a vector */
+    lp = parity64(t & 0xff00ff00ff00ff00ULL) |
+         parity64(t & 0xffff0000ffff0000ULL) << 1 |
+         parity64(t & 0xffffffff00000000ULL) << 2 |
+         parity64(all[1] ^ all[3]) << 3 |
+         parity64(all[2] ^ all[3]) << 4 |
+         parity64(odd1[0] ^ odd1[1] ^ odd1[2] ^ odd1[3]) << 5 |
+         parity64(odd2[0] ^ odd2[1] ^ odd2[2] ^ odd2[3]) << 6 |
+         parity64(odd4[0] ^ odd4[1] ^ odd4[2] ^ odd4[3]) << 7;
+    lpp = parity64(t) ? ~lp : lp;
+
+    t ^= t >> 32;
+    t ^= t >> 16;
+    t ^= t >> 8;
+    c = t;
+
+    col = parity64(c & 0xf0) << 7 | parity64(c & 0x0f) << 6 |
+          parity64(c & 0xcc) << 5 | parity64(c & 0x33) << 4 |
+          parity64(c & 0xaa) << 3 | parity64(c & 0x55) << 2;
+
+    ecc[0] = ~interleave_parity(lp, lpp);
+    ecc[1] = ~interleave_parity(lp >> 4, lpp >> 4);
+    ecc[2] = ~col | 0x03;
+}
+
+/* returns the bits corrected, or -1 */
+int ecc_hamming_correct(u8 *data, const u8 *read_ecc, const u8 *calc_ecc)
+{
+    u8 d0 = read_ecc[0] ^ calc_ecc[0];
+    u8 d1 = read_ecc[1] ^ calc_ecc[1];
+    u8 d2 = read_ecc[2] ^ calc_ecc[2];
+    int byte = 0, bit = 0;
+    int i;
+
+    if (!(d0 | d1 | d2))
+        return 0;
+
+    /* a single data bit flips exactly one of each parity/prime pair */
+    if (((d0 ^ (d0 >> 1)) & 0x55) == 0x55 &&
+        ((d1 ^ (d1 >> 1)) & 0x55) == 0x55 &&
+        ((d2 ^ (d2 >> 1)) & 0x54) == 0x54)
+    {
+        for (i=0; i < 4; i++)
+        {
+            byte |= ((d1 >> (2 * i + 1)) & 1) << (i + 4);
+            byte |= ((d0 >> (2 * i + 1)) & 1) << i;
+        }
+        for (i=0; i < 3; i++)
+            bit |= ((d2 >> (2 * i + 3)) & 1) << i;
+
+        data[byte] ^= 1 << bit;
+        return 1;
+    }
+
+    /* a single flipped bit in the ECC itself */
+    if (__builtin_popcount(d0) + __builtin_popcount(d1) +
+        __builtin_popcount(d2) == 1)
+        return 1;
+
+    return -1;
+}
+
+/*
+ * BCH code, byte compatible with the Linux soft BCH NAND ECC: GF(2^13)
+ * with the kernel's default primitive polynomial, generator polynomial
+ * the product of the minimal polynomials of alpha^1 .. alpha^2t, data
+ * and ECC taken most significant bit first.  The stored ECC is XORed
+ * with the inverted ECC of an erased step so erased pages check clean.
+ *
+ * Encoding is a table driven LFSR over the remainder, at most
+ * 13 * ECC_BCH_MAX_T = 104 bits, kept left aligned in 128 bits so the
+ * bits shifted out are the feedback; it takes 32 data bits a step with
+ * four tables once the remainder is that wide.  Each step of a page has
+ * its own LFSR, so four of them are run interleaved to keep the table
+ * lookups from waiting on each other.  Decoding (syndromes,
+ * Berlekamp-Massey, Chien search) only runs when the ECC mismatches.
+ */
+#define BCH_M           13
+#define BCH_N           ((1 << BCH_M) - 1)
+#define BCH_PRIM_POLY   0x201b
+
+typedef unsigned __int128 u128;
+
+struct ecc_bch
+{
+    int t;
+    int r;                  /* ECC bits, the generator's degree */
+    u16 exp[2 * BCH_N];
+    u16 log[BCH_N + 1];
+    u128 table[4][256];     /* (b(x) * x^(r + 8k)) mod g(x), left aligned */
+    u8 mask[ECC_BCH_MAX_BYTES];
+};
+
+static inline u16 gf_mul(struct ecc_bch *bch, u16 a, u16 b)
+{
+    if (!a || !b)
+        return 0;
+    return bch->exp[bch->log[a] + bch->log[b]];
+}
+
+static inline u16 gf_div(struct ecc_bch *bch, u16 a, u16 b)
+{
+    if (!a)
+        return 0;
+    return bch->exp[bch->log[a] + BCH_N - bch->log[b]];
+}
+
+static inline u128 bch_lfsr32(struct ecc_bch *bch, u128 reg, const u8 *p)
+{
+    u32 w = (u32) (reg >> 96) ^
+            ((u32) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]);
+
+    return (reg << 32) ^ bch->table[3][w >> 24] ^
+           bch->table[2][(u8) (w >> 16)] ^
+           bch->table[1][(u8) (w >> 8)] ^ bch->table[0][(u8) w];
+}
+
+static u128 bch_remainder(struct ecc_bch *bch, const u8 *data, int len)
+{
+    u128 reg = 0;
+    int i = 0;
+
+    if (bch->r >= 32)
+        for (; i + 4 <= len; i += 4)
+            reg = bch_lfsr32(bch, reg, data + i);
+
+    for (; i < len; i++)
+        reg = (reg << 8) ^ bch->table[0][(u8) (reg >> 120) ^ data[i]];
+    return reg;
+}
+
+/* four consecutive steps; needs r >= 32 */
+static void bch_remainder4(struct ecc_bch *bch, const u8 *data, u128 *reg)
+{
+    u128 r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+    int i;
+
+    for (i=0; i < ECC_BCH_STEP; i += 4)
+    {
+        r0 = bch_lfsr32(bch, r0, data + i);
+        r1 = bch_lfsr32(bch, r1, data + ECC_BCH_STEP + i);
+        r2 = bch_lfsr32(bch, r2, data + 2 * ECC_BCH_STEP + i);
+        r3 = bch_lfsr32(bch, r3, data + 3 * ECC_BCH_STEP + i);
+    }
+
+    reg[0] = r0;
+    reg[1] = r1;
+    reg[2] = r2;
+    reg[3] = r3;
+}
+
+/* the remainder's bits are already in stored order, padding clear */
+static void bch_reg_to_bytes(struct ecc_bch *bch, u128 reg, u8 *ecc)
+{
+    int i;
+
+    for (i=0; i < (bch->r + 7) / 8; i++)
+        ecc[i] = reg >> (120 - 8 * i);
+}
+
+static u128 bch_bytes_to_reg(struct ecc_bch *bch, const u8 *ecc)
+{
+    u128 reg = 0;
+    int i;
+
+    for (i=0; i < (bch->r + 7) / 8; i++)
+        reg |= (u128) ecc[i] << (120 - 8 * i);
+    return reg >> (128 - bch->r) << (128 - bch->r);
+}
+
+static void bch_store(struct ecc_bch *bch, u128 reg, u8 *ecc)
+{
+    int i;
+
+    bch_reg_to_bytes(bch, reg, ecc);
+    for (i=0; i < (bch->r + 7) / 8; i++)
+        ecc[i] ^= bch->mask[i];
+}
+
+static void bch_calc_steps(struct ecc_bch *bch, const u8 *data, int nsteps,
+                           u8 (*ecc)[ECC_BCH_MAX_BYTES])
+{
+    u128 reg[4];
+    int i = 0, k;
+
+    if (bch->r >= 32)
+    {
+        for (; i + 4 <= nsteps; i += 4)
+        {
+            bch_remainder4(bch, data + i * ECC_BCH_STEP, reg);
+            for (k=0; k < 4; k++)
+                bch_store(bch, reg[k], ecc[i + k]);
+        }
+    }
+
+    for (; i < nsteps; i++)
+        bch_store(bch, bch_remainder(bch, data + i * ECC_BCH_STEP,
+                                     ECC_BCH_STEP), ecc[i]);
+}
+
+static struct ecc_bch *bch_new(void *mem_ctx, int t)
+{
+    struct ecc_bch *bch = talloc_zero(mem_ctx, struct ecc_bch);
+    u8 *roots = talloc_zero_array(bch, u8, BCH_N);
+    u16 g[BCH_M * ECC_BCH_MAX_T + 1] = { 1 };
+    u8 erased[ECC_BCH_STEP];
+    u128 gbits = 0, reg;
+    int deg = 0;
+    int i, j, x;
+
+    bch->t = t;
+
+    for (i=0, x=1; i < BCH_N; i++)
+    {
+        bch->exp[i] = bch->exp[i + BCH_N] = x;
+        bch->log[x] = i;
+        x <<= 1;
+        if (x & (1 << BCH_M))
+            x ^= BCH_PRIM_POLY;
+    }
+
+    /* g(x) has every conjugate of alpha^(2i+1) as a root */
+    for (i=0; i < t; i++)
+        for (j=0, x=2*i+1; j < BCH_M; j++, x = (x * 2) % BCH_N)
+            roots[x] = 1;
+
+    for (x=0; x < BCH_N; x++)
+    {
+        if (!roots[x])
+            continue;
+
+        /* g *= (x + alpha^x) */
+        g[deg + 1] = 1;
+        for (j=deg; j > 0; j--)
+            g[j] = g[j - 1] ^ gf_mul(bch, g[j], bch->exp[x]);
+        g[0] = gf_mul(bch, g[0], bch->exp[x]);
+        deg++;
+    }
+    talloc_free(roots);
+
+    bch->r = deg;
+
+    for (i=0; i < deg; i++)
+        gbits |= (u128) (g[i] & 1) << (128 - deg + i);
+
+    /* remainder of each byte shifted up by r, then by 8, 16 and 24 more */
+    for (i=0; i < 256; i++)
+    {
+        reg = 0;
+        for (j=7; j >= 0; j--)
+        {
+            int fb = ((i >> j) & 1) ^ (int) (reg >> 127);
+
+            reg <<= 1;
+            if (fb)
+                reg ^= gbits;
+        }
+        bch->table[0][i] = reg;
+    }
+    for (j=1; j < 4; j++)
+        for (i=0; i < 256; i++)
+            bch->table[j][i] = (bch->table[j - 1][i] << 8) ^
+                               bch->table[0][bch->table[j - 1][i] >> 120];
+
+    memset(erased, 0xff, sizeof(erased));
+    bch_reg_to_bytes(bch, bch_remainder(bch, erased, sizeof(erased)),
+                     bch->mask);
+    for (i=0; i < (deg + 7) / 8; i++)
+        bch->mask[i] ^= 0xff;
+
+    return bch;
+}
+
+/* returns the bits corrected, or -1 */
+static int bch_correct(struct ecc_bch *bch, u8 *data, const u8 *read_ecc,
+                       const u8 *calc_ecc)
+{
+    u16 s[2 * ECC_BCH_MAX_T + 1];
+    u16 c[2 * ECC_BCH_MAX_T + 1] = { 1 }, b[2 * ECC_BCH_MAX_T + 1] = { 1 };
+    u16 tmp[2 * ECC_BCH_MAX_T + 1];
+    int lc[2 * ECC_BCH_MAX_T + 1];
+    int nbits = 8 * ECC_BCH_STEP + bch->r;
+    u16 d, bd = 1, sum;
+    int l = 0, m = 1;
+    int found = 0;
+    u128 rem;
+    int i, j, k, bit;
+
+    rem = bch_bytes_to_reg(bch, read_ecc) ^ bch_bytes_to_reg(bch, calc_ecc);
+    rem >>= 128 - bch->r;
+    if (!rem)
+        return 0;
+
+    /* syndromes of the error polynomial, rem(x) = e(x) mod g(x) */
+    for (j=1; j <= 2 * bch->t; j++)
+    {
+        s[j] = 0;
+        for (i=0; i < bch->r; i++)
+            if ((rem >> i) & 1)
+                s[j] ^= bch->exp[(i * j) % BCH_N];
+    }
+
+    /* Berlekamp-Massey for the error locator c(x) */
+    for (k=0; k < 2 * bch->t; k++)
+    {
+        d = s[k + 1];
+        for (i=1; i <= l; i++)
+            d ^= gf_mul(bch, c[i], s[k + 1 - i]);
+
+        if (!d)
+        {
+            m++;
+            continue;
+        }
+
+        memcpy(tmp, c, sizeof(c));
+        for (i=0; i + m <= 2 * bch->t; i++)
+            c[i + m] ^= gf_mul(bch, gf_div(bch, d, bd), b[i]);
+
+        if (2 * l <= k)
+        {
+            l = k + 1 - l;
+            memcpy(b, tmp, sizeof(b));
+            bd = d;
+            m = 1;
+        }
+        else
+            m++;
+    }
+
+    if (l > bch->t)
+        return -1;
+
+    /* Chien search: degree p is in error if c(alpha^-p) == 0 */
+    for (i=0; i <= l; i++)
+        lc[i] = c[i] ? bch->log[c[i]] : -1;
+
+    for (k=0; k < nbits && found < l; k++)
+    {
+        sum = 0;
+        for (i=0; i <= l; i++)
+        {
+            if (lc[i] < 0)
+                continue;
+            sum ^= bch->exp[lc[i]];
+            lc[i] = (lc[i] + BCH_N - i) % BCH_N;
+        }
+        if (sum)
+            continue;
+
+        /* degrees below r are ECC bits, the data sits above them */
+        found++;
+        if (k >= bch->r)
+        {
+            bit = nbits - 1 - k;
+            data[bit / 8] ^= 0x80 >> (bit % 8);
+        }
+    }
+
+    return found == l ? l : -1;
+}
+
+/* Linux's layout for 512 byte pages puts the ECC around the bad block marker */
+static const u16 small_page_pos[] = { 0, 1, 2, 3, 6, 7 };
+
+struct ecc *ecc_new(void *mem_ctx, const char *spec, int page, int oob)
+{
+    struct ecc *ecc = talloc_zero(mem_ctx, struct ecc);
+    int offset = -1;
+    int total;
+    char *end;
+    int i;
+
+    if (strncmp(spec, "hamming", 7) == 0)
+    {
+        ecc->scheme = ECC_HAMMING;
+        ecc->step = ECC_HAMMING_STEP;
+        ecc->bytes = ECC_HAMMING_BYTES;
+        ecc->strength = 1;
+        end = (char *) spec + 7;
+    }
+    else if (strncmp(spec, "bch", 3) == 0)
+    {
+        ecc->scheme = ECC_BCH;
+        ecc->step = ECC_BCH_STEP;
+        ecc->strength = strtol(spec + 3, &end, 10);
+        if (ecc->strength < 1 || ecc->strength > ECC_BCH_MAX_T)
+            goto bad_spec;
+        ecc->bch = bch_new(ecc, ecc->strength);
+        ecc->bytes = (ecc->bch->r + 7) / 8;
+    }
+    else
+        goto bad_spec;
+
+    if (*end == '@')
+        offset = strtol(end + 1, &end, 10);
+    if (*end)
+        goto bad_spec;
+
+    if (!oob || page % ecc->step || page / ecc->step > ECC_MAX_STEPS)
+    {
+        fprintf(stderr, "ecc: %s does not fit %d byte pages with %d bytes "
+                "of OOB\n", spec, page, oob);
+        goto err;
+    }
+
+    ecc->nsteps = page / ecc->step;
+    total = ecc->nsteps * ecc->bytes;
+    ecc->pos = talloc_array(ecc, u16, total);
+
+    if (offset < 0 && ecc->scheme == ECC_HAMMING && page == 512 &&
+        oob == 16)
+    {
+        memcpy(ecc->pos, small_page_pos, sizeof(small_page_pos));
+    }
+    else
+    {
+        if (offset < 0)
+            offset = oob - total;
+        if (offset < 0 || offset + total > oob)
+        {
+            fprintf(stderr, "ecc: %d ECC bytes do not fit in %d bytes of "
+                    "OOB\n", total, oob);
+            goto err;
+        }
+        for (i=0; i < total; i++)
+            ecc->pos[i] = offset + i;
+    }
+    return ecc;
+
+bad_spec:
+    fprintf(stderr, "ecc: unknown ECC scheme '%s'\n", spec);
+err:
+    talloc_free(ecc);
+    return NULL;
+}
+
+/*
+ * Check and correct one page in place against its OOB.  Returns the
+ * number of bits corrected, or -EBADMSG if any step was beyond repair.
+ */
+int ecc_correct_page(struct ecc *ecc, u8 *page, const u8 *oob)
+{
+    u8 read_ecc[ECC_BCH_MAX_BYTES];
+    u8 calc_ecc[ECC_MAX_STEPS][ECC_BCH_MAX_BYTES];
+    int corrected = 0, failed = 0;
+    int i, j, n;
+
+    if (ecc->scheme == ECC_HAMMING)
+        for (i=0; i < ecc->nsteps; i++)
+            ecc_hamming_calc(page + i * ecc->step, calc_ecc[i]);
+    else
+        bch_calc_steps(ecc->bch, page, ecc->nsteps, calc_ecc);
+
+    for (i=0; i < ecc->nsteps; i++)
+    {
+        u8 *data = page + i * ecc->step;
+
+        for (j=0; j < ecc->bytes; j++)
+            read_ecc[j] = oob[ecc->pos[i * ecc->bytes + j]];
+
+        if (!memcmp(read_ecc, calc_ecc[i], ecc->bytes))
+            continue;
+
+        if (ecc->scheme == ECC_HAMMING)
+            n = ecc_hamming_correct(data, read_ecc, calc_ecc[i]);
+        else
+            n = bch_correct(ecc->bch, data, read_ecc, calc_ecc[i]);
+
+        if (n < 0)
+            failed++;
+        else
+            corrected += n;
+    }
+
+    __atomic_add_fetch(&ecc->pages, 1, __ATOMIC_RELAXED);
+    if (corrected)
+        __atomic_add_fetch(&ecc->corrected, corrected, __ATOMIC_RELAXED);
+    if (failed)
+    {
+        __atomic_add_fetch(&ecc->failed, failed, __ATOMIC_RELAXED);
+        return -EBADMSG;
+    }
+    return corrected;
+}
+
+void ecc_report(struct ecc *ecc, const char *prefix)
+{
+    fprintf(stderr, "%s: ECC checked %llu pages, corrected %llu bitflips, "
+            "%llu uncorrectable steps\n", prefix,
+            (unsigned long long) __atomic_load_n(&ecc->pages,
+                                                 __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&ecc->corrected,
+                                                 __ATOMIC_RELAXED),
+            (unsigned long long) __atomic_load_n(&ecc->failed,
+                                                 __ATOMIC_RELAXED));
+}
@@ -0,0 +1,57 @@
+#ifndef _ECC_H
+#define _ECC_H
+
+#include "config.h"
+
+/*
+ * NAND page ECC, checked against the ECC bytes the controller left in
+ * the OOB area.  Two schemes are known:
+ *
+ *  hamming   the yaffs / Linux MTD software Hamming code, 3 bytes per
+ *            256 data bytes, corrects one bit per step
+ *  bch<t>    Linux soft BCH over GF(2^13), 512 byte steps, corrects t
+ *            bits per step (t up to ECC_BCH_MAX_T)
+ *
+ * By default the ECC bytes sit at the end of the OOB area as in the Linux
+ * large page layout (or bytes 0-3, 6-7 for 512 byte pages with Hamming);
+ * "<scheme>@<offset>" places them contiguously from offset instead.
+ */
+enum ecc_scheme
+{
+    ECC_HAMMING,
+    ECC_BCH,
+};
+
+#define ECC_HAMMING_STEP    256
+#define ECC_HAMMING_BYTES   3
+#define ECC_BCH_STEP        512
+#define ECC_BCH_MAX_T       8
+#define ECC_BCH_MAX_BYTES   13
+#define ECC_MAX_STEPS       64
+
+struct ecc_bch;
+
+struct ecc
+{
+    int scheme;
+    int step;               /* data bytes per ECC step */
+    int bytes;              /* ECC bytes per step */
+    int strength;           /* bits corrected per step */
+    int nsteps;
+    u16 *pos;               /* OOB offset of every ECC byte */
+    struct ecc_bch *bch;
+
+    /* statistics, updated atomically */
+    u64 pages;
+    u64 corrected;          /* bitflips corrected */
+    u64 failed;             /* steps beyond correction */
+};
+
+struct ecc *ecc_new(void *mem_ctx, const char *spec, int page, int oob);
+int ecc_correct_page(struct ecc *ecc, u8 *page, const u8 *oob);
+void ecc_report(struct ecc *ecc, const char *prefix);
+
+void ecc_hamming_calc(const u8 *data, u8 *ecc);
+int ecc_hamming_correct(u8 *data, const u8 *read_ecc, const u8 *calc_ecc);
+
+#endif /* _ECC_H */
@@ -1,106 +1,717 @@
-#include <fuse.h>
-#include <fuse/fuse_lowlevel.h>
 #include <talloc.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <linux/fs.h>
 #include <linux/ext2_fs.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "config.h"
+#include "trace.h"
+#include "ext2.h"
+#include "ext4.h"
+#include "crc32c.h"
+#include "bdev.h"
+#include "bcache.h"
+#include "manifest.h"
+#include "warm.h"
+#include "fszoo.h"
 
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 #define div_round(a,b) ((a)+(b)-1)/(b)
 
-struct ext2_info
+/* metadata blocks kept in the cache */
+#define EXT2_CACHE_BLOCKS 4096
+
+/* inode table blocks prefetched after a readdir reply, at most */
+#define EXT2_PREFETCH_BLOCKS 256
+
+/* --preload reads inode tables this much at a time */
+#define EXT2_PRELOAD_IO (1 << 20)
+
+/* what a verify callback needs to know about the block's owner */
+struct ext2_csum_ctx
 {
-    FILE *dev;
-    struct ext2_super_block sb;
-    struct ext2_group_desc *groups;
+    struct ext2_info *info;
+    u32 ino;                /* owning inode, or first inode in the block */
+    u32 generation;
+};
 
-    /* useful in-memory, cpu-endian values */
-    u32 block_size;
-    u32 frag_size;
-    u32 ngroups;
-    u32 inode_size;
+/*
+ * Preloaded metadata.  Each group's in-use inodes are copied into an
+ * array of their own, and slots maps every inode number to its place
+ * there: 0 if it wasn't loaded and is read from the device as usual, ~0
+ * if it failed its checksum.  Directory inodes have their parsed
+ * directory alongside.  It is only written before the mount.
+ */
+struct ext2_preload
+{
+    struct ext2_info *info;
+    u32 *slots;
+    u32 ninodes;
+    struct ext2_inode **inodes;     /* per group */
+    u32 *counts;                    /* of those, per group */
+    struct ext2_dir ***dirs;        /* per group, per loaded inode */
+
+    u64 mem;
+    u64 max_mem;
+    int capped;
+
+    /* progress, and the group the next worker takes */
+    u32 next;
+    u32 groups_done;
+    u64 loaded;
+    u64 ndirs;
+
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
 };
 
+static u32 ext2_preload_slot(struct ext2_preload *p, u32 ino)
+{
+    return p && ino && ino <= p->ninodes ? p->slots[ino - 1] : 0;
+}
+
+/* 0, -EIO if it failed its checksum, or -EAGAIN if it wasn't preloaded */
+static int ext2_preload_inode(struct ext2_info *info, u32 ino,
+                              struct ext2_inode *ret)
+{
+    u32 slot = ext2_preload_slot(info->preload, ino);
+    u32 bg = (ino - 1) / le32_to_cpu(info->sb.s_inodes_per_group);
+
+    if (!slot)
+        return -EAGAIN;
+    if (slot == ~0U)
+        return -EIO;
+
+    memcpy(ret, &info->preload->inodes[bg][slot - 1], sizeof(*ret));
+    return 0;
+}
+
+static struct ext2_dir *ext2_preload_dir(struct ext2_info *info, u32 ino)
+{
+    struct ext2_preload *p = info->preload;
+    u32 slot = ext2_preload_slot(p, ino);
+    u32 bg = (ino - 1) / le32_to_cpu(info->sb.s_inodes_per_group);
+
+    if (!slot || slot == ~0U || !p->dirs[bg])
+        return NULL;
+    return p->dirs[bg][slot - 1];
+}
+
+static u32 ext2_name_hash(const char *name)
+{
+    u32 h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (u8) *name++) * 16777619u;
+    return h;
+}
+
+static struct ext2_dirent *ext2_dir_find(struct ext2_dir *dir,
+                                         const char *name)
+{
+    struct ext2_dirent *ent;
+    u32 h;
+
+    if (!dir->hash)
+        return NULL;
+
+    for (h = ext2_name_hash(name) & dir->hash_mask; dir->hash[h];
+         h = (h + 1) & dir->hash_mask)
+    {
+        ent = &dir->entries[dir->hash[h] - 1];
+        if (strcmp(dir->names + ent->name, name) == 0)
+            return ent;
+    }
+    return NULL;
+}
+
 /* internal I/O routines */
 
-int bread(void *buf, int blk_size, u64 blk, FILE *fp)
+static int bread(void *buf, int blk_size, u64 blk, struct bdev *dev)
 {
-    fseeko(fp, blk * blk_size, SEEK_SET);
-    return fread(buf, blk_size, 1, fp);
+    ssize_t ret;
+
+    ret = bdev_pread(dev, buf, blk_size, blk * blk_size);
+
+    trace(ext2_bread, blk, blk_size, ret);
+    return ret == blk_size;
 }
 
-u8 *bread_m(int blk_size, u64 blk, u64 count, FILE *fp)
+static const u8 *ext2_get_meta(struct ext2_info *info, u64 blk,
+                               bcache_verify_fn verify,
+                               struct ext2_csum_ctx *ctx, u64 *bad)
 {
-    u8 *mem = talloc_size(NULL, blk_size * count);
-    bread(mem, blk_size, blk * count, fp);
-    return mem;
+    const u8 *block;
+
+    block = bcache_get(info->cache, blk, info->csum ? verify : NULL, ctx,
+                       bad);
+    trace(ext2_bread, blk, info->block_size, block ? info->block_size : 0);
+    return block;
 }
 
-u8 *ext2_get_block_n(struct ext2_info *info, struct ext2_inode *inode,
-                     int blknum)
+static void ext2_csum_error(struct ext2_info *info)
 {
-    u32 ptrs_per_block = info->block_size /  sizeof(u32);
-    u32 dptrs = ptrs_per_block * ptrs_per_block;
-    u32 ptrs[4];
-    int nptrs = 0;
-    int i;
+    __atomic_add_fetch(&info->csum_errors, 1, __ATOMIC_RELAXED);
+}
+
+/* per-inode checksums are seeded with the inode number and generation */
+static u32 ext2_inode_csum_seed(struct ext2_info *info, u32 ino, u32 gen)
+{
+    u32 le_ino = cpu_to_le32(ino);
+    u32 le_gen = cpu_to_le32(gen);
+
+    return crc32c(crc32c(info->csum_seed, &le_ino, 4), &le_gen, 4);
+}
+
+static int ext2_inode_csum_ok(struct ext2_info *info, u32 ino, const u8 *raw)
+{
+    u16 zero = 0;
+    int has_hi = 0;
+    u32 crc, stored;
+    int ofs;
+
+    if (info->inode_size > EXT4_GOOD_OLD_INODE_SIZE)
+        has_hi = get_le16(raw + EXT4_INODE_EXTRA_ISIZE) >=
+                 EXT4_INODE_CHECKSUM_HI + 2 - EXT4_GOOD_OLD_INODE_SIZE;
+
+    /* the checksum fields themselves count as zero */
+    crc = ext2_inode_csum_seed(info, ino,
+                               get_le32(raw + EXT4_INODE_GENERATION));
+    crc = crc32c(crc, raw, EXT4_INODE_CHECKSUM_LO);
+    crc = crc32c(crc, &zero, 2);
+    crc = crc32c(crc, raw + EXT4_INODE_CHECKSUM_LO + 2,
+                 EXT4_GOOD_OLD_INODE_SIZE - EXT4_INODE_CHECKSUM_LO - 2);
+
+    if (info->inode_size > EXT4_GOOD_OLD_INODE_SIZE)
+    {
+        ofs = EXT4_INODE_CHECKSUM_HI;
+        crc = crc32c(crc, raw + EXT4_GOOD_OLD_INODE_SIZE,
+                     ofs - EXT4_GOOD_OLD_INODE_SIZE);
+        if (has_hi)
+        {
+            crc = crc32c(crc, &zero, 2);
+            ofs += 2;
+        }
+        crc = crc32c(crc, raw + ofs, info->inode_size - ofs);
+    }
+
+    stored = get_le16(raw + EXT4_INODE_CHECKSUM_LO);
+    if (has_hi)
+        stored |= (u32) get_le16(raw + EXT4_INODE_CHECKSUM_HI) << 16;
+    else
+        crc &= 0xffff;
+
+    return crc == stored;
+}
+
+/*
+ * An inode table block is checked whole; bit i of the mask covers the
+ * i'th 64th of the block, so every inode maps to one bit.
+ */
+static inline u64 ext2_inode_bad_bit(int idx, int per_block)
+{
+    return 1ULL << (per_block <= 64 ? idx : idx * 64 / per_block);
+}
+
+static u64 ext2_verify_inodes(void *arg, u64 blk, const u8 *data)
+{
+    struct ext2_csum_ctx *ctx = arg;
+    struct ext2_info *info = ctx->info;
+    int per_block = 1 << (info->block_bits - info->inode_bits);
+    const u8 *raw;
+    u64 bad = 0;
+    int i, j;
+
+    for (i=0; i < per_block; i++)
+    {
+        raw = data + (i << info->inode_bits);
+
+        /* never used inodes are left zeroed, without a checksum */
+        for (j=0; j < info->inode_size && !raw[j]; j++)
+            ;
+        if (j == info->inode_size)
+            continue;
+
+        if (!ext2_inode_csum_ok(info, ctx->ino + i, raw))
+        {
+            bad |= ext2_inode_bad_bit(i, per_block);
+            ext2_csum_error(info);
+        }
+    }
+    return bad;
+}
+
+static u64 ext2_verify_extent_block(void *arg, u64 blk, const u8 *data)
+{
+    struct ext2_csum_ctx *ctx = arg;
+    struct ext2_info *info = ctx->info;
+    const struct ext4_extent_header *eh = (const void *) data;
+    int ofs = sizeof(*eh) +
+              le16_to_cpu(eh->eh_max) * sizeof(struct ext4_extent);
+
+    if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC ||
+        ofs + sizeof(struct ext4_extent_tail) > info->block_size ||
+        crc32c(ext2_inode_csum_seed(info, ctx->ino, ctx->generation),
+               data, ofs) != get_le32(data + ofs))
+    {
+        ext2_csum_error(info);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Only leaf blocks carry a dirent tail; htree index blocks have their
+ * own tail and are left unchecked.
+ */
+static u64 ext2_verify_dir_block(void *arg, u64 blk, const u8 *data)
+{
+    struct ext2_csum_ctx *ctx = arg;
+    struct ext2_info *info = ctx->info;
+    int ofs = info->block_size - sizeof(struct ext4_dir_entry_tail);
+    const struct ext4_dir_entry_tail *t = (const void *) (data + ofs);
+
+    if (t->det_reserved_zero1 || le16_to_cpu(t->det_rec_len) != sizeof(*t) ||
+        t->det_reserved_zero2 || t->det_reserved_ft != EXT4_FT_DIR_CSUM)
+        return 0;
+
+    if (crc32c(ext2_inode_csum_seed(info, ctx->ino, ctx->generation),
+               data, ofs) != le32_to_cpu(t->det_checksum))
+    {
+        ext2_csum_error(info);
+        return 1;
+    }
+    return 0;
+}
+
+static int ext2_group_desc_csum_ok(struct ext2_info *info, u32 bg,
+                                   const u8 *desc)
+{
+    u32 le_bg = cpu_to_le32(bg);
+    int ofs = offsetof(struct ext4_group_desc, bg_checksum);
+    u16 zero = 0;
+    u32 crc;
+
+    crc = crc32c(info->csum_seed, &le_bg, 4);
+    crc = crc32c(crc, desc, ofs);
+    crc = crc32c(crc, &zero, 2);
+    ofs += 2;
+    if (ofs < info->desc_size)
+        crc = crc32c(crc, desc + ofs, info->desc_size - ofs);
+
+    return (crc & 0xffff) ==
+        le16_to_cpu(((const struct ext4_group_desc *) desc)->bg_checksum);
+}
+
+static u64 ext2_inode_table(struct ext2_info *info, u32 bg)
+{
+    const struct ext4_group_desc *gd =
+        (const void *) (info->groups + (size_t) bg * info->desc_size);
+    u64 blk = le32_to_cpu(gd->bg_inode_table_lo);
+
+    if (info->desc_size > EXT2_MIN_DESC_SIZE)
+        blk |= (u64) le32_to_cpu(gd->bg_inode_table_hi) << 32;
+    return blk;
+}
+
+/*
+ * Walk the extent tree down to logical block n; 0 for a hole.  count is
+ * how many blocks from n, up to max, the extent goes on for.
+ */
+static int ext2_map_extent(struct ext2_info *info, u32 ino,
+                           struct ext2_inode *inode, u64 n, u64 max,
+                           u64 *pblk, u64 *count)
+{
+    struct ext2_csum_ctx ctx = {
+        info, ino, le32_to_cpu(inode->i_generation)
+    };
+    const struct ext4_extent_header *eh = (const void *) inode->i_block;
+    const struct ext4_extent_idx *ix;
+    const struct ext4_extent *ex;
+    const u8 *block = NULL, *next;
+    int lo, hi, mid, nentries;
+    int depth, len;
+    int err = -EIO;
+    u64 bad;
+
+    *pblk = 0;
+    *count = 1;
+
+    for (depth = 0; depth <= EXT4_EXT_MAX_DEPTH; depth++)
+    {
+        if (le16_to_cpu(eh->eh_magic) != EXT4_EXT_MAGIC)
+            break;
+
+        /* find the last entry starting at or before n */
+        nentries = le16_to_cpu(eh->eh_entries);
+        lo = -1;
+        hi = nentries;
+        while (hi - lo > 1)
+        {
+            mid = lo + (hi - lo) / 2;
+            if (le32_to_cpu(((const struct ext4_extent *) (eh + 1))[mid].
+                            ee_block) <= n)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        if (!eh->eh_depth)
+        {
+            err = 0;
+            if (lo < 0)
+                break;
+
+            ex = (const struct ext4_extent *) (eh + 1) + lo;
+            len = le16_to_cpu(ex->ee_len);
+
+            /* unwritten extents read as zeros */
+            if (len > EXT4_EXT_INIT_MAX_LEN)
+                break;
+            if (n < le32_to_cpu(ex->ee_block) + len)
+            {
+                *pblk = ((u64) le16_to_cpu(ex->ee_start_hi) << 32 |
+                         le32_to_cpu(ex->ee_start_lo)) +
+                        n - le32_to_cpu(ex->ee_block);
+                *count = min(max, le32_to_cpu(ex->ee_block) + len - n);
+            }
+            break;
+        }
+
+        if (lo < 0)
+        {
+            err = 0;
+            break;
+        }
+
+        ix = (const struct ext4_extent_idx *) (eh + 1) + lo;
+        next = ext2_get_meta(info, (u64) le16_to_cpu(ix->ei_leaf_hi) << 32 |
+                             le32_to_cpu(ix->ei_leaf_lo),
+                             ext2_verify_extent_block, &ctx, &bad);
+        if (block)
+            bcache_put(info->cache, block);
+        block = next;
+        if (!block || bad)
+            break;
+        eh = (const struct ext4_extent_header *) block;
+    }
+
+    if (block)
+        bcache_put(info->cache, block);
+    return err;
+}
+
+/*
+ * Step one level down an indirect tree: blk becomes pointer idx of block
+ * blk.  A hole stays a hole.
+ */
+static inline int ext2_ind_ptr(struct ext2_info *info, u32 *blk, u32 idx)
+{
+    const u8 *block;
+
+    if (!*blk)
+        return 0;
+
+    block = ext2_get_meta(info, *blk, NULL, NULL, NULL);
+    if (!block)
+        return -EIO;
+    *blk = le32_to_cpu(((const u32 *) block)[idx]);
+    bcache_put(info->cache, block);
+    return 0;
+}
+
+/*
+ * Pointer idx of nptrs, and how many after it, up to max in all, follow
+ * on from it on disk.  Holes follow on from holes.
+ */
+static inline u64 ext2_ptr_run(const u32 *ptrs, u32 idx, u32 nptrs, u64 max,
+                               u64 *pblk)
+{
+    u32 first = le32_to_cpu(ptrs[idx]);
+    u64 i;
+
+    *pblk = first;
+    for (i=1; i < max && idx + i < nptrs; i++)
+    {
+        if (le32_to_cpu(ptrs[idx + i]) != (first ? first + i : 0))
+            break;
+    }
+    return i;
+}
+
+/*
+ * The mapping and read paths are written once, for a block size of
+ * 1 << bits, and built for each common size below so that the divisions
+ * by it are shifts and masks.  read_super picks the set to use.
+ */
+struct ext2_kernels
+{
+    int (*map_block)(struct ext2_info *info, u32 ino,
+                     struct ext2_inode *inode, u64 n, u64 *pblk);
+    ssize_t (*read_data)(struct ext2_info *info, u32 ino,
+                         struct ext2_inode *inode, void *buf, size_t size,
+                         off_t off);
+};
 
-    u8 *block = talloc_size(info, info->block_size);
+/*
+ * Logical block n through the direct, single, double and triple indirect
+ * pointers, with each level spelt out.  The last pointer block is held
+ * while the run after n is counted.
+ */
+static inline __attribute__((always_inline))
+int ext2_map_indirect_body(struct ext2_info *info, struct ext2_inode *inode,
+                           u64 n, u64 max, u64 *pblk, u64 *count, int bits)
+{
+    const int pbits = bits - 2;     /* log2 of pointers per block */
+    const u64 pmask = (1ULL << pbits) - 1;
+    const u8 *block;
+    u32 blk;
+
+    *pblk = 0;
+    *count = 1;
 
-    /* build a list of blocks to read to reach the target block */
-    /* direct blocks */
-    if (blknum < EXT2_NDIR_BLOCKS)
+    if (n < EXT2_NDIR_BLOCKS)
     {
-        ptrs[nptrs++] = blknum;
+        *count = ext2_ptr_run(inode->i_block, n, EXT2_NDIR_BLOCKS, max,
+                              pblk);
+        return 0;
     }
-    /* one indirection */
-    else if ( (blknum -= EXT2_NDIR_BLOCKS) < ptrs_per_block)
+
+    n -= EXT2_NDIR_BLOCKS;
+    if (n < 1ULL << pbits)
     {
-        ptrs[nptrs++] = EXT2_IND_BLOCK;
-        ptrs[nptrs++] = blknum;
+        blk = le32_to_cpu(inode->i_block[EXT2_IND_BLOCK]);
+        goto ind;
     }
-    /* double indirection */
-    else if ( (blknum -= ptrs_per_block) < dptrs)
+
+    n -= 1ULL << pbits;
+    if (n < 1ULL << 2 * pbits)
     {
-        ptrs[nptrs++] = EXT2_DIND_BLOCK;
-        ptrs[nptrs++] = blknum / ptrs_per_block;
-        ptrs[nptrs++] = blknum % ptrs_per_block;
+        blk = le32_to_cpu(inode->i_block[EXT2_DIND_BLOCK]);
+        goto dind;
     }
-    /* triple indirection */
+
+    /* past the end of the triple indirect tree is a hole */
+    n -= 1ULL << 2 * pbits;
+    if (n >= 1ULL << 3 * pbits)
+        return 0;
+
+    blk = le32_to_cpu(inode->i_block[EXT2_TIND_BLOCK]);
+    if (ext2_ind_ptr(info, &blk, n >> 2 * pbits))
+        return -EIO;
+dind:
+    if (ext2_ind_ptr(info, &blk, (n >> pbits) & pmask))
+        return -EIO;
+ind:
+    if (!blk)
+        return 0;
+
+    block = ext2_get_meta(info, blk, NULL, NULL, NULL);
+    if (!block)
+        return -EIO;
+    *count = ext2_ptr_run((const u32 *) block, n & pmask, 1 << pbits, max,
+                          pblk);
+    bcache_put(info->cache, block);
+    return 0;
+}
+
+/*
+ * Map logical block n of an inode to a device block, 0 for a hole.
+ * count is how many blocks from n, up to max, follow on from it.
+ */
+static inline __attribute__((always_inline))
+int ext2_map_run_body(struct ext2_info *info, u32 ino,
+                      struct ext2_inode *inode, u64 n, u64 max, u64 *pblk,
+                      u64 *count, int bits)
+{
+    int err;
+
+    if (le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL)
+        err = ext2_map_extent(info, ino, inode, n, max, pblk, count);
     else
+        err = ext2_map_indirect_body(info, inode, n, max, pblk, count, bits);
+
+    trace(ext2_map_block, n, *pblk, err);
+    return err;
+}
+
+static u32 ext2_ino(u32 ino)
+{
+    /* FUSE's root */
+    return ino == 1 ? EXT2_ROOT_INO : ino;
+}
+
+/*
+ * Read file data into buf.  The range is mapped first, then each
+ * physically contiguous run is read straight into buf; holes read as
+ * zeros.  Returns the bytes read, short only at the end of the file, or
+ * -errno.
+ */
+static inline __attribute__((always_inline))
+ssize_t ext2_read_data_body(struct ext2_info *info, u32 ino,
+                            struct ext2_inode *inode, void *buf, size_t size,
+                            off_t off, int bits)
+{
+    const u64 mask = (1ULL << bits) - 1;
+    u32 isize = le32_to_cpu(inode->i_size);
+    u64 blk, end, pblk, run_start, run_len, n;
+    u32 blk_ofs;
+    size_t bufofs = 0, len;
+    ssize_t ret;
+
+    if (off >= isize)
+        return 0;
+
+    ino = ext2_ino(ino);
+
+    /* compute actual size to read */
+    size = min(size, isize - off);
+
+    blk = off >> bits;
+    blk_ofs = off & mask;
+    end = (off + size + mask) >> bits;
+
+    while (blk < end)
+    {
+        if (ext2_map_run_body(info, ino, inode, blk, end - blk, &run_start,
+                              &run_len, bits))
+            return -EIO;
+
+        /* and on into the next pointer block or extent */
+        while (blk + run_len < end)
+        {
+            if (ext2_map_run_body(info, ino, inode, blk + run_len,
+                                  end - blk - run_len, &pblk, &n, bits))
+                return -EIO;
+            if (pblk != (run_start ? run_start + run_len : 0))
+                break;
+            run_len += n;
+        }
+
+        len = min(size - bufofs, (run_len << bits) - blk_ofs);
+        if (!run_start)
+            memset((u8 *) buf + bufofs, 0, len);
+        else
+        {
+            ret = bdev_pread(info->dev, (u8 *) buf + bufofs, len,
+                             (run_start << bits) + blk_ofs);
+            trace(ext2_bread, run_start, len, ret);
+            if (ret != len)
+                return ret < 0 ? ret : -EIO;
+            if (info->warm)
+                warm_touch(info->warm, (run_start << bits) + blk_ofs, len);
+        }
+
+        bufofs += len;
+        blk += run_len;
+        blk_ofs = 0;
+    }
+    return bufofs;
+}
+
+#define EXT2_KERNELS(name, bits)                                            \
+static int ext2_map_block_##name(struct ext2_info *info, u32 ino,          \
+                                 struct ext2_inode *inode, u64 n,          \
+                                 u64 *pblk)                                \
+{                                                                           \
+    u64 count;                                                              \
+                                                                            \
+    return ext2_map_run_body(info, ino, inode, n, 1, pblk, &count, bits);   \
+}                                                                           \
+                                                                            \
+static ssize_t ext2_read_data_##name(struct ext2_info *info, u32 ino,      \
+                                     struct ext2_inode *inode, void *buf,  \
+                                     size_t size, off_t off)               \
+{                                                                           \
+    return ext2_read_data_body(info, ino, inode, buf, size, off, bits);     \
+}                                                                           \
+                                                                            \
+static const struct ext2_kernels ext2_kernels_##name = {                    \
+    ext2_map_block_##name, ext2_read_data_##name                            \
+}
+
+EXT2_KERNELS(1k, 10);
+EXT2_KERNELS(2k, 11);
+EXT2_KERNELS(4k, 12);
+EXT2_KERNELS(64k, 16);
+/* any other size, shifting by the filesystem's */
+EXT2_KERNELS(any, info->block_bits);
+
+static const struct ext2_kernels *ext2_kernels_for(u32 block_bits)
+{
+    switch (block_bits)
     {
-        blknum -= dptrs;
-        ptrs[nptrs++] = EXT2_TIND_BLOCK;
-        ptrs[nptrs++] = blknum / dptrs;
-        ptrs[nptrs++] = (blknum / ptrs_per_block) % ptrs_per_block;
-        ptrs[nptrs++] = blknum % ptrs_per_block;
+        case 10:
+            return &ext2_kernels_1k;
+        case 11:
+            return &ext2_kernels_2k;
+        case 12:
+            return &ext2_kernels_4k;
+        case 16:
+            return &ext2_kernels_64k;
+        default:
+            return &ext2_kernels_any;
     }
+}
+
+/* map logical block n of an inode to a device block, 0 for a hole */
+static int ext2_map_block(struct ext2_info *info, u32 ino,
+                          struct ext2_inode *inode, u64 n, u64 *pblk)
+{
+    return info->kern->map_block(info, ino, inode, n, pblk);
+}
+
+/*
+ * Directory block n of inode ino, from the cache and checked; release it
+ * with bcache_put().  NULL on error or for a hole.
+ */
+static const u8 *ext2_get_dir_block(struct ext2_info *info, u32 ino,
+                                    struct ext2_inode *dir, u64 n)
+{
+    struct ext2_csum_ctx ctx = {
+        info, ino, le32_to_cpu(dir->i_generation)
+    };
+    const u8 *block;
+    u64 pblk, bad;
 
-    blknum = inode->i_block[ptrs[0]];
+    if (ext2_map_block(info, ino, dir, n, &pblk) || !pblk)
+        return NULL;
 
-    for (i=1; i < nptrs; i++)
+    block = ext2_get_meta(info, pblk, ext2_verify_dir_block, &ctx, &bad);
+    if (block && bad)
     {
-        bread(block, info->block_size, blknum, info->dev);
-        blknum = ((u32 *) block)[ptrs[i]];
+        bcache_put(info->cache, block);
+        return NULL;
     }
-    talloc_free(block);
-    return bread_m(info->block_size, blknum, 1, info->dev);
+    return block;
 }
 
 int ext2_read_inode(struct ext2_info *info, u32 ino, struct ext2_inode *ret)
 {
     u32 inodes_per_group = le32_to_cpu(info->sb.s_inodes_per_group);
-    u32 inode_size = le32_to_cpu(info->sb.s_inode_size);
-    u32 inodes_per_block = info->block_size / inode_size;
+    u32 per_block_bits = info->block_bits - info->inode_bits;
+    u32 inodes_per_block = 1 << per_block_bits;
+    struct ext2_csum_ctx ctx = { info };
     u64 tbl_addr, blk_addr, blk_ofs;
-    u8 *inode_table;
+    const u8 *inode_table;
+    u64 bad;
 
-    if (ino == FUSE_ROOT_ID)
-        ino = EXT2_ROOT_INO;
+    ino = ext2_ino(ino);
+
+    if (info->preload)
+    {
+        int err = ext2_preload_inode(info, ino, ret);
+
+        if (err != -EAGAIN)
+            return err;
+    }
 
     /* inodes are 1-based */
     ino--;
@@ -109,58 +720,141 @@ int ext2_read_inode(struct ext2_info *info, u32 ino, struct ext2_inode *ret)
     int bg = ino / inodes_per_group;
     int offs = ino % inodes_per_group;
 
+    if (bg >= info->ngroups)
+        return -ENOENT;
+    if (info->bad_groups && info->bad_groups[bg])
+        return -EIO;
+
     /* now find the corresponding inode table */
-    tbl_addr = info->groups[bg].bg_inode_table;
+    tbl_addr = ext2_inode_table(info, bg);
 
     /* and get the block that is offs / inodes_per_block... */
-    blk_addr = tbl_addr + offs / inodes_per_block;
-    blk_ofs = offs % inodes_per_block;
+    blk_addr = tbl_addr + (offs >> per_block_bits);
+    blk_ofs = offs & (inodes_per_block - 1);
+
+    trace(ext2_read_inode, ino + 1, blk_addr, 0);
 
     /* finally, read it */
-    inode_table = bread_m(info->block_size, blk_addr, 1, info->dev);
+    ctx.ino = ino + 1 - blk_ofs;
+    inode_table = ext2_get_meta(info, blk_addr, ext2_verify_inodes, &ctx,
+                                &bad);
+    if (!inode_table)
+        return -EIO;
+
+    if (bad & ext2_inode_bad_bit(blk_ofs, inodes_per_block))
+    {
+        bcache_put(info->cache, inode_table);
+        return -EIO;
+    }
 
     /* copy into ret */
-    memcpy(ret, (struct ext2_inode *) (inode_table + blk_ofs * inode_size),
-           sizeof(*ret));
+    memcpy(ret, inode_table + (blk_ofs << info->inode_bits), sizeof(*ret));
 
-    talloc_free(inode_table);
+    bcache_put(info->cache, inode_table);
 
     return 0;
 }
 
 int ext2_read_super(struct ext2_info *info)
 {
+    const u8 *raw = (const u8 *) &info->sb;
     int res;
     int i;
     int group_desc_sz;      /* size of group desc, in blocks */
 
-    res = bread(&info->sb, EXT2_MIN_BLOCK_SIZE, 1, info->dev);
+    if (!bread(&info->sb, EXT2_MIN_BLOCK_SIZE, 1, info->dev))
+        return -EIO;
+    if (le16_to_cpu(info->sb.s_magic) != EXT2_SUPER_MAGIC)
+        return -EINVAL;
 
-    if (res != 1)
-        goto err;
+    info->csum = info->verify_csum &&
+        (get_le32(raw + EXT4_SB_FEATURE_RO_COMPAT) &
+         EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+
+    if (info->verify_csum && !info->csum)
+        fprintf(stderr, "ext2: no metadata checksums to verify\n");
+
+    if (info->csum)
+    {
+        if (crc32c(~0, raw, EXT4_SB_CHECKSUM) !=
+            get_le32(raw + EXT4_SB_CHECKSUM))
+        {
+            fprintf(stderr, "ext2: superblock checksum mismatch\n");
+            ext2_csum_error(info);
+            res = -EIO;
+            goto err;
+        }
+
+        if (get_le32(raw + EXT4_SB_FEATURE_INCOMPAT) &
+            EXT4_FEATURE_INCOMPAT_CSUM_SEED)
+            info->csum_seed = get_le32(raw + EXT4_SB_CHECKSUM_SEED);
+        else
+            info->csum_seed = crc32c(~0, raw + EXT4_SB_UUID, 16);
+    }
 
     /* swap endianness for some ext2_fs.h macros */
     info->sb.s_log_block_size = le32_to_cpu(info->sb.s_log_block_size);
     info->sb.s_log_frag_size = le32_to_cpu(info->sb.s_log_frag_size);
 
+    /* up to 64K blocks */
+    if (info->sb.s_log_block_size > 6)
+        return -EINVAL;
+
     info->block_size = EXT2_BLOCK_SIZE(&info->sb);
+    info->block_bits = EXT2_MIN_BLOCK_LOG_SIZE + info->sb.s_log_block_size;
     info->frag_size = EXT2_FRAG_SIZE(&info->sb);
-
-    /* note, this is only valid for EXT2_DYNAMIC_REV */
-    info->inode_size = le32_to_cpu(info->sb.s_inode_size);
+    info->kern = ext2_kernels_for(info->block_bits);
+
+    /* revision 0 has no s_inode_size */
+    info->inode_size = EXT4_GOOD_OLD_INODE_SIZE;
+    if (le32_to_cpu(info->sb.s_rev_level) != EXT2_GOOD_OLD_REV)
+        info->inode_size = le16_to_cpu(info->sb.s_inode_size);
+    if (info->inode_size < EXT4_GOOD_OLD_INODE_SIZE ||
+        info->inode_size > info->block_size ||
+        (info->inode_size & (info->inode_size - 1)))
+        return -EINVAL;
+    info->inode_bits = __builtin_ctz(info->inode_size);
+
+    info->desc_size = EXT2_MIN_DESC_SIZE;
+    if (get_le32(raw + EXT4_SB_FEATURE_INCOMPAT) &
+        EXT4_FEATURE_INCOMPAT_64BIT)
+        info->desc_size = get_le16(raw + EXT4_SB_DESC_SIZE);
 
     info->ngroups = div_round(le32_to_cpu(info->sb.s_blocks_count),
         le32_to_cpu(info->sb.s_blocks_per_group));
 
-    /* read in all of the group descriptors */
-    group_desc_sz = div_round(info->ngroups * sizeof(struct ext2_group_desc),
+    info->cache = bcache_new(info, info->dev, info->block_size,
+                             EXT2_CACHE_BLOCKS);
+
+    /* read in all of the group descriptors, after the superblock */
+    group_desc_sz = div_round(info->ngroups * info->desc_size,
                   info->block_size);
 
     info->groups = talloc_size(info, group_desc_sz * info->block_size);
     for (i=0; i < group_desc_sz; i++)
     {
-        int ofs = i * info->block_size / sizeof(struct ext2_group_desc);
-        bread(&info->groups[ofs], info->block_size, 1+i, info->dev);
+        if (bread(info->groups + i * info->block_size, info->block_size,
+                  le32_to_cpu(info->sb.s_first_data_block) + 1 + i,
+                  info->dev) != 1)
+        {
+            res = -EIO;
+            goto err;
+        }
+    }
+
+    /* a group with a bad descriptor has its inodes read as EIO */
+    if (info->csum)
+    {
+        info->bad_groups = talloc_zero_array(info, u8, info->ngroups);
+        for (i=0; i < info->ngroups; i++)
+        {
+            if (!ext2_group_desc_csum_ok(info, i,
+                    info->groups + (size_t) i * info->desc_size))
+            {
+                info->bad_groups[i] = 1;
+                ext2_csum_error(info);
+            }
+        }
     }
 
     res = 0;
@@ -171,9 +865,11 @@ err:
 int ext2_stat(struct ext2_info *info, u32 ino, struct stat *st)
 {
     struct ext2_inode inode;
+    int err;
 
-    if (ext2_read_inode(info, ino, &inode))
-        return ENOENT;
+    err = ext2_read_inode(info, ino, &inode);
+    if (err)
+        return -err;
 
     st->st_ino = ino;
     st->st_mode = le16_to_cpu(inode.i_mode);
@@ -190,377 +886,853 @@ int ext2_stat(struct ext2_info *info, u32 ino, struct stat *st)
     return 0;
 }
 
-/* FUSE API */
+ssize_t ext2_read_data(struct ext2_info *info, u32 ino,
+                       struct ext2_inode *inode, void *buf, size_t size,
+                       off_t off)
+{
+    return info->kern->read_data(info, ino, inode, buf, size, off);
+}
+
+/*
+ * Parse directory ino into dir: every live entry, in on-disk order, with
+ * the names packed into one buffer.  Returns 0 or an errno.
+ */
+static int ext2_read_dir(struct ext2_info *info, u32 ino,
+                         struct ext2_dir *dir)
+{
+    struct ext2_inode inode;
+    struct ext2_dir_entry_2 *entry;
+    struct ext2_dirent *ent;
+    u32 dirsize, nblocks, names_len = 0, names_max = 256, max = 16;
+    u32 blk, j, rec_len;
+    int err = 0;
+
+    if (ext2_read_inode(info, ino, &inode))
+        return EIO;
+
+    dirsize = le32_to_cpu(inode.i_size);
+    nblocks = (dirsize + info->block_size - 1) >> info->block_bits;
+
+    dir->entries = talloc_array(dir, struct ext2_dirent, max);
+    dir->names = talloc_size(dir, names_max);
+
+    for (blk=0; blk < nblocks; blk++)
+    {
+        const u8 *block = ext2_get_dir_block(info, ext2_ino(ino), &inode,
+                                             blk);
+        if (!block)
+        {
+            err = EIO;
+            break;
+        }
+
+        for (j=0; j + 8 <= info->block_size; j += rec_len)
+        {
+            entry = (struct ext2_dir_entry_2 *) &block[j];
+            rec_len = le16_to_cpu(entry->rec_len);
+
+            /* a damaged entry ends the block rather than the listing */
+            if (rec_len < 8 || j + rec_len > info->block_size ||
+                8 + entry->name_len > rec_len)
+                break;
+
+            /* unused entries, including the checksum tail */
+            if (!entry->inode)
+                continue;
+
+            if (dir->nentries == max)
+            {
+                max *= 2;
+                dir->entries = talloc_realloc(dir, dir->entries,
+                                              struct ext2_dirent, max);
+            }
+            while (names_len + entry->name_len + 1 > names_max)
+            {
+                names_max *= 2;
+                dir->names = talloc_realloc_size(dir, dir->names, names_max);
+            }
+
+            ent = &dir->entries[dir->nentries++];
+            ent->ino = le32_to_cpu(entry->inode);
+            ent->name = names_len;
+            ent->file_type = entry->file_type;
+
+            memcpy(dir->names + names_len, entry->name, entry->name_len);
+            names_len += entry->name_len;
+            dir->names[names_len++] = 0;
+        }
+        bcache_put(info->cache, block);
+    }
+
+    trace(ext2_opendir, ino, dir->nentries, err);
+    return err;
+}
+
+static int ext2_blk_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a, y = *(const u64 *) b;
 
-static void ext2_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * The kernel follows a readdir reply with a lookup and getattr of each
+ * name in it.  Start reading the inode table blocks those will want now,
+ * in disk order and merged into runs, so they find them cached.
+ */
+void ext2_prefetch_inodes(struct ext2_info *info,
+                          const struct ext2_dirent *ents, u32 n)
+{
+    u32 inodes_per_group = le32_to_cpu(info->sb.s_inodes_per_group);
+    u32 per_block_bits = info->block_bits - info->inode_bits;
+    u64 blks[EXT2_PREFETCH_BLOCKS];
+    u32 i, nblks = 0, run;
+    u32 ino, bg;
+    u64 blk;
+
+    for (i=0; i < n && nblks < EXT2_PREFETCH_BLOCKS; i++)
+    {
+        ino = ents[i].ino - 1;
+        bg = ino / inodes_per_group;
+        if (bg >= info->ngroups || (info->bad_groups && info->bad_groups[bg]))
+            continue;
+
+        blk = ext2_inode_table(info, bg) +
+              ((ino % inodes_per_group) >> per_block_bits);
+        if (!nblks || blks[nblks - 1] != blk)
+            blks[nblks++] = blk;
+    }
+
+    qsort(blks, nblks, sizeof(*blks), ext2_blk_cmp);
+    for (i=0; i < nblks; i += run)
+    {
+        for (run=1; i + run < nblks && blks[i + run] <= blks[i + run - 1] + 1;
+             run++)
+            ;
+        bcache_prefetch(info->cache, blks[i], blks[i + run - 1] - blks[i] + 1);
+    }
+}
+
+/* the file type of a directory entry, as an st_mode */
+u32 ext2_dirent_mode(const struct ext2_dirent *ent)
 {
-    struct ext2_info *info = fuse_req_userdata(req);
-    struct ext2_inode dir;
-    struct fuse_entry_param result;
+    switch (ent->file_type)
+    {
+        case EXT2_FT_DIR:
+            return S_IFDIR;
+        case EXT2_FT_SYMLINK:
+            return S_IFLNK;
+        case EXT2_FT_CHRDEV:
+            return S_IFCHR;
+        case EXT2_FT_BLKDEV:
+            return S_IFBLK;
+        case EXT2_FT_FIFO:
+            return S_IFIFO;
+        case EXT2_FT_SOCK:
+            return S_IFSOCK;
+        case EXT2_FT_REG_FILE:
+        default:
+            return S_IFREG;
+    }
+}
+
+/*
+ * Look name up in directory dir, from its preloaded copy if there is one
+ * or else straight from its blocks.
+ */
+int ext2_find_child(struct ext2_info *info, u32 dir, const char *name,
+                    u32 *ino)
+{
+    struct ext2_inode inode;
     struct ext2_dir_entry_2 *entry;
+    struct ext2_dir *pdir;
+    struct ext2_dirent *ent;
+    int err = ENOENT;
     int dirsize;
     int i, j;
     int namelen, tgt_namelen;
 
-    if (ext2_read_inode(info, parent, &dir))
+    /* a preloaded directory is looked up in memory */
+    pdir = ext2_preload_dir(info, ext2_ino(dir));
+    if (pdir)
+    {
+        ent = ext2_dir_find(pdir, name);
+        if (!ent)
+            goto out;
+
+        *ino = ent->ino;
+        trace(ext2_lookup, dir, *ino, 0);
+        return 0;
+    }
+
+    if (ext2_read_inode(info, dir, &inode))
         goto out;
 
-    dirsize = le32_to_cpu(dir.i_size);
+    dirsize = le32_to_cpu(inode.i_size);
     tgt_namelen = strlen(name);
 
     /* scan directory associated with ino for name */
     for (i=0; i < dirsize; i += info->block_size)
     {
-        u8 *block = ext2_get_block_n(info, &dir, i / info->block_size);
+        const u8 *block = ext2_get_dir_block(info, ext2_ino(dir), &inode,
+                                             i >> info->block_bits);
         if (!block)
+        {
+            err = EIO;
             goto out;
+        }
 
         for (j=0; j < info->block_size && j < dirsize; )
         {
             entry = (struct ext2_dir_entry_2 *) &block[j];
 
-            namelen = le32_to_cpu(entry->name_len);
+            namelen = entry->name_len;
 
-            if (namelen == tgt_namelen &&
-                strncmp(entry->name, name, le32_to_cpu(entry->name_len)) == 0)
+            if (entry->inode && namelen == tgt_namelen &&
+                strncmp(entry->name, name, namelen) == 0)
             {
                 /* got it - return success */
-                result.ino = le32_to_cpu(entry->inode);
-                ext2_stat(info, result.ino, &result.attr);
-                talloc_free(block);
-                goto found;
+                *ino = le32_to_cpu(entry->inode);
+                trace(ext2_lookup, dir, *ino, 0);
+                bcache_put(info->cache, block);
+                return 0;
             }
-            j += le32_to_cpu(entry->rec_len);
+            if (!entry->rec_len)
+                break;
+            j += le16_to_cpu(entry->rec_len);
         }
-        talloc_free(block);
+        bcache_put(info->cache, block);
     }
 
 out:
-    fuse_reply_err(req, ENOENT);
-    return;
-
-found:
-    fuse_reply_entry(req, &result);
+    trace(ext2_lookup, dir, 0, 0);
+    return err;
 }
 
-static
-void ext2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+int ext2_open_dir(struct ext2_info *info, u32 ino, struct ext2_dir **dirp)
 {
+    struct ext2_dir *dir;
     int err;
-    struct ext2_info *info = fuse_req_userdata(req);
-    struct stat st;
 
-    err = ext2_stat(info, ino, &st);
+    /* preloaded directories are listed as they are */
+    dir = ext2_preload_dir(info, ext2_ino(ino));
+    if (dir)
+    {
+        *dirp = dir;
+        return 0;
+    }
+
+    dir = talloc_zero(NULL, struct ext2_dir);
+    if (!dir)
+        return ENOMEM;
+
+    err = ext2_read_dir(info, ino, dir);
     if (err)
-        goto out;
+    {
+        talloc_free(dir);
+        return err;
+    }
 
-    fuse_reply_attr(req, &st, 1.0);
-    return;
-out:
-    fuse_reply_err(req, err);
+    *dirp = dir;
+    return 0;
 }
 
-static void ext2_readlink(fuse_req_t req, fuse_ino_t ino)
+void ext2_close_dir(struct ext2_dir *dir)
 {
-    fuse_reply_err(req, EIO);
+    if (!dir->preloaded)
+        talloc_free(dir);
 }
 
-static
-void ext2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
-{
-    struct ext2_info *info = fuse_req_userdata(req);
-    struct ext2_inode *inode;
-
-    inode = talloc_size(info, sizeof(struct ext2_inode));
-
-    /* read the inode and store it in fi->fh */
-    if (ext2_read_inode(info, ino, inode))
-        fuse_reply_err(req, ENOENT);
-
-    fi->fh = (uint64_t) (unsigned long) inode;
-    fuse_reply_open(req, fi);
-}
+/* preload */
 
-static void ext2_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-               struct fuse_file_info *fi)
+struct ext2_preload_worker
 {
-    struct ext2_info *info = fuse_req_userdata(req);
-    struct ext2_inode *inode = (struct ext2_inode *) (unsigned long) fi->fh;
-    u32 blk_start, blk_ofs;
-    int nblocks;
-    char *buf;
-    int bufsize = 0;
-    int i;
-
-    buf = talloc_size(info, size);
-    blk_start = off / info->block_size;
-    blk_ofs = off % info->block_size;
-
-    /* compute actual size to read */
-    size = min(size, inode->i_size - off);
-    nblocks = div_round(size + blk_ofs, info->block_size);
+    struct ext2_preload *p;
+    void *ctx;              /* this thread's allocations */
+    u8 *buf;
+    int (*fn)(struct ext2_preload_worker *w, u32 bg);
+};
 
-    /* read all the associated blocks, and copy as space allows */
-    for (i=blk_start; i < blk_start + nblocks; i++)
+/* account for n more bytes, unless that goes over the cap */
+static int ext2_preload_charge(struct ext2_preload *p, u64 n)
+{
+    if (__atomic_add_fetch(&p->mem, n, __ATOMIC_RELAXED) > p->max_mem)
     {
-        u8 *block = ext2_get_block_n(info, inode, i);
-        if (!block)
-            goto out;
-
-        memcpy(buf + bufsize, block + blk_ofs, info->block_size - blk_ofs);
-        bufsize += info->block_size - blk_ofs;
-        blk_ofs = 0;
+        __atomic_sub_fetch(&p->mem, n, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->capped, 1, __ATOMIC_RELAXED);
+        return -ENOMEM;
     }
-    fuse_reply_buf(req, buf, bufsize);
-    return;
-
-out:
-    fuse_reply_err(req, EIO);
+    return 0;
 }
 
-static
-void ext2_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static inline int ext2_bit(const u8 *bitmap, u32 i)
 {
-    struct ext2_inode *inode = (struct ext2_inode *) (unsigned long) fi->fh;
-
-    talloc_free(inode);
-    fuse_reply_err(req, 0);
+    return bitmap[i >> 3] & (1 << (i & 7));
 }
 
-static
-void ext2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+/*
+ * Copy a group's in-use inodes.  The inode bitmap says which are in use;
+ * with uninit_bg the table past bg_itable_unused, or all of it in a group
+ * flagged INODE_UNINIT, was never written and isn't looked at.  The
+ * table blocks holding any are read in runs of up to EXT2_PRELOAD_IO.
+ */
+static int ext2_preload_inodes(struct ext2_preload_worker *w, u32 bg)
 {
-    fuse_reply_open(req, fi);
-}
+    struct ext2_preload *p = w->p;
+    struct ext2_info *info = p->info;
+    const struct ext4_group_desc *gd =
+        (const void *) (info->groups + (size_t) bg * info->desc_size);
+    const u8 *raw = (const u8 *) &info->sb;
+    struct ext2_csum_ctx ctx = { info };
+    u32 ipg = le32_to_cpu(info->sb.s_inodes_per_group);
+    u32 per_block = 1 << (info->block_bits - info->inode_bits);
+    u32 io_blocks = max(1, EXT2_PRELOAD_IO / info->block_size);
+    u32 used = ipg, nused = 0, unused, n = 0;
+    u32 i, blk, run, k, first;
+    u64 bitmap_blk, table, bad;
+    const u8 *block;
+    u8 *bitmap;
+    ssize_t ret;
+
+    if (info->bad_groups && info->bad_groups[bg])
+        return 0;
+
+    if (get_le32(raw + EXT4_SB_FEATURE_RO_COMPAT) &
+        (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+         EXT4_FEATURE_RO_COMPAT_METADATA_CSUM))
+    {
+        if (le16_to_cpu(gd->bg_flags) & EXT4_BG_INODE_UNINIT)
+            return 0;
 
-static
-void ext2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                  struct fuse_file_info *fi)
-{
-    struct ext2_info *info = fuse_req_userdata(req);
-    struct ext2_super_block *sb = &info->sb;
-    struct ext2_inode dir;
-    struct ext2_dir_entry_2 *entry;
-    struct stat file_info;
-    int i, j;
-    int curblk, curofs;
-    int dirsize;
-    char *buf;
-    int bufsize = 0, ret;
-    char name[EXT2_NAME_LEN+1];
-    int namelen;
+        unused = le16_to_cpu(gd->bg_itable_unused_lo);
+        if (info->desc_size > EXT2_MIN_DESC_SIZE)
+            unused |= (u32) le16_to_cpu(gd->bg_itable_unused_hi) << 16;
+        used = ipg - min(unused, ipg);
+    }
 
-    if (ext2_read_inode(info, ino, &dir))
-        goto err;
+    bitmap_blk = le32_to_cpu(gd->bg_inode_bitmap_lo);
+    if (info->desc_size > EXT2_MIN_DESC_SIZE)
+        bitmap_blk |= (u64) le32_to_cpu(gd->bg_inode_bitmap_hi) << 32;
 
-    buf = talloc_size(info, size);
+    bitmap = talloc_size(NULL, info->block_size);
+    if (!bread(bitmap, info->block_size, bitmap_blk, info->dev))
+    {
+        talloc_free(bitmap);
+        return -EIO;
+    }
 
-    dirsize = dir.i_size;
+    used = min(used, info->block_size * 8);
+    for (i=0; i < used; i++)
+        if (ext2_bit(bitmap, i))
+            nused++;
 
-    for (i=off; i < off + size && i < dirsize; )
+    if (!nused || ext2_preload_charge(p, nused * sizeof(struct ext2_inode)))
     {
-        curblk = i / info->block_size;
-        curofs = i % info->block_size;
+        talloc_free(bitmap);
+        return 0;
+    }
+    p->inodes[bg] = talloc_array(w->ctx, struct ext2_inode, nused);
 
-        u8 *block = ext2_get_block_n(info, &dir, curblk);
-        if (!block)
-            goto err;
+    table = ext2_inode_table(info, bg);
+    for (blk = 0; blk * per_block < used; blk += run)
+    {
+        /* a run of blocks each with an inode in use */
+        for (run = 0; run < io_blocks && (blk + run) * per_block < used;
+             run++)
+        {
+            for (i = (blk + run) * per_block;
+                 i < min(used, (blk + run + 1) * per_block) &&
+                 !ext2_bit(bitmap, i); i++)
+                ;
+            if (i == min(used, (blk + run + 1) * per_block))
+                break;
+        }
+        if (!run)
+        {
+            run = 1;
+            continue;
+        }
 
-        /* parse all of the directory items, etc */
-        for (j=curofs; j < info->block_size && j < dirsize; )
+        ret = bdev_pread(info->dev, w->buf, (size_t) run * info->block_size,
+                         (table + blk) * info->block_size);
+        trace(ext2_bread, table + blk, run * info->block_size, ret);
+        if (ret != (ssize_t) run * info->block_size)
         {
-            entry = (struct ext2_dir_entry_2 *) &block[j];
+            talloc_free(bitmap);
+            return -EIO;
+        }
 
-            struct stat st = {
-                .st_ino = le32_to_cpu(entry->inode),
-            };
+        for (k=0; k < run; k++)
+        {
+            block = w->buf + (size_t) k * info->block_size;
+            first = (blk + k) * per_block;
 
-            switch (entry->file_type)
+            bad = 0;
+            if (info->csum)
             {
-                case EXT2_FT_DIR:
-                    st.st_mode |= S_IFDIR;
-                    break;
-                case EXT2_FT_REG_FILE:
-                default:
-                    st.st_mode |= S_IFREG;
-                    break;
+                ctx.ino = bg * ipg + first + 1;
+                bad = ext2_verify_inodes(&ctx, table + blk + k, block);
             }
 
-            namelen = le32_to_cpu(entry->name_len);
-            memcpy(name, entry->name, namelen);
-            name[namelen] = 0;
-
-            ret = fuse_add_direntry(req, buf + bufsize, size - bufsize, name,
-                                    &st, i + j + entry->rec_len);
-            if (ret >= size - bufsize)
+            for (i = first; i < min(used, first + per_block); i++)
             {
-                talloc_free(block);
-                goto done;
+                if (!ext2_bit(bitmap, i))
+                    continue;
+
+                if (bad & ext2_inode_bad_bit(i - first, per_block))
+                {
+                    p->slots[bg * ipg + i] = ~0U;
+                    continue;
+                }
+                memcpy(&p->inodes[bg][n], block +
+                       (size_t) (i - first) * info->inode_size,
+                       sizeof(struct ext2_inode));
+                p->slots[bg * ipg + i] = ++n;
             }
-
-            bufsize += ret;
-            j += le32_to_cpu(entry->rec_len);
         }
-        talloc_free(block);
-        i += j;
     }
 
-done:
-    fuse_reply_buf(req, buf, bufsize);
-    talloc_free(buf);
-    return;
-
-err:
-    fuse_reply_err(req, EIO);
+    p->counts[bg] = n;
+    __atomic_add_fetch(&p->loaded, n, __ATOMIC_RELAXED);
+    talloc_free(bitmap);
+    return 0;
 }
 
-static void ext2_releasedir(fuse_req_t req, fuse_ino_t ino,
-                     struct fuse_file_info *fi)
+static void ext2_dir_index(struct ext2_dir *dir)
 {
-    fuse_reply_err(req, 0);
+    u32 size = 4;
+    u32 i, h;
+
+    /* keep the table at most half full */
+    while (size < dir->nentries * 2)
+        size <<= 1;
+
+    dir->hash = talloc_zero_array(dir, u32, size);
+    dir->hash_mask = size - 1;
+
+    for (i=0; i < dir->nentries; i++)
+    {
+        h = ext2_name_hash(dir->names + dir->entries[i].name) &
+            dir->hash_mask;
+        while (dir->hash[h])
+            h = (h + 1) & dir->hash_mask;
+        dir->hash[h] = i + 1;
+    }
 }
 
-static void ext2_statfs(fuse_req_t req, fuse_ino_t ino)
+/* parse and index every directory among a group's preloaded inodes */
+static int ext2_preload_dirs(struct ext2_preload_worker *w, u32 bg)
 {
-    struct ext2_info *fsi = fuse_req_userdata(req);
-    struct ext2_super_block *sb = &fsi->sb;
+    struct ext2_preload *p = w->p;
+    struct ext2_info *info = p->info;
+    u32 ipg = le32_to_cpu(info->sb.s_inodes_per_group);
+    struct ext2_dir *dir;
+    u32 i, slot;
 
-    struct statvfs stbuf = {
-        .f_bsize = fsi->block_size,
-        .f_frsize = fsi->frag_size,
-        .f_blocks = le32_to_cpu(sb->s_blocks_count),
-        .f_bfree = le32_to_cpu(sb->s_free_blocks_count),
-        .f_bavail = le32_to_cpu(sb->s_free_blocks_count) -
-                    le32_to_cpu(sb->s_r_blocks_count),
-        .f_files = le32_to_cpu(sb->s_inodes_count),
-        .f_ffree = le32_to_cpu(sb->s_free_inodes_count),
-        .f_favail = le32_to_cpu(sb->s_free_inodes_count),
-        .f_fsid = sb->s_magic,
-        .f_flag = 0,
-        .f_namemax = EXT2_NAME_LEN,
-    };
+    for (i=0; i < ipg && !__atomic_load_n(&p->capped, __ATOMIC_RELAXED); i++)
+    {
+        slot = p->slots[bg * ipg + i];
+        if (!slot || slot == ~0U ||
+            !S_ISDIR(le16_to_cpu(p->inodes[bg][slot - 1].i_mode)))
+            continue;
 
-    fuse_reply_statfs(req, &stbuf);
+        dir = talloc_zero(w->ctx, struct ext2_dir);
+        if (ext2_read_dir(info, bg * ipg + i + 1, dir))
+        {
+            /* left to fail again at opendir */
+            talloc_free(dir);
+            continue;
+        }
+        ext2_dir_index(dir);
+        dir->preloaded = 1;
+
+        if (ext2_preload_charge(p, talloc_total_size(dir)))
+        {
+            talloc_free(dir);
+            break;
+        }
+
+        if (!p->dirs[bg])
+            p->dirs[bg] = talloc_zero_array(w->ctx, struct ext2_dir *,
+                                            p->counts[bg]);
+        p->dirs[bg][slot - 1] = dir;
+        __atomic_add_fetch(&p->ndirs, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
 }
 
-static void ext2_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
-                   size_t size)
+static void *ext2_preload_thread(void *arg)
 {
+    struct ext2_preload_worker *w = arg;
+    struct ext2_preload *p = w->p;
+    u32 bg;
+
+    while ((bg = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) <
+           p->info->ngroups)
+    {
+        if (w->fn(w, bg))
+            fprintf(stderr, "ext2: preload: group %u unreadable\n", bg);
+        __atomic_add_fetch(&p->groups_done, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (!--p->running)
+        pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
 }
 
-static void ext2_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+static void ext2_preload_report(struct ext2_preload *p, const char *what)
 {
+    u32 done = __atomic_load_n(&p->groups_done, __ATOMIC_RELAXED);
+    u64 loaded = __atomic_load_n(&p->loaded, __ATOMIC_RELAXED);
+    u64 ndirs = __atomic_load_n(&p->ndirs, __ATOMIC_RELAXED);
+    u64 mem = __atomic_load_n(&p->mem, __ATOMIC_RELAXED);
+
+    fprintf(stderr, "ext2: preloading %s: %u/%u groups, %llu inodes, "
+            "%llu directories, %llu MB\n", what, done, p->info->ngroups,
+            (unsigned long long) loaded, (unsigned long long) ndirs,
+            (unsigned long long) (mem >> 20));
 }
 
-static void ext2_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
-               uint64_t idx)
+/* run fn over every group on the workers, reporting every second */
+static void ext2_preload_run(struct ext2_preload *p,
+                             struct ext2_preload_worker *workers,
+                             int nthreads, const char *what,
+                             int (*fn)(struct ext2_preload_worker *, u32))
 {
-    /* fuse_reply_bmap(req, idx) */
+    pthread_t *threads = talloc_array(NULL, pthread_t, nthreads);
+    struct timespec ts;
+    int t;
+
+    p->next = 0;
+    p->groups_done = 0;
+    p->running = nthreads;
+
+    for (t=0; t < nthreads; t++)
+    {
+        workers[t].fn = fn;
+        if (pthread_create(&threads[t], NULL, ext2_preload_thread,
+                           &workers[t]))
+            break;
+    }
+
+    /* if no thread could be started, do it here */
+    if (!t)
+    {
+        p->running = 1;
+        ext2_preload_thread(&workers[0]);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->running -= nthreads - max(t, 1);
+    while (p->running)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        if (pthread_cond_timedwait(&p->cond, &p->lock, &ts) == ETIMEDOUT)
+            ext2_preload_report(p, what);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    while (t--)
+        pthread_join(threads[t], NULL);
+    talloc_free(threads);
 }
 
-static struct fuse_lowlevel_ops ext2_ops = {
-    .lookup = ext2_lookup,
-    .getattr = ext2_getattr,
-    .readlink = ext2_readlink,
-    .open = ext2_open,
-    .read = ext2_read,
-    .release = ext2_release,
-    .opendir = ext2_opendir,
-    .readdir = ext2_readdir,
-    .releasedir = ext2_releasedir,
-    .statfs = ext2_statfs,
 /*
-    .getxattr = ext2_getxattr,
-    .listxattr = ext2_listxattr,
-    .bmap = ext2_bmap
-*/
+ * Read every in-use inode and parse every directory into memory, on
+ * nthreads threads (0 for one per CPU) taking a group at a time: first
+ * the inode tables, then, with those in place, the directories.  Past
+ * max_mem bytes the rest is left to be read as needed.
+ */
+int ext2_preload(struct ext2_info *info, int nthreads, u64 max_mem)
+{
+    struct ext2_preload *p;
+    struct ext2_preload_worker *workers;
+    u32 ninodes = le32_to_cpu(info->sb.s_inodes_count);
+    int t;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    p = talloc_zero(info, struct ext2_preload);
+    p->info = info;
+    p->max_mem = max_mem;
+    p->ninodes = min(ninodes, info->ngroups *
+                     le32_to_cpu(info->sb.s_inodes_per_group));
+    p->inodes = talloc_zero_array(p, struct ext2_inode *, info->ngroups);
+    p->counts = talloc_zero_array(p, u32, info->ngroups);
+    p->dirs = talloc_zero_array(p, struct ext2_dir **, info->ngroups);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if (ext2_preload_charge(p, (u64) p->ninodes * sizeof(*p->slots)))
+    {
+        talloc_free(p);
+        return -ENOMEM;
+    }
+    p->slots = talloc_zero_array(p, u32, p->ninodes);
+
+    workers = talloc_zero_array(p, struct ext2_preload_worker, nthreads);
+    for (t=0; t < nthreads; t++)
+    {
+        workers[t].p = p;
+        workers[t].ctx = talloc_new(p);
+        workers[t].buf = talloc_size(workers[t].ctx,
+            max(EXT2_PRELOAD_IO, info->block_size));
+    }
+
+    ext2_preload_run(p, workers, nthreads, "inodes", ext2_preload_inodes);
+
+    /* directories read their inodes from what is loaded so far */
+    info->preload = p;
+    ext2_preload_run(p, workers, nthreads, "directories", ext2_preload_dirs);
+
+    for (t=0; t < nthreads; t++)
+        talloc_free(workers[t].buf);
+    talloc_free(workers);
+
+    fprintf(stderr, "ext2: preloaded %llu inodes and %llu directories, "
+            "%llu MB%s\n", (unsigned long long) p->loaded,
+            (unsigned long long) p->ndirs,
+            (unsigned long long) (p->mem >> 20),
+            p->capped ? "; over the cap, the rest is read as needed" : "");
+    return 0;
+}
+
+/* manifests */
+
+/* directories deeper than this are taken to be a loop */
+#define EXT2_MANIFEST_MAX_DEPTH 256
+
+struct ext2_manifest_file
+{
+    u32 ino;
+    struct ext2_inode inode;
 };
 
-int main(int argc, char *argv[])
-{
-    struct ext2_info *ctx;
-    int i, fuse_argc=0;
-    char *device;
-    struct fuse_session *sess;
-    struct fuse_chan *chan;
-    struct fuse_args args;
-    char *mountpoint;
-    int multithreaded;
-    int foreground;
-    int res;
+static ssize_t ext2_manifest_read(void *fs, void *file, void *buf,
+                                  size_t len, u64 off)
+{
+    struct ext2_manifest_file *f = file;
+
+    return ext2_read_data(fs, f->ino, &f->inode, buf, len, off);
+}
+
+static void ext2_manifest_extents(struct ext2_info *info,
+                                  struct manifest_entry *e,
+                                  struct ext2_manifest_file *f)
+{
+    u64 blk, pblk;
+    u64 nblocks = div_round(e->size, info->block_size);
+
+    for (blk=0; blk < nblocks; blk++)
+    {
+        if (ext2_map_block(info, f->ino, &f->inode, blk, &pblk))
+            break;
+        if (pblk)
+            manifest_add_extent(e, blk * info->block_size,
+                                pblk * info->block_size,
+                                min(info->block_size,
+                                    e->size - blk * info->block_size));
+    }
+}
 
-    ctx = talloc(NULL, struct ext2_info);
+static void ext2_manifest_dir(struct ext2_info *info, struct manifest *m,
+                              u32 ino, const char *path, int depth)
+{
+    struct ext2_dir *dir = talloc_zero(NULL, struct ext2_dir);
+    struct ext2_manifest_file *f;
+    struct manifest_entry *e;
+    struct ext2_inode inode;
+    const char *name;
+    char *child;
+    u32 i, mode;
 
-    /* FIXME replace this with fuse_getopt */
-    char **fuse_argv = malloc((argc + 1) * sizeof(char *));
+    if (depth > EXT2_MANIFEST_MAX_DEPTH || ext2_read_dir(info, ino, dir))
+    {
+        fprintf(stderr, "ext2: %s/: could not list\n", path);
+        talloc_free(dir);
+        return;
+    }
 
-    for (i=0; i < argc; i++)
+    for (i=0; i < dir->nentries; i++)
     {
-        if ((strcmp(argv[i], "-a") == 0) && i + 1 < argc)
+        name = dir->names + dir->entries[i].name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        child = talloc_asprintf(dir, "%s/%s", path, name);
+        if (ext2_read_inode(info, dir->entries[i].ino, &inode))
         {
-            i++;
-            device = argv[i];
+            fprintf(stderr, "ext2: %s: bad inode %u\n", child,
+                    dir->entries[i].ino);
+            continue;
         }
-        else
-            fuse_argv[fuse_argc++] = argv[i];
+
+        mode = le16_to_cpu(inode.i_mode);
+        if (!S_ISREG(mode))
+        {
+            manifest_add(m, child, le32_to_cpu(inode.i_size), mode, NULL);
+            if (S_ISDIR(mode))
+                ext2_manifest_dir(info, m, dir->entries[i].ino, child,
+                                  depth + 1);
+            continue;
+        }
+
+        f = talloc(m, struct ext2_manifest_file);
+        f->ino = dir->entries[i].ino;
+        f->inode = inode;
+        e = manifest_add(m, child, le32_to_cpu(inode.i_size), mode, f);
+        ext2_manifest_extents(info, e, f);
     }
+    talloc_free(dir);
+}
 
-    fuse_argv[fuse_argc] = NULL;
+int ext2_write_manifest(struct ext2_info *info, const char *file,
+                        const char *hash, int nthreads)
+{
+    const struct hash_algo *algo = hash_find(hash);
+    struct ext2_inode root;
+    struct manifest *m;
+    FILE *out;
+    int errors;
 
-    if (!device)
+    if (!algo)
     {
-        fprintf(stderr, "Usage: %s -a <device_file> <mount_point>\n", argv[0]);
+        fprintf(stderr, "ext2: unknown hash %s\n", hash);
         return 1;
     }
 
-    FILE *fp = fopen(device, "r");
-    if (!fp)
+    out = strcmp(file, "-") == 0 ? stdout : fopen(file, "w");
+    if (!out)
     {
-        perror("ext2_fuse");
+        perror(file);
         return 2;
     }
 
-    ctx->dev = fp;
+    m = manifest_new(info, info->dev, algo, ext2_manifest_read, info);
+    if (!ext2_read_inode(info, EXT2_ROOT_INO, &root))
+        manifest_add(m, "/", le32_to_cpu(root.i_size),
+                     le16_to_cpu(root.i_mode), NULL);
+    ext2_manifest_dir(info, m, EXT2_ROOT_INO, "", 0);
 
-    if (ext2_read_super(ctx))
+    errors = manifest_run(m, nthreads, out);
+    if (errors)
+        fprintf(stderr, "ext2: %d files could not be read\n", errors);
+
+    talloc_free(m);
+    if (out != stdout)
+        fclose(out);
+    return errors ? 4 : 0;
+}
+
+/* library */
+
+struct ext2_fszoo_file
+{
+    u32 ino;
+    struct ext2_inode inode;
+};
+
+static int ext2_fszoo_open(void *mem_ctx, struct bdev *dev,
+                           const struct fszoo_opts *opts, void **fs)
+{
+    struct ext2_info *info = talloc_zero(mem_ctx, struct ext2_info);
+    int err;
+
+    info->dev = dev;
+    info->verify_csum = opts->csum;
+
+    err = ext2_read_super(info);
+    if (err)
     {
-        printf ("Could not read super block\n");
-        return 3;
+        talloc_free(info);
+        return err;
     }
+    *fs = info;
+    return 0;
+}
 
-    args.argc = fuse_argc;
-    args.argv = fuse_argv;
-    args.allocated = 0;
+static int ext2_fszoo_lookup(void *fs, u32 dir, const char *name, u32 *ino)
+{
+    return -ext2_find_child(fs, dir, name, ino);
+}
 
-    res = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
-    if (res == -1)
-        goto out_err;
+static int ext2_fszoo_stat(void *fs, u32 ino, struct stat *st)
+{
+    return -ext2_stat(fs, ino, st);
+}
 
-    printf ("mount %s\n", mountpoint);
+static int ext2_fszoo_readdir(void *fs, u32 ino, fszoo_dir_fn fn, void *arg)
+{
+    struct ext2_dir *dir;
+    struct ext2_dirent *ent;
+    struct stat st;
+    int err;
+    u32 i;
 
-    chan = fuse_mount(mountpoint, &args);
-    if (!chan)
-        goto out_err;
+    err = ext2_open_dir(fs, ino, &dir);
+    if (err)
+        return -err;
 
-    sess = fuse_lowlevel_new(&args, &ext2_ops, sizeof(ext2_ops), ctx);
-    fuse_session_add_chan(sess, chan);
+    for (i=0; i < dir->nentries; i++)
+    {
+        ent = &dir->entries[i];
+        memset(&st, 0, sizeof(st));
+        st.st_ino = ent->ino;
+        st.st_mode = ext2_dirent_mode(ent);
+        if (fn(arg, dir->names + ent->name, &st))
+            break;
+    }
 
-    res = fuse_daemonize(foreground);
-    if (res == -1)
-        goto err_unmount;
+    ext2_close_dir(dir);
+    return 0;
+}
 
-    res = fuse_set_signal_handlers(sess);
-    if (res == -1)
-        goto err_unmount;
+static int ext2_fszoo_open_file(void *fs, u32 ino, void **file)
+{
+    struct ext2_fszoo_file *f = talloc(NULL, struct ext2_fszoo_file);
+    int err;
+
+    if (!f)
+        return -ENOMEM;
 
-    fuse_session_loop_mt(sess);
-    talloc_free(ctx);
+    f->ino = ino;
+    err = ext2_read_inode(fs, ino, &f->inode);
+    if (err)
+    {
+        talloc_free(f);
+        return err;
+    }
+    *file = f;
     return 0;
+}
 
-err_unmount:
-    fuse_unmount(mountpoint, chan);
+static ssize_t ext2_fszoo_pread(void *fs, void *file, void *buf, size_t len,
+                                u64 off)
+{
+    struct ext2_fszoo_file *f = file;
 
-out_err:
-    free(mountpoint);
-    return 0;
+    return ext2_read_data(fs, f->ino, &f->inode, buf, len, off);
+}
+
+static void ext2_fszoo_close_file(void *fs, void *file)
+{
+    talloc_free(file);
 }
+
+const struct fszoo_ops ext2_fszoo_ops = {
+    .name = "ext2",
+    .root = EXT2_ROOT_INO,
+    .open = ext2_fszoo_open,
+    .lookup = ext2_fszoo_lookup,
+    .stat = ext2_fszoo_stat,
+    .readdir = ext2_fszoo_readdir,
+    .open_file = ext2_fszoo_open_file,
+    .pread = ext2_fszoo_pread,
+    .close_file = ext2_fszoo_close_file,
+};
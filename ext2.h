@@ -0,0 +1,108 @@
+#ifndef _EXT2_H
+#define _EXT2_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/ext2_fs.h>
+
+#include "config.h"
+#include "bdev.h"
+
+/*
+ * The ext2/ext4 reader, for ext2_fuse and the fszoo library.  Inode
+ * numbers are the filesystem's own, except that 1 (FUSE's root) is taken
+ * to mean the root directory.
+ */
+
+/* --preload stops loading at this much memory by default, in MB */
+#define EXT2_PRELOAD_MEM 256
+
+struct ext2_kernels;
+
+struct ext2_info
+{
+    struct bdev *dev;
+    struct ext2_super_block sb;
+    u8 *groups;             /* group descriptors, desc_size apart */
+    struct bcache *cache;   /* metadata blocks */
+
+    /* useful in-memory, cpu-endian values */
+    u32 block_size;
+    u32 frag_size;
+    u32 ngroups;
+    u32 inode_size;
+    u32 desc_size;
+    u32 block_bits;         /* log2 of block_size */
+    u32 inode_bits;         /* log2 of inode_size */
+
+    /* mapping and reading, built for this block size */
+    const struct ext2_kernels *kern;
+
+    /*
+     * metadata_csum checking, when asked for and the filesystem has it.
+     * Blocks are checked as they enter the cache; anything that fails
+     * reads as EIO and is counted.
+     */
+    int verify_csum;
+    int csum;
+    u32 csum_seed;
+    u8 *bad_groups;
+    u64 csum_errors;
+
+    /* hot block profile, with --warm */
+    struct warm *warm;
+
+    /* every in-use inode and directory, with --preload */
+    struct ext2_preload *preload;
+};
+
+/* a directory as parsed at opendir, held in fi->fh until releasedir */
+struct ext2_dirent
+{
+    u32 ino;
+    u32 name;               /* offset into names */
+    u8 file_type;
+};
+
+struct ext2_dir
+{
+    struct ext2_dirent *entries;
+    u32 nentries;
+    char *names;            /* NUL terminated, back to back */
+
+    /*
+     * preloaded directories are shared by every opendir and have an open
+     * addressed index of name hashes, holding entry index + 1
+     */
+    int preloaded;
+    u32 *hash;
+    u32 hash_mask;
+};
+
+/* 0 or -errno */
+int ext2_read_super(struct ext2_info *info);
+int ext2_read_inode(struct ext2_info *info, u32 ino, struct ext2_inode *ret);
+int ext2_preload(struct ext2_info *info, int nthreads, u64 max_mem);
+
+/* 0 or an errno */
+int ext2_stat(struct ext2_info *info, u32 ino, struct stat *st);
+int ext2_find_child(struct ext2_info *info, u32 dir, const char *name,
+                    u32 *ino);
+
+/* bytes read, or -errno */
+ssize_t ext2_read_data(struct ext2_info *info, u32 ino,
+                       struct ext2_inode *inode, void *buf, size_t size,
+                       off_t off);
+
+/* 0 or an errno; preloaded directories are shared, closing them is a no-op */
+int ext2_open_dir(struct ext2_info *info, u32 ino, struct ext2_dir **dirp);
+void ext2_close_dir(struct ext2_dir *dir);
+u32 ext2_dirent_mode(const struct ext2_dirent *ent);
+void ext2_prefetch_inodes(struct ext2_info *info,
+                          const struct ext2_dirent *ents, u32 n);
+
+/* an exit status */
+int ext2_write_manifest(struct ext2_info *info, const char *file,
+                        const char *hash, int nthreads);
+
+#endif /* _EXT2_H */
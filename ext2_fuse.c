@@ -0,0 +1,422 @@
+#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
+#include <talloc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "config.h"
+#include "trace.h"
+#include "ext2.h"
+#include "bdev.h"
+#include "warm.h"
+#include "reqsched.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+/* FUSE API */
+
+static void ext2_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct fuse_entry_param result;
+    u32 ino;
+    int err;
+
+    memset(&result, 0, sizeof(result));
+
+    err = ext2_find_child(info, parent, name, &ino);
+    if (err)
+    {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    result.ino = ino;
+    if (ext2_stat(info, ino, &result.attr))
+    {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_entry(req, &result);
+}
+
+static
+void ext2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int err;
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct stat st;
+
+    err = ext2_stat(info, ino, &st);
+    if (err)
+        goto out;
+
+    fuse_reply_attr(req, &st, 1.0);
+    return;
+out:
+    fuse_reply_err(req, err);
+}
+
+static void ext2_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    fuse_reply_err(req, EIO);
+}
+
+static
+void ext2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct ext2_inode *inode;
+
+    inode = talloc_size(info, sizeof(struct ext2_inode));
+
+    /* read the inode and store it in fi->fh */
+    if (ext2_read_inode(info, ino, inode))
+    {
+        talloc_free(inode);
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fi->fh = (uint64_t) (unsigned long) inode;
+    fuse_reply_open(req, fi);
+}
+
+static void ext2_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
+{
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct ext2_inode *inode = (struct ext2_inode *) (unsigned long) fi->fh;
+    u32 isize = le32_to_cpu(inode->i_size);
+    ssize_t ret;
+    u8 *buf;
+
+    trace(ext2_read, ino, off, size);
+
+    if (off >= isize)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    buf = talloc_size(NULL, min(size, isize - off));
+    if (!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    ret = ext2_read_data(info, ino, inode, buf, size, off);
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, (char *) buf, ret);
+    talloc_free(buf);
+}
+
+static
+void ext2_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct ext2_inode *inode = (struct ext2_inode *) (unsigned long) fi->fh;
+
+    talloc_free(inode);
+    fuse_reply_err(req, 0);
+}
+
+static
+void ext2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct ext2_dir *dir;
+    int err;
+
+    /* parse the directory once and list it from fi->fh */
+    err = ext2_open_dir(info, ino, &dir);
+    if (err)
+    {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    fi->fh = (uint64_t) (unsigned long) dir;
+    fuse_reply_open(req, fi);
+}
+
+static
+void ext2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info *fi)
+{
+    struct ext2_info *info = fuse_req_userdata(req);
+    struct ext2_dir *dir = (struct ext2_dir *) (unsigned long) fi->fh;
+    struct ext2_dirent *ent;
+    char *buf;
+    u32 i;
+    size_t ret;
+    size_t bufsize = 0;
+
+    buf = talloc_size(NULL, size);
+    if (!buf)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    /* offsets are indexes into the snapshot taken at opendir */
+    for (i=off; i < dir->nentries; i++)
+    {
+        ent = &dir->entries[i];
+
+        struct stat st = {
+            .st_ino = ent->ino,
+            .st_mode = ext2_dirent_mode(ent),
+        };
+
+        ret = fuse_add_direntry(req, buf + bufsize, size - bufsize,
+                                dir->names + ent->name, &st, i+1);
+        if (ret > size - bufsize)
+            break;
+
+        bufsize += ret;
+    }
+
+    if (i > off && !dir->preloaded)
+        ext2_prefetch_inodes(info, dir->entries + off, i - off);
+
+    fuse_reply_buf(req, buf, bufsize);
+    talloc_free(buf);
+}
+
+static void ext2_releasedir(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+    struct ext2_dir *dir = (struct ext2_dir *) (unsigned long) fi->fh;
+
+    ext2_close_dir(dir);
+    fuse_reply_err(req, 0);
+}
+
+static void ext2_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct ext2_info *fsi = fuse_req_userdata(req);
+    struct ext2_super_block *sb = &fsi->sb;
+
+    struct statvfs stbuf = {
+        .f_bsize = fsi->block_size,
+        .f_frsize = fsi->frag_size,
+        .f_blocks = le32_to_cpu(sb->s_blocks_count),
+        .f_bfree = le32_to_cpu(sb->s_free_blocks_count),
+        .f_bavail = le32_to_cpu(sb->s_free_blocks_count) -
+                    le32_to_cpu(sb->s_r_blocks_count),
+        .f_files = le32_to_cpu(sb->s_inodes_count),
+        .f_ffree = le32_to_cpu(sb->s_free_inodes_count),
+        .f_favail = le32_to_cpu(sb->s_free_inodes_count),
+        .f_fsid = sb->s_magic,
+        .f_flag = 0,
+        .f_namemax = EXT2_NAME_LEN,
+    };
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void ext2_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                   size_t size)
+{
+}
+
+static void ext2_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+}
+
+static void ext2_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
+               uint64_t idx)
+{
+    /* fuse_reply_bmap(req, idx) */
+}
+
+static struct fuse_lowlevel_ops ext2_ops = {
+    .lookup = ext2_lookup,
+    .getattr = ext2_getattr,
+    .readlink = ext2_readlink,
+    .open = ext2_open,
+    .read = ext2_read,
+    .release = ext2_release,
+    .opendir = ext2_opendir,
+    .readdir = ext2_readdir,
+    .releasedir = ext2_releasedir,
+    .statfs = ext2_statfs,
+/*
+    .getxattr = ext2_getxattr,
+    .listxattr = ext2_listxattr,
+    .bmap = ext2_bmap
+*/
+};
+
+int main(int argc, char *argv[])
+{
+    struct ext2_info *ctx;
+    int i, fuse_argc=0;
+    char *device = NULL;
+    char *trace_file = NULL;
+    char *backend = NULL;
+    char *manifest = NULL;
+    char *hash = "sha256";
+    int nthreads = 0;
+    int warm = 0;
+    int warm_rate = WARM_RATE;
+    int workers = REQSCHED_WORKERS;
+    int max_bulk = REQSCHED_MAX_BULK;
+    struct reqsched *sched;
+    int preload = 0;
+    int preload_mem = EXT2_PRELOAD_MEM;
+    struct fuse_session *sess;
+    struct fuse_chan *chan;
+    struct fuse_args args;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int res;
+
+    ctx = talloc_zero(NULL, struct ext2_info);
+
+    /* FIXME replace this with fuse_getopt */
+    char **fuse_argv = malloc((argc + 1) * sizeof(char *));
+
+    for (i=0; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-a") == 0) && i + 1 < argc)
+        {
+            i++;
+            device = argv[i];
+        }
+        else if ((strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+            backend = argv[++i];
+        else if ((strcmp(argv[i], "--trace") == 0) && i + 1 < argc)
+            trace_file = argv[++i];
+        else if (strcmp(argv[i], "--csum") == 0)
+            ctx->verify_csum = 1;
+        else if ((strcmp(argv[i], "--manifest") == 0) && i + 1 < argc)
+            manifest = argv[++i];
+        else if ((strcmp(argv[i], "--hash") == 0) && i + 1 < argc)
+            hash = argv[++i];
+        else if ((strcmp(argv[i], "-j") == 0) && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warm") == 0)
+            warm = 1;
+        else if ((strcmp(argv[i], "--warm-rate") == 0) && i + 1 < argc)
+            warm_rate = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--workers") == 0) && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--max-bulk") == 0) && i + 1 < argc)
+            max_bulk = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--preload") == 0)
+            preload = 1;
+        else if ((strcmp(argv[i], "--preload-mem") == 0) && i + 1 < argc)
+            preload_mem = atoi(argv[++i]);
+        else
+            fuse_argv[fuse_argc++] = argv[i];
+    }
+
+    fuse_argv[fuse_argc] = NULL;
+
+    if (!device)
+    {
+        fprintf(stderr, "Usage: %s -a <device_file> [-b <backend>] [--csum] "
+                "[--trace <file>] [--warm [--warm-rate <MB/s>]] "
+                "[--preload [--preload-mem <MB>] [-j <threads>]] "
+                "[--workers <n>] [--max-bulk <n>] <mount_point>\n"
+                "       %s -a <device_file> [-b <backend>] [--csum] "
+                "--manifest <file> [--hash sha256|blake3] [-j <threads>]\n",
+                argv[0], argv[0]);
+        bdev_usage(stderr);
+        return 1;
+    }
+
+    ctx->dev = bdev_open(ctx, device, backend);
+    if (!ctx->dev)
+    {
+        perror("ext2_fuse");
+        return 2;
+    }
+
+    if (trace_file && trace_start(trace_file))
+        fprintf(stderr, "ext2_fuse: not tracing to %s\n", trace_file);
+
+    if (ext2_read_super(ctx))
+    {
+        printf ("Could not read super block\n");
+        return 3;
+    }
+
+    if (manifest)
+    {
+        res = ext2_write_manifest(ctx, manifest, hash, nthreads);
+        trace_stop();
+        if (ctx->csum)
+            fprintf(stderr, "ext2: %llu metadata checksum errors\n",
+                    (unsigned long long) ctx->csum_errors);
+        talloc_free(ctx);
+        return res;
+    }
+
+    if (preload && ext2_preload(ctx, nthreads, (u64) preload_mem << 20))
+        fprintf(stderr, "ext2_fuse: not preloading\n");
+
+    /* the profile lives next to the image */
+    if (warm)
+    {
+        ctx->warm = warm_new(ctx, talloc_asprintf(ctx, "%s.warm", device),
+                             ctx->dev);
+        warm_set_cache(ctx->warm, ctx->cache, ctx->block_size);
+    }
+
+    args.argc = fuse_argc;
+    args.argv = fuse_argv;
+    args.allocated = 0;
+
+    res = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
+    if (res == -1)
+        goto out_err;
+
+    printf ("mount %s\n", mountpoint);
+
+    chan = fuse_mount(mountpoint, &args);
+    if (!chan)
+        goto out_err;
+
+    sess = fuse_lowlevel_new(&args, &ext2_ops, sizeof(ext2_ops), ctx);
+    fuse_session_add_chan(sess, chan);
+
+    res = fuse_daemonize(foreground);
+    if (res == -1)
+        goto err_unmount;
+
+    res = fuse_set_signal_handlers(sess);
+    if (res == -1)
+        goto err_unmount;
+
+    /* after daemonizing, which would lose the thread */
+    if (ctx->warm &&
+        warm_start(ctx->warm, (u64) warm_rate << 20, WARM_SAVE_INTERVAL))
+        fprintf(stderr, "ext2_fuse: no cache warm-up\n");
+
+    sched = reqsched_new(ctx, workers, max_bulk);
+    reqsched_loop(sched, sess);
+    reqsched_report(sched, "ext2");
+    if (ctx->warm)
+        warm_stop(ctx->warm);
+    trace_stop();
+    if (ctx->csum)
+        fprintf(stderr, "ext2: %llu metadata checksum errors\n",
+                (unsigned long long) ctx->csum_errors);
+    talloc_free(ctx);
+    return 0;
+
+err_unmount:
+    fuse_unmount(mountpoint, chan);
+
+out_err:
+    free(mountpoint);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#ifndef _EXT4_H
+#define _EXT4_H
+
+#include <string.h>
+
+#include "config.h"
+
+/*
+ * The parts of the ext4 on-disk format that <linux/ext2_fs.h> does not
+ * describe: 64 bit group descriptors, extents and metadata checksums.
+ */
+
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM         0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM    0x0400
+#define EXT4_FEATURE_INCOMPAT_EXTENTS           0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_INCOMPAT_CSUM_SEED         0x2000
+
+/* superblock fields past the ext2 ones, as byte offsets */
+#define EXT4_SB_FEATURE_INCOMPAT    0x60
+#define EXT4_SB_FEATURE_RO_COMPAT   0x64
+#define EXT4_SB_UUID                0x68
+#define EXT4_SB_DESC_SIZE           0xFE
+#define EXT4_SB_CHECKSUM_SEED       0x270
+#define EXT4_SB_CHECKSUM            0x3FC
+
+#define EXT2_MIN_DESC_SIZE          32
+
+struct ext4_group_desc
+{
+    u32 bg_block_bitmap_lo;
+    u32 bg_inode_bitmap_lo;
+    u32 bg_inode_table_lo;
+    u16 bg_free_blocks_count_lo;
+    u16 bg_free_inodes_count_lo;
+    u16 bg_used_dirs_count_lo;
+    u16 bg_flags;
+    u32 bg_exclude_bitmap_lo;
+    u16 bg_block_bitmap_csum_lo;
+    u16 bg_inode_bitmap_csum_lo;
+    u16 bg_itable_unused_lo;
+    u16 bg_checksum;
+    /* 64 bit descriptors only */
+    u32 bg_block_bitmap_hi;
+    u32 bg_inode_bitmap_hi;
+    u32 bg_inode_table_hi;
+    u16 bg_free_blocks_count_hi;
+    u16 bg_free_inodes_count_hi;
+    u16 bg_used_dirs_count_hi;
+    u16 bg_itable_unused_hi;
+    u32 bg_exclude_bitmap_hi;
+    u16 bg_block_bitmap_csum_hi;
+    u16 bg_inode_bitmap_csum_hi;
+    u32 bg_reserved;
+};
+
+/* bg_flags: the group's inode table and bitmap were never initialized */
+#define EXT4_BG_INODE_UNINIT        0x0001
+
+/* inode fields, as byte offsets */
+#define EXT4_GOOD_OLD_INODE_SIZE    128
+#define EXT4_INODE_GENERATION       0x64
+#define EXT4_INODE_CHECKSUM_LO      0x7C
+#define EXT4_INODE_EXTRA_ISIZE      0x80
+#define EXT4_INODE_CHECKSUM_HI      0x82
+
+#define EXT4_EXTENTS_FL             0x00080000
+
+#define EXT4_EXT_MAGIC              0xf30a
+#define EXT4_EXT_MAX_DEPTH          5
+#define EXT4_EXT_INIT_MAX_LEN       32768
+
+struct ext4_extent_header
+{
+    u16 eh_magic;
+    u16 eh_entries;
+    u16 eh_max;
+    u16 eh_depth;
+    u32 eh_generation;
+};
+
+struct ext4_extent_idx
+{
+    u32 ei_block;
+    u32 ei_leaf_lo;
+    u16 ei_leaf_hi;
+    u16 ei_unused;
+};
+
+struct ext4_extent
+{
+    u32 ee_block;
+    u16 ee_len;             /* above EXT4_EXT_INIT_MAX_LEN: unwritten */
+    u16 ee_start_hi;
+    u32 ee_start_lo;
+};
+
+/* follows the eh_max entries of an extent block */
+struct ext4_extent_tail
+{
+    u32 et_checksum;
+};
+
+/* checksummed directory leaf blocks end in this fake entry */
+struct ext4_dir_entry_tail
+{
+    u32 det_reserved_zero1;
+    u16 det_rec_len;        /* 12 */
+    u8 det_reserved_zero2;
+    u8 det_reserved_ft;     /* EXT4_FT_DIR_CSUM */
+    u32 det_checksum;
+};
+
+#define EXT4_FT_DIR_CSUM            0xDE
+
+static inline u16 get_le16(const u8 *p)
+{
+    u16 v;
+
+    memcpy(&v, p, sizeof(v));
+    return le16_to_cpu(v);
+}
+
+static inline u32 get_le32(const u8 *p)
+{
+    u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return le32_to_cpu(v);
+}
+
+#endif /* _EXT4_H */
@@ -0,0 +1,194 @@
+/*
+ * The fszoo library: images opened in process, with files found by path
+ * rather than by inode number.  Each filesystem supplies a struct
+ * fszoo_ops over the same reader its FUSE program uses.
+ */
+#include <string.h>
+#include <errno.h>
+#include <talloc.h>
+
+#include "fszoo.h"
+
+/* tried in this order when no type is given */
+static const struct fszoo_ops *fszoo_types[] = {
+    &ext2_fszoo_ops,
+    &yaffs2_fszoo_ops,
+};
+
+#define FSZOO_NTYPES (sizeof(fszoo_types) / sizeof(fszoo_types[0]))
+
+struct fszoo
+{
+    const struct fszoo_ops *ops;
+    struct bdev *dev;
+    void *fs;
+};
+
+struct fszoo_file
+{
+    struct fszoo *fs;
+    void *file;
+};
+
+int fszoo_open(void *mem_ctx, const char *image,
+               const struct fszoo_opts *opts, struct fszoo **fsp)
+{
+    static const struct fszoo_opts defaults;
+    struct fszoo *fs;
+    int err = -EINVAL, ret;
+    int i;
+
+    if (!opts)
+        opts = &defaults;
+
+    fs = talloc_zero(mem_ctx, struct fszoo);
+    if (!fs)
+        return -ENOMEM;
+
+    fs->dev = bdev_open(fs, image, opts->backend);
+    if (!fs->dev)
+    {
+        err = -errno;
+        talloc_free(fs);
+        return err;
+    }
+
+    /* the first that takes it; a read error beats "not this type" */
+    for (i=0; i < FSZOO_NTYPES; i++)
+    {
+        if (opts->type && strcmp(opts->type, fszoo_types[i]->name))
+            continue;
+
+        ret = fszoo_types[i]->open(fs, fs->dev, opts, &fs->fs);
+        if (!ret)
+        {
+            fs->ops = fszoo_types[i];
+            *fsp = fs;
+            return 0;
+        }
+        if (err == -EINVAL)
+            err = ret;
+    }
+
+    talloc_free(fs);
+    return err;
+}
+
+void fszoo_close(struct fszoo *fs)
+{
+    talloc_free(fs);
+}
+
+const char *fszoo_type(struct fszoo *fs)
+{
+    return fs->ops->name;
+}
+
+/* look path up one component at a time from the root */
+static int fszoo_walk(struct fszoo *fs, const char *path, u32 *ino)
+{
+    char name[256];
+    const char *end;
+    size_t len;
+    int err;
+
+    *ino = fs->ops->root;
+
+    for (;;)
+    {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            return 0;
+
+        end = strchrnul(path, '/');
+        len = end - path;
+        if (len >= sizeof(name))
+            return -ENAMETOOLONG;
+
+        memcpy(name, path, len);
+        name[len] = 0;
+        path = end;
+
+        if (strcmp(name, ".") == 0)
+            continue;
+
+        err = fs->ops->lookup(fs->fs, *ino, name, ino);
+        if (err)
+            return err;
+    }
+}
+
+int fszoo_stat(struct fszoo *fs, const char *path, struct stat *st)
+{
+    u32 ino;
+    int err;
+
+    err = fszoo_walk(fs, path, &ino);
+    if (err)
+        return err;
+
+    memset(st, 0, sizeof(*st));
+    return fs->ops->stat(fs->fs, ino, st);
+}
+
+int fszoo_readdir(struct fszoo *fs, const char *path, fszoo_dir_fn fn,
+                  void *arg)
+{
+    struct stat st;
+    u32 ino;
+    int err;
+
+    err = fszoo_walk(fs, path, &ino);
+    if (!err)
+        err = fs->ops->stat(fs->fs, ino, &st);
+    if (err)
+        return err;
+    if (!S_ISDIR(st.st_mode))
+        return -ENOTDIR;
+
+    return fs->ops->readdir(fs->fs, ino, fn, arg);
+}
+
+int fszoo_open_file(struct fszoo *fs, const char *path,
+                    struct fszoo_file **fp)
+{
+    struct fszoo_file *f;
+    struct stat st;
+    u32 ino;
+    int err;
+
+    err = fszoo_walk(fs, path, &ino);
+    if (!err)
+        err = fs->ops->stat(fs->fs, ino, &st);
+    if (err)
+        return err;
+    if (S_ISDIR(st.st_mode))
+        return -EISDIR;
+
+    /* not under fs, whose talloc tree other threads may be using */
+    f = talloc(NULL, struct fszoo_file);
+    if (!f)
+        return -ENOMEM;
+
+    f->fs = fs;
+    err = fs->ops->open_file(fs->fs, ino, &f->file);
+    if (err)
+    {
+        talloc_free(f);
+        return err;
+    }
+    *fp = f;
+    return 0;
+}
+
+ssize_t fszoo_pread(struct fszoo_file *f, void *buf, size_t len, u64 off)
+{
+    return f->fs->ops->pread(f->fs->fs, f->file, buf, len, off);
+}
+
+void fszoo_close_file(struct fszoo_file *f)
+{
+    f->fs->ops->close_file(f->fs->fs, f->file);
+    talloc_free(f);
+}
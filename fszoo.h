@@ -0,0 +1,72 @@
+#ifndef _FSZOO_H
+#define _FSZOO_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "bdev.h"
+
+/*
+ * Reading images in process, without mounting them.  fszoo_open() reads
+ * an image's superblock (or scans it, for yaffs2) once; after that any
+ * number of threads can stat, list and read files in it by absolute path,
+ * into buffers of their own.  Nothing is shared between open images.
+ *
+ * Calls return 0, or a byte count for reads, and -errno on failure.
+ * Symbolic links are not followed.
+ */
+struct fszoo;
+struct fszoo_file;
+
+/* zero for the defaults */
+struct fszoo_opts
+{
+    const char *backend;    /* as for bdev_open() */
+    const char *type;       /* "ext2" or "yaffs2"; NULL to probe */
+    int csum;               /* ext2: verify metadata_csum */
+    const char *ecc;        /* yaffs2: ECC scheme, as for --ecc */
+};
+
+/* called for each entry by fszoo_readdir(); nonzero stops the listing */
+typedef int (*fszoo_dir_fn)(void *arg, const char *name,
+                            const struct stat *st);
+
+/*
+ * A filesystem, as seen by the library.  Inodes are numbered as the
+ * filesystem likes; fs is whatever open() made of the device.  The
+ * readdir stat has only st_ino and the file type in st_mode.
+ */
+struct fszoo_ops
+{
+    const char *name;
+    u32 root;
+
+    int (*open)(void *mem_ctx, struct bdev *dev,
+                const struct fszoo_opts *opts, void **fs);
+    int (*lookup)(void *fs, u32 dir, const char *name, u32 *ino);
+    int (*stat)(void *fs, u32 ino, struct stat *st);
+    int (*readdir)(void *fs, u32 dir, fszoo_dir_fn fn, void *arg);
+    int (*open_file)(void *fs, u32 ino, void **file);
+    ssize_t (*pread)(void *fs, void *file, void *buf, size_t len, u64 off);
+    void (*close_file)(void *fs, void *file);
+};
+
+extern const struct fszoo_ops ext2_fszoo_ops;
+extern const struct fszoo_ops yaffs2_fszoo_ops;
+
+int fszoo_open(void *mem_ctx, const char *image,
+               const struct fszoo_opts *opts, struct fszoo **fsp);
+void fszoo_close(struct fszoo *fs);
+const char *fszoo_type(struct fszoo *fs);
+
+int fszoo_stat(struct fszoo *fs, const char *path, struct stat *st);
+int fszoo_readdir(struct fszoo *fs, const char *path, fszoo_dir_fn fn,
+                  void *arg);
+
+int fszoo_open_file(struct fszoo *fs, const char *path,
+                    struct fszoo_file **fp);
+ssize_t fszoo_pread(struct fszoo_file *f, void *buf, size_t len, u64 off);
+void fszoo_close_file(struct fszoo_file *f);
+
+#endif /* _FSZOO_H */
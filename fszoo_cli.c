@@ -0,0 +1,157 @@
+/*
+ * List, stat and read files in an image through the fszoo library,
+ * without mounting it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <talloc.h>
+
+#include "fszoo.h"
+
+/* cat reads this much at a time */
+#define CAT_CHUNK (128 << 10)
+
+static int ls_entry(void *arg, const char *name, const struct stat *st)
+{
+    printf("%s%s\n", name, S_ISDIR(st->st_mode) ? "/" : "");
+    return 0;
+}
+
+static int do_ls(struct fszoo *fs, const char *path)
+{
+    struct stat st;
+    int err;
+
+    err = fszoo_stat(fs, path, &st);
+    if (err)
+        return err;
+    if (!S_ISDIR(st.st_mode))
+    {
+        printf("%s\n", path);
+        return 0;
+    }
+    return fszoo_readdir(fs, path, ls_entry, NULL);
+}
+
+static int do_stat(struct fszoo *fs, const char *path)
+{
+    struct stat st;
+    int err;
+
+    err = fszoo_stat(fs, path, &st);
+    if (err)
+        return err;
+
+    printf("%s: inode %llu mode %o links %lu uid %u gid %u size %llu "
+           "mtime %llu\n", path, (unsigned long long) st.st_ino, st.st_mode,
+           (unsigned long) st.st_nlink, st.st_uid, st.st_gid,
+           (unsigned long long) st.st_size,
+           (unsigned long long) st.st_mtime);
+    return 0;
+}
+
+static int do_cat(struct fszoo *fs, const char *path)
+{
+    struct fszoo_file *f;
+    u64 off = 0;
+    ssize_t ret;
+    char *buf;
+    int err;
+
+    err = fszoo_open_file(fs, path, &f);
+    if (err)
+        return err;
+
+    buf = malloc(CAT_CHUNK);
+    if (!buf)
+    {
+        fszoo_close_file(f);
+        return -ENOMEM;
+    }
+
+    while ((ret = fszoo_pread(f, buf, CAT_CHUNK, off)) > 0)
+    {
+        if (fwrite(buf, 1, ret, stdout) != ret)
+        {
+            ret = -EIO;
+            break;
+        }
+        off += ret;
+    }
+
+    free(buf);
+    fszoo_close_file(f);
+    return ret < 0 ? ret : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fszoo_opts opts = { 0 };
+    int (*cmd)(struct fszoo *, const char *) = NULL;
+    const char *image = NULL;
+    struct fszoo *fs;
+    int res = 0;
+    int err;
+    int i;
+
+    for (i=1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+            opts.backend = argv[++i];
+        else if ((strcmp(argv[i], "-t") == 0) && i + 1 < argc)
+            opts.type = argv[++i];
+        else if (strcmp(argv[i], "--csum") == 0)
+            opts.csum = 1;
+        else if ((strcmp(argv[i], "--ecc") == 0) && i + 1 < argc)
+            opts.ecc = argv[++i];
+        else
+            break;
+    }
+
+    if (i + 1 < argc)
+    {
+        image = argv[i++];
+        if (strcmp(argv[i], "ls") == 0)
+            cmd = do_ls;
+        else if (strcmp(argv[i], "stat") == 0)
+            cmd = do_stat;
+        else if (strcmp(argv[i], "cat") == 0)
+            cmd = do_cat;
+        i++;
+    }
+
+    if (!cmd)
+    {
+        fprintf(stderr, "Usage: %s [-b <backend>] [-t ext2|yaffs2] [--csum] "
+                "[--ecc <scheme>] <image> ls|stat|cat [<path>...]\n",
+                argv[0]);
+        bdev_usage(stderr);
+        return 1;
+    }
+
+    err = fszoo_open(NULL, image, &opts, &fs);
+    if (err)
+    {
+        fprintf(stderr, "%s: %s\n", image, strerror(-err));
+        return 2;
+    }
+
+    /* the root when no path is given */
+    if (i == argc)
+        argv[--i] = "/";
+
+    for (; i < argc; i++)
+    {
+        err = cmd(fs, argv[i]);
+        if (err)
+        {
+            fprintf(stderr, "%s: %s\n", argv[i], strerror(-err));
+            res = 3;
+        }
+    }
+
+    fszoo_close(fs);
+    return res;
+}
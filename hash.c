@@ -0,0 +1,595 @@
+#include <string.h>
+#include <pthread.h>
+
+#include "hash.h"
+
+/*
+ * SHA-256 is the plain FIPS 180-4 compression, or on x86-64 with the SHA
+ * extensions the sha256rnds2 family, one block at a time.
+ *
+ * BLAKE3 follows the reference implementation: 1KB chunks compressed a
+ * block at a time, chained into a binary tree through a stack of
+ * chaining values.  Runs of whole chunks are compressed BLAKE3_LANES at
+ * a time, one chunk per vector lane, with AVX2 where there is one.
+ */
+#define min(a,b) ((a)<(b)?(a):(b))
+
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static inline u32 rotr32(u32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline u32 load32_le(const u8 *p)
+{
+    u32 w;
+
+    memcpy(&w, p, sizeof(w));
+    return le32_to_cpu(w);
+}
+
+static inline u32 load32_be(const u8 *p)
+{
+    u32 w;
+
+    memcpy(&w, p, sizeof(w));
+    return be32_to_cpu(w);
+}
+
+static inline void store32_le(u8 *p, u32 w)
+{
+    w = cpu_to_le32(w);
+    memcpy(p, &w, sizeof(w));
+}
+
+static inline void store32_be(u8 *p, u32 w)
+{
+    w = cpu_to_be32(w);
+    memcpy(p, &w, sizeof(w));
+}
+
+/* SHA-256 */
+
+struct sha256_state
+{
+    u32 h[8];
+    u64 len;
+    u8 buf[64];
+};
+
+static const u32 sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/* also BLAKE3's IV */
+static const u32 sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static void (*sha256_blocks)(u32 *h, const u8 *p, size_t nblocks);
+
+static void sha256_blocks_sw(u32 *h, const u8 *p, size_t nblocks)
+{
+    u32 w[64], s[8], t1, t2;
+    int i;
+
+    for (; nblocks--; p += 64)
+    {
+        for (i=0; i < 16; i++)
+            w[i] = load32_be(p + 4 * i);
+        for (; i < 64; i++)
+            w[i] = w[i - 16] + w[i - 7] +
+                   (rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^
+                    (w[i - 15] >> 3)) +
+                   (rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^
+                    (w[i - 2] >> 10));
+
+        memcpy(s, h, sizeof(s));
+        for (i=0; i < 64; i++)
+        {
+            t1 = s[7] + (rotr32(s[4], 6) ^ rotr32(s[4], 11) ^
+                         rotr32(s[4], 25)) +
+                 ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+            t2 = (rotr32(s[0], 2) ^ rotr32(s[0], 13) ^ rotr32(s[0], 22)) +
+                 ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            memmove(s + 1, s, 7 * sizeof(u32));
+            s[4] += t1;
+            s[0] = t1 + t2;
+        }
+        for (i=0; i < 8; i++)
+            h[i] += s[i];
+    }
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+/*
+ * The state lives as ABEF/CDGH pairs; each sha256rnds2 does two rounds,
+ * and msg1/msg2 extend the schedule four words at a time.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(u32 *h, const u8 *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i state0, state1, save0, save1, msg[4], t;
+    int i;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]),
+                               0x1b);
+    state0 = _mm_alignr_epi8(t, state1, 8);
+    state1 = _mm_blend_epi16(state1, t, 0xf0);
+
+    for (; nblocks--; p += 64)
+    {
+        save0 = state0;
+        save1 = state1;
+
+        for (i=0; i < 16; i++)
+        {
+            if (i < 4)
+                msg[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) (p + 16 * i)), bswap);
+            else
+            {
+                t = _mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]);
+                t = _mm_add_epi32(t, _mm_alignr_epi8(msg[(i + 3) & 3],
+                                                     msg[(i + 2) & 3], 4));
+                msg[i & 3] = _mm_sha256msg2_epu32(t, msg[(i + 3) & 3]);
+            }
+
+            t = _mm_add_epi32(msg[i & 3],
+                    _mm_loadu_si128((const __m128i *) &sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, t);
+            state0 = _mm_sha256rnds2_epu32(state0, state1,
+                                           _mm_shuffle_epi32(t, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+    }
+
+    t = _mm_shuffle_epi32(state0, 0x1b);
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    state0 = _mm_blend_epi16(t, state1, 0xf0);
+    state1 = _mm_alignr_epi8(state1, t, 8);
+    _mm_storeu_si128((__m128i *) &h[0], state0);
+    _mm_storeu_si128((__m128i *) &h[4], state1);
+}
+#endif
+
+static void sha256_init(void *state)
+{
+    struct sha256_state *s = state;
+
+    memcpy(s->h, sha256_iv, sizeof(s->h));
+    s->len = 0;
+}
+
+static void sha256_update(void *state, const void *buf, size_t len)
+{
+    struct sha256_state *s = state;
+    const u8 *p = buf;
+    size_t used = s->len % 64, n;
+
+    s->len += len;
+
+    if (used)
+    {
+        n = min(len, 64 - used);
+        memcpy(s->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        sha256_blocks(s->h, s->buf, 1);
+    }
+
+    if (len >= 64)
+    {
+        sha256_blocks(s->h, p, len / 64);
+        p += len & ~63;
+        len &= 63;
+    }
+    memcpy(s->buf, p, len);
+}
+
+static void sha256_final(void *state, u8 *digest)
+{
+    struct sha256_state *s = state;
+    u64 bits = s->len * 8;
+    u8 pad[72] = { 0x80 };
+    size_t padlen = (s->len % 64 < 56 ? 56 : 120) - s->len % 64;
+    int i;
+
+    for (i=0; i < 8; i++)
+        pad[padlen + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, padlen + 8);
+
+    for (i=0; i < 8; i++)
+        store32_be(digest + 4 * i, s->h[i]);
+}
+
+/* BLAKE3 */
+
+#define BLAKE3_BLOCK_LEN    64
+#define BLAKE3_CHUNK_LEN    1024
+#define BLAKE3_MAX_DEPTH    54
+#define BLAKE3_LANES        8
+
+#define BLAKE3_CHUNK_START  1
+#define BLAKE3_CHUNK_END    2
+#define BLAKE3_PARENT       4
+#define BLAKE3_ROOT         8
+
+struct blake3_chunk
+{
+    u32 cv[8];
+    u64 counter;
+    u8 block[BLAKE3_BLOCK_LEN];
+    u8 block_len;
+    u8 blocks_compressed;
+};
+
+struct blake3_state
+{
+    struct blake3_chunk chunk;
+    u8 cv_stack_len;
+    u32 cv_stack[BLAKE3_MAX_DEPTH][8];
+};
+
+_Static_assert(sizeof(struct blake3_state) <= HASH_CTX_SIZE,
+               "blake3 state outgrew struct hash_ctx");
+
+static const u8 blake3_schedule[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+#define BLAKE3_G(v, a, b, c, d, x, y) \
+    do { \
+        v[a] = v[a] + v[b] + (x); \
+        v[d] = ROTR(v[d] ^ v[a], 16); \
+        v[c] = v[c] + v[d]; \
+        v[b] = ROTR(v[b] ^ v[c], 12); \
+        v[a] = v[a] + v[b] + (y); \
+        v[d] = ROTR(v[d] ^ v[a], 8); \
+        v[c] = v[c] + v[d]; \
+        v[b] = ROTR(v[b] ^ v[c], 7); \
+    } while (0)
+
+#define BLAKE3_ROUNDS(v, m) \
+    do { \
+        int r; \
+        for (r=0; r < 7; r++) \
+        { \
+            const u8 *s = blake3_schedule[r]; \
+            BLAKE3_G(v, 0, 4, 8, 12, m[s[0]], m[s[1]]); \
+            BLAKE3_G(v, 1, 5, 9, 13, m[s[2]], m[s[3]]); \
+            BLAKE3_G(v, 2, 6, 10, 14, m[s[4]], m[s[5]]); \
+            BLAKE3_G(v, 3, 7, 11, 15, m[s[6]], m[s[7]]); \
+            BLAKE3_G(v, 0, 5, 10, 15, m[s[8]], m[s[9]]); \
+            BLAKE3_G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]); \
+            BLAKE3_G(v, 2, 7, 8, 13, m[s[12]], m[s[13]]); \
+            BLAKE3_G(v, 3, 4, 9, 14, m[s[14]], m[s[15]]); \
+        } \
+    } while (0)
+
+/* the full 16 word output; the first 8 are the chaining value */
+static void blake3_compress(const u32 cv[8], const u8 block[64],
+                            u64 counter, u32 block_len, u32 flags,
+                            u32 out[16])
+{
+    u32 v[16], m[16];
+    int i;
+
+#define ROTR(x, n) rotr32(x, n)
+    for (i=0; i < 16; i++)
+        m[i] = load32_le(block + 4 * i);
+    memcpy(v, cv, 8 * sizeof(u32));
+    memcpy(v + 8, sha256_iv, 4 * sizeof(u32));
+    v[12] = counter;
+    v[13] = counter >> 32;
+    v[14] = block_len;
+    v[15] = flags;
+
+    BLAKE3_ROUNDS(v, m);
+#undef ROTR
+
+    for (i=0; i < 8; i++)
+    {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ cv[i];
+    }
+}
+
+/*
+ * BLAKE3_LANES whole chunks at once, chunk i of them at counter + i, in
+ * vectors of one word per chunk.
+ */
+typedef u32 u32xl __attribute__((vector_size(4 * BLAKE3_LANES)));
+
+static void (*blake3_hash_chunks)(const u8 *p, u64 counter,
+                                  u32 cvs[BLAKE3_LANES][8]);
+
+static inline __attribute__((always_inline))
+void blake3_hash_chunks_body(const u8 *p, u64 counter,
+                             u32 cvs[BLAKE3_LANES][8])
+{
+    u32xl v[16], m[16], cv[8], ctr_lo, ctr_hi;
+    u32 flags;
+    int b, i, l;
+
+    for (i=0; i < 8; i++)
+        for (l=0; l < BLAKE3_LANES; l++)
+            cv[i][l] = sha256_iv[i];
+    for (l=0; l < BLAKE3_LANES; l++)
+    {
+        ctr_lo[l] = counter + l;
+        ctr_hi[l] = (counter + l) >> 32;
+    }
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+    for (b=0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++)
+    {
+        flags = (b ? 0 : BLAKE3_CHUNK_START) |
+                (b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ?
+                 BLAKE3_CHUNK_END : 0);
+
+        for (i=0; i < 16; i++)
+            for (l=0; l < BLAKE3_LANES; l++)
+                m[i][l] = load32_le(p + l * BLAKE3_CHUNK_LEN +
+                                    b * BLAKE3_BLOCK_LEN + 4 * i);
+        for (i=0; i < 8; i++)
+            v[i] = cv[i];
+        for (i=0; i < 4; i++)
+            v[i + 8] = (u32xl) { 0 } + sha256_iv[i];
+        v[12] = ctr_lo;
+        v[13] = ctr_hi;
+        v[14] = (u32xl) { 0 } + BLAKE3_BLOCK_LEN;
+        v[15] = (u32xl) { 0 } + flags;
+
+        BLAKE3_ROUNDS(v, m);
+
+        for (i=0; i < 8; i++)
+            cv[i] = v[i] ^ v[i + 8];
+    }
+#undef ROTR
+
+    for (l=0; l < BLAKE3_LANES; l++)
+        for (i=0; i < 8; i++)
+            cvs[l][i] = cv[i][l];
+}
+
+static void blake3_hash_chunks_sw(const u8 *p, u64 counter,
+                                  u32 cvs[BLAKE3_LANES][8])
+{
+    blake3_hash_chunks_body(p, counter, cvs);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void blake3_hash_chunks_avx2(const u8 *p, u64 counter,
+                                    u32 cvs[BLAKE3_LANES][8])
+{
+    blake3_hash_chunks_body(p, counter, cvs);
+}
+#endif
+
+static void blake3_chunk_init(struct blake3_chunk *c, u64 counter)
+{
+    memcpy(c->cv, sha256_iv, sizeof(c->cv));
+    c->counter = counter;
+    c->block_len = 0;
+    c->blocks_compressed = 0;
+}
+
+static size_t blake3_chunk_len(struct blake3_chunk *c)
+{
+    return (size_t) c->blocks_compressed * BLAKE3_BLOCK_LEN + c->block_len;
+}
+
+static u32 blake3_chunk_flags(struct blake3_chunk *c)
+{
+    return c->blocks_compressed ? 0 : BLAKE3_CHUNK_START;
+}
+
+static void blake3_chunk_update(struct blake3_chunk *c, const u8 *p,
+                                size_t len)
+{
+    u32 out[16];
+    size_t n;
+
+    while (len)
+    {
+        /* the last block of a chunk waits, it may need CHUNK_END */
+        if (c->block_len == BLAKE3_BLOCK_LEN)
+        {
+            blake3_compress(c->cv, c->block, c->counter, BLAKE3_BLOCK_LEN,
+                            blake3_chunk_flags(c), out);
+            memcpy(c->cv, out, sizeof(c->cv));
+            c->blocks_compressed++;
+            c->block_len = 0;
+        }
+
+        n = min(len, BLAKE3_BLOCK_LEN - c->block_len);
+        memcpy(c->block + c->block_len, p, n);
+        c->block_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* merge completed subtrees; total is the number of chunks so far */
+static void blake3_push_cv(struct blake3_state *s, const u32 cv[8],
+                           u64 total)
+{
+    u8 block[64];
+    u32 out[16];
+
+    memcpy(out, cv, 8 * sizeof(u32));
+    while (!(total & 1))
+    {
+        s->cv_stack_len--;
+        memcpy(block, s->cv_stack[s->cv_stack_len], 32);
+        memcpy(block + 32, out, 32);
+        blake3_compress(sha256_iv, block, 0, BLAKE3_BLOCK_LEN,
+                        BLAKE3_PARENT, out);
+        total >>= 1;
+    }
+    memcpy(s->cv_stack[s->cv_stack_len++], out, 32);
+}
+
+static void blake3_init(void *state)
+{
+    struct blake3_state *s = state;
+
+    blake3_chunk_init(&s->chunk, 0);
+    s->cv_stack_len = 0;
+}
+
+static void blake3_update(void *state, const void *buf, size_t len)
+{
+    struct blake3_state *s = state;
+    struct blake3_chunk *c = &s->chunk;
+    u32 cvs[BLAKE3_LANES][8], out[16];
+    const u8 *p = buf;
+    size_t n;
+    int l;
+
+    while (len)
+    {
+        if (blake3_chunk_len(c) == BLAKE3_CHUNK_LEN)
+        {
+            blake3_compress(c->cv, c->block, c->counter, BLAKE3_BLOCK_LEN,
+                            blake3_chunk_flags(c) | BLAKE3_CHUNK_END, out);
+            blake3_push_cv(s, out, c->counter + 1);
+            blake3_chunk_init(c, c->counter + 1);
+        }
+
+        /*
+         * Whole chunks straight from the input, as long as something is
+         * left over for the chunk state: the last chunk may be the root.
+         */
+        if (!blake3_chunk_len(c) && len > BLAKE3_LANES * BLAKE3_CHUNK_LEN)
+        {
+            blake3_hash_chunks(p, c->counter, cvs);
+            for (l=0; l < BLAKE3_LANES; l++)
+                blake3_push_cv(s, cvs[l], c->counter + l + 1);
+            blake3_chunk_init(c, c->counter + BLAKE3_LANES);
+            p += BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+            len -= BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+
+        n = min(len, BLAKE3_CHUNK_LEN - blake3_chunk_len(c));
+        blake3_chunk_update(c, p, n);
+        p += n;
+        len -= n;
+    }
+}
+
+static void blake3_final(void *state, u8 *digest)
+{
+    struct blake3_state *s = state;
+    struct blake3_chunk *c = &s->chunk;
+    u32 block_len = c->block_len;
+    u32 flags = blake3_chunk_flags(c) | BLAKE3_CHUNK_END;
+    u64 counter = c->counter;
+    u8 block[64];
+    u32 cv[8], out[16];
+    int i = s->cv_stack_len;
+
+    /* the output node: the last chunk, or the top parent */
+    memcpy(cv, c->cv, sizeof(cv));
+    memset(block, 0, sizeof(block));
+    memcpy(block, c->block, c->block_len);
+
+    while (i--)
+    {
+        blake3_compress(cv, block, counter, block_len, flags, out);
+        memcpy(block, s->cv_stack[i], 32);
+        memcpy(block + 32, out, 32);
+        memcpy(cv, sha256_iv, sizeof(cv));
+        block_len = BLAKE3_BLOCK_LEN;
+        flags = BLAKE3_PARENT;
+        counter = 0;
+    }
+
+    blake3_compress(cv, block, counter, block_len, flags | BLAKE3_ROOT, out);
+    for (i=0; i < 8; i++)
+        store32_le(digest + 4 * i, out[i]);
+}
+
+static void hash_init_impl(void)
+{
+    sha256_blocks = sha256_blocks_sw;
+    blake3_hash_chunks = blake3_hash_chunks_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        sha256_blocks = sha256_blocks_shani;
+    if (__builtin_cpu_supports("avx2"))
+        blake3_hash_chunks = blake3_hash_chunks_avx2;
+#endif
+}
+
+static void sha256_init_once(void *state)
+{
+    pthread_once(&hash_once, hash_init_impl);
+    sha256_init(state);
+}
+
+static void blake3_init_once(void *state)
+{
+    pthread_once(&hash_once, hash_init_impl);
+    blake3_init(state);
+}
+
+const struct hash_algo hash_sha256 = {
+    .name = "sha256",
+    .digest_size = 32,
+    .init = sha256_init_once,
+    .update = sha256_update,
+    .final = sha256_final,
+};
+
+const struct hash_algo hash_blake3 = {
+    .name = "blake3",
+    .digest_size = 32,
+    .init = blake3_init_once,
+    .update = blake3_update,
+    .final = blake3_final,
+};
+
+const struct hash_algo *hash_find(const char *name)
+{
+    if (strcmp(name, hash_sha256.name) == 0)
+        return &hash_sha256;
+    if (strcmp(name, hash_blake3.name) == 0)
+        return &hash_blake3;
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+
+#include "config.h"
+
+/*
+ * Content hashes for manifests: SHA-256 and BLAKE3 (unkeyed, 32 byte
+ * output).  Both pick the fastest code the CPU supports at first use.
+ */
+#define HASH_MAX_DIGEST     32
+#define HASH_CTX_SIZE       2048
+
+struct hash_ctx
+{
+    const struct hash_algo *algo;
+    u64 state[HASH_CTX_SIZE / 8];
+};
+
+struct hash_algo
+{
+    const char *name;
+    int digest_size;
+
+    void (*init)(void *state);
+    void (*update)(void *state, const void *buf, size_t len);
+    void (*final)(void *state, u8 *digest);
+};
+
+extern const struct hash_algo hash_sha256;
+extern const struct hash_algo hash_blake3;
+
+const struct hash_algo *hash_find(const char *name);
+
+static inline void hash_init(struct hash_ctx *ctx,
+                             const struct hash_algo *algo)
+{
+    ctx->algo = algo;
+    algo->init(ctx->state);
+}
+
+static inline void hash_update(struct hash_ctx *ctx, const void *buf,
+                               size_t len)
+{
+    ctx->algo->update(ctx->state, buf, len);
+}
+
+static inline void hash_final(struct hash_ctx *ctx, u8 *digest)
+{
+    ctx->algo->final(ctx->state, digest);
+}
+
+#endif /* _HASH_H */
@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <talloc.h>
+
+#include "manifest.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+/* each thread hashes through a buffer of this many bytes */
+#define MANIFEST_READ_SIZE  (1 << 20)
+
+/* how much of a file coming up is hinted to the device ahead of time */
+#define MANIFEST_HINT_SIZE  (8 << 20)
+
+struct manifest
+{
+    struct bdev *dev;
+    const struct hash_algo *algo;
+    manifest_read_fn read;
+    void *fs;
+
+    struct manifest_entry **entries;
+    u32 nentries;
+    u32 entries_size;
+
+    /* regular files, by first physical extent */
+    struct manifest_entry **order;
+    u32 norder;
+    u32 next;
+    int nthreads;
+    int errors;
+    pthread_mutex_t lock;
+};
+
+struct manifest *manifest_new(void *mem_ctx, struct bdev *dev,
+                              const struct hash_algo *algo,
+                              manifest_read_fn read, void *fs)
+{
+    struct manifest *m = talloc_zero(mem_ctx, struct manifest);
+
+    m->dev = dev;
+    m->algo = algo;
+    m->read = read;
+    m->fs = fs;
+    pthread_mutex_init(&m->lock, NULL);
+    return m;
+}
+
+struct manifest_entry *manifest_add(struct manifest *m, const char *path,
+                                    u64 size, u32 mode, void *file)
+{
+    struct manifest_entry *e;
+
+    if (m->nentries == m->entries_size)
+    {
+        m->entries_size = m->entries_size ? m->entries_size * 2 : 256;
+        m->entries = talloc_realloc(m, m->entries, struct manifest_entry *,
+                                    m->entries_size);
+    }
+
+    e = talloc_zero(m, struct manifest_entry);
+    e->path = talloc_strdup(e, path);
+    e->size = size;
+    e->mode = mode;
+    e->file = file;
+    m->entries[m->nentries++] = e;
+    return e;
+}
+
+void manifest_add_extent(struct manifest_entry *e, u64 logical,
+                         u64 physical, u64 len)
+{
+    struct manifest_extent *x = e->nextents ?
+                                &e->extents[e->nextents - 1] : NULL;
+
+    /* extend the last extent if this carries straight on from it */
+    if (x && x->logical + x->len == logical &&
+        x->physical + x->len == physical)
+    {
+        x->len += len;
+        return;
+    }
+
+    if (e->nextents == e->extents_size)
+    {
+        e->extents_size = e->extents_size ? e->extents_size * 2 : 4;
+        e->extents = talloc_realloc(e, e->extents, struct manifest_extent,
+                                    e->extents_size);
+    }
+    x = &e->extents[e->nextents++];
+    x->logical = logical;
+    x->physical = physical;
+    x->len = len;
+}
+
+static int manifest_order_cmp(const void *a, const void *b)
+{
+    const struct manifest_entry *ea = *(struct manifest_entry * const *) a;
+    const struct manifest_entry *eb = *(struct manifest_entry * const *) b;
+    u64 pa = ea->nextents ? ea->extents[0].physical : 0;
+    u64 pb = eb->nextents ? eb->extents[0].physical : 0;
+
+    if (pa != pb)
+        return pa < pb ? -1 : 1;
+    return 0;
+}
+
+/* tell the device about the start of a file a thread will soon want */
+static void manifest_hint(struct manifest *m, struct manifest_entry *e)
+{
+    u64 left = MANIFEST_HINT_SIZE;
+    u32 i;
+
+    for (i=0; i < e->nextents && left; i++)
+    {
+        bdev_hint(m->dev, BDEV_HINT_WILLNEED, e->extents[i].physical,
+                  min(left, e->extents[i].len));
+        left -= min(left, e->extents[i].len);
+    }
+}
+
+static int manifest_hash(struct manifest *m, struct manifest_entry *e,
+                         u8 *buf)
+{
+    struct hash_ctx ctx;
+    u64 off = 0;
+    ssize_t ret;
+
+    hash_init(&ctx, m->algo);
+    while (off < e->size)
+    {
+        ret = m->read(m->fs, e->file, buf,
+                      min(e->size - off, MANIFEST_READ_SIZE), off);
+        if (ret < 0)
+            return ret;
+        if (!ret)
+            return -EIO;
+        hash_update(&ctx, buf, ret);
+        off += ret;
+    }
+    hash_final(&ctx, e->digest);
+    return 0;
+}
+
+static void *manifest_thread(void *arg)
+{
+    struct manifest *m = arg;
+    struct manifest_entry *e;
+    u8 *buf = malloc(MANIFEST_READ_SIZE);
+    u32 i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&m->lock);
+        i = m->next++;
+        pthread_mutex_unlock(&m->lock);
+        if (i >= m->norder)
+            break;
+
+        /* the file whoever finishes next will pick up */
+        if (i + m->nthreads < m->norder)
+            manifest_hint(m, m->order[i + m->nthreads]);
+
+        e = m->order[i];
+        e->err = buf ? manifest_hash(m, e, buf) : -ENOMEM;
+        if (e->err)
+        {
+            pthread_mutex_lock(&m->lock);
+            m->errors++;
+            pthread_mutex_unlock(&m->lock);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void manifest_put_path(FILE *out, const char *p)
+{
+    for (; *p; p++)
+    {
+        if (*p == '\t')
+            fputs("\\t", out);
+        else if (*p == '\n')
+            fputs("\\n", out);
+        else if (*p == '\\')
+            fputs("\\\\", out);
+        else
+            fputc(*p, out);
+    }
+}
+
+static void manifest_write(struct manifest *m, FILE *out)
+{
+    struct manifest_entry *e;
+    u32 i, j;
+    int k;
+
+    fprintf(out, "# path\tsize\tmode\t%s\textents\n", m->algo->name);
+    for (i=0; i < m->nentries; i++)
+    {
+        e = m->entries[i];
+
+        manifest_put_path(out, e->path);
+        fprintf(out, "\t%llu\t%o\t", (unsigned long long) e->size, e->mode);
+
+        if (S_ISREG(e->mode) && !e->err)
+            for (k=0; k < m->algo->digest_size; k++)
+                fprintf(out, "%02x", e->digest[k]);
+        else
+            fputc('-', out);
+        fputc('\t', out);
+
+        for (j=0; j < e->nextents; j++)
+            fprintf(out, "%s%llu+%llu", j ? "," : "",
+                    (unsigned long long) e->extents[j].physical,
+                    (unsigned long long) e->extents[j].len);
+        fputs(e->nextents ? "\n" : "-\n", out);
+    }
+}
+
+int manifest_run(struct manifest *m, int nthreads, FILE *out)
+{
+    pthread_t *threads;
+    u32 i;
+    int t;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    m->order = talloc_array(m, struct manifest_entry *, m->nentries);
+    for (i=0; i < m->nentries; i++)
+        if (S_ISREG(m->entries[i]->mode))
+            m->order[m->norder++] = m->entries[i];
+    qsort(m->order, m->norder, sizeof(*m->order), manifest_order_cmp);
+
+    m->nthreads = nthreads;
+    m->next = 0;
+    m->errors = 0;
+
+    bdev_hint(m->dev, BDEV_HINT_SEQUENTIAL, 0, 0);
+    for (i=0; i < m->norder && i < nthreads; i++)
+        manifest_hint(m, m->order[i]);
+
+    threads = talloc_array(m, pthread_t, nthreads);
+    for (t=0; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, manifest_thread, m))
+            break;
+
+    /* if no thread could be started, do it here */
+    if (!t)
+        manifest_thread(m);
+    while (t--)
+        pthread_join(threads[t], NULL);
+
+    manifest_write(m, out);
+    talloc_free(threads);
+    return m->errors;
+}
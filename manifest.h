@@ -0,0 +1,61 @@
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "config.h"
+#include "hash.h"
+#include "bdev.h"
+
+/*
+ * Content manifests: a filesystem walks its tree adding an entry per
+ * object, with the device extents of each regular file, then the files
+ * are hashed on a pool of threads in order of where their data starts on
+ * the device, so that together the threads read it front to back.  The
+ * manifest is written in the order the entries were added, one line each:
+ *
+ *  path <tab> size <tab> mode <tab> hash <tab> extents
+ *
+ * with the mode in octal, the hash in hex ("-" if not a regular file or
+ * it could not be read) and the extents as device offset+length pairs,
+ * comma separated.  Tabs, newlines and backslashes in paths are escaped.
+ */
+struct manifest_extent
+{
+    u64 logical;
+    u64 physical;
+    u64 len;
+};
+
+struct manifest_entry
+{
+    const char *path;
+    u64 size;
+    u32 mode;
+    void *file;             /* the filesystem's, passed back to read */
+
+    struct manifest_extent *extents;
+    u32 nextents;
+    u32 extents_size;
+
+    u8 digest[HASH_MAX_DIGEST];
+    int err;
+};
+
+/* read file data like pread; -errno on error */
+typedef ssize_t (*manifest_read_fn)(void *fs, void *file, void *buf,
+                                    size_t len, u64 off);
+
+struct manifest *manifest_new(void *mem_ctx, struct bdev *dev,
+                              const struct hash_algo *algo,
+                              manifest_read_fn read, void *fs);
+struct manifest_entry *manifest_add(struct manifest *m, const char *path,
+                                    u64 size, u32 mode, void *file);
+void manifest_add_extent(struct manifest_entry *e, u64 logical,
+                         u64 physical, u64 len);
+
+/* hash on nthreads threads (0 for one per CPU); returns files unread */
+int manifest_run(struct manifest *m, int nthreads, FILE *out);
+
+#endif /* _MANIFEST_H */
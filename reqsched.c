@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "reqsched.h"
+#include "trace.h"
+
+/* the start of every request from the kernel, as in linux/fuse.h */
+struct reqsched_in_header
+{
+    u32 len;
+    u32 opcode;
+    u64 unique;
+    u64 nodeid;
+    u32 uid;
+    u32 gid;
+    u32 pid;
+    u32 padding;
+};
+
+#define REQSCHED_FUSE_READ  15
+
+enum
+{
+    REQSCHED_META,
+    REQSCHED_BULK,
+    REQSCHED_NCLASSES
+};
+
+static const char *reqsched_class_names[REQSCHED_NCLASSES] =
+{
+    "metadata",
+    "bulk"
+};
+
+/* latencies in us, bucketed 8 to each power of two */
+#define REQSCHED_HIST_SUB   3
+#define REQSCHED_HIST_SIZE  ((65 - REQSCHED_HIST_SUB) << REQSCHED_HIST_SUB)
+
+struct reqsched_req
+{
+    struct reqsched_req *next;
+    struct fuse_chan *ch;
+    struct timespec queued;
+    u32 opcode;
+    size_t len;
+    char buf[];
+};
+
+struct reqsched_class
+{
+    struct reqsched_req *head, **tail;
+    int active;
+
+    u64 count;
+    u64 max_us;
+    u64 wait[REQSCHED_HIST_SIZE];
+    u64 total[REQSCHED_HIST_SIZE];
+};
+
+struct reqsched
+{
+    struct fuse_session *se;
+    int nworkers;
+    int max_bulk;
+    int credit;             /* metadata requests before bulk's next turn */
+    int stop;
+    struct reqsched_class cls[REQSCHED_NCLASSES];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int reqsched_destroy(struct reqsched *s)
+{
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    return 0;
+}
+
+struct reqsched *reqsched_new(void *mem_ctx, int workers, int max_bulk)
+{
+    struct reqsched *s = talloc_zero(mem_ctx, struct reqsched);
+    int c;
+
+    s->nworkers = workers > 0 ? workers : REQSCHED_WORKERS;
+    s->max_bulk = max_bulk > 0 ? max_bulk : REQSCHED_MAX_BULK;
+    s->credit = REQSCHED_META_WEIGHT;
+    for (c=0; c < REQSCHED_NCLASSES; c++)
+        s->cls[c].tail = &s->cls[c].head;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    talloc_set_destructor(s, reqsched_destroy);
+    return s;
+}
+
+static u32 reqsched_bucket(u64 us)
+{
+    int e;
+
+    if (us < (1 << REQSCHED_HIST_SUB))
+        return us;
+    e = 63 - __builtin_clzll(us);
+    return ((e - REQSCHED_HIST_SUB + 1) << REQSCHED_HIST_SUB) +
+           ((us >> (e - REQSCHED_HIST_SUB)) & ((1 << REQSCHED_HIST_SUB) - 1));
+}
+
+/* the smallest latency that falls in bucket b */
+static u64 reqsched_bucket_us(u32 b)
+{
+    u32 e = b >> REQSCHED_HIST_SUB;
+    u64 step = (1 << REQSCHED_HIST_SUB) + (b & ((1 << REQSCHED_HIST_SUB) - 1));
+
+    if (!e)
+        return b;
+    return step << (e - 1);
+}
+
+static u64 reqsched_us(const struct timespec *from, const struct timespec *to)
+{
+    return ((s64) (to->tv_sec - from->tv_sec) * 1000000000 +
+            (to->tv_nsec - from->tv_nsec)) / 1000;
+}
+
+/* with the lock held */
+static void reqsched_queue(struct reqsched *s, struct reqsched_req *r)
+{
+    int cls = r->opcode == REQSCHED_FUSE_READ ? REQSCHED_BULK : REQSCHED_META;
+    struct reqsched_class *c = &s->cls[cls];
+
+    r->next = NULL;
+    *c->tail = r;
+    c->tail = &r->next;
+}
+
+/* with the lock held: the next request a worker may take, if any */
+static struct reqsched_req *reqsched_pick(struct reqsched *s, int *cls)
+{
+    struct reqsched_class *meta = &s->cls[REQSCHED_META];
+    struct reqsched_class *bulk = &s->cls[REQSCHED_BULK];
+    int can_bulk = bulk->head && bulk->active < s->max_bulk;
+    struct reqsched_class *c;
+    struct reqsched_req *r;
+
+    if (meta->head && (!can_bulk || s->credit > 0))
+    {
+        *cls = REQSCHED_META;
+        if (s->credit > 0)
+            s->credit--;
+    }
+    else if (can_bulk)
+    {
+        *cls = REQSCHED_BULK;
+        s->credit = REQSCHED_META_WEIGHT;
+    }
+    else
+        return NULL;
+
+    c = &s->cls[*cls];
+    r = c->head;
+    c->head = r->next;
+    if (!c->head)
+        c->tail = &c->head;
+    c->active++;
+    return r;
+}
+
+static void *reqsched_worker(void *arg)
+{
+    struct reqsched *s = arg;
+    struct reqsched_class *c;
+    struct reqsched_req *r;
+    struct timespec start, end;
+    u64 wait, total;
+    int cls;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;)
+    {
+        r = reqsched_pick(s, &cls);
+        if (!r)
+        {
+            /* finish off what was queued before stopping */
+            if (s->stop && !s->cls[REQSCHED_META].head &&
+                !s->cls[REQSCHED_BULK].head)
+                break;
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fuse_session_process(s->se, r->buf, r->len, r->ch);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        wait = reqsched_us(&r->queued, &start);
+        total = reqsched_us(&r->queued, &end);
+        trace(reqsched_request, r->opcode, wait, total - wait);
+        free(r);
+
+        pthread_mutex_lock(&s->lock);
+        c = &s->cls[cls];
+        c->active--;
+        c->count++;
+        c->wait[reqsched_bucket(wait)]++;
+        c->total[reqsched_bucket(total)]++;
+        if (total > c->max_us)
+            c->max_us = total;
+
+        /* a bulk slot is free for whoever is waiting on one */
+        if (cls == REQSCHED_BULK)
+            pthread_cond_signal(&s->cond);
+    }
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+int reqsched_loop(struct reqsched *s, struct fuse_session *se)
+{
+    struct fuse_chan *ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = malloc(bufsize);
+    struct fuse_chan *tmpch;
+    struct reqsched_req *r;
+    pthread_t *threads;
+    int res = 0;
+    int t;
+
+    if (!buf)
+        return -1;
+
+    s->se = se;
+    threads = talloc_array(s, pthread_t, s->nworkers);
+    for (t=0; t < s->nworkers; t++)
+        if (pthread_create(&threads[t], NULL, reqsched_worker, s))
+            break;
+
+    if (!t)
+    {
+        free(buf);
+        talloc_free(threads);
+        return fuse_session_loop(se);
+    }
+
+    /* always leave a worker for metadata */
+    if (s->max_bulk >= t && t > 1)
+        s->max_bulk = t - 1;
+
+    while (!fuse_session_exited(se))
+    {
+        tmpch = ch;
+        res = fuse_chan_recv(&tmpch, buf, bufsize);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+            break;
+
+        r = malloc(sizeof(*r) + res);
+        if (!r)
+        {
+            fuse_session_process(se, buf, res, tmpch);
+            continue;
+        }
+        r->ch = tmpch;
+        r->len = res;
+        r->opcode = res >= sizeof(struct reqsched_in_header) ?
+                    ((struct reqsched_in_header *) buf)->opcode : 0;
+        memcpy(r->buf, buf, res);
+        clock_gettime(CLOCK_MONOTONIC, &r->queued);
+
+        pthread_mutex_lock(&s->lock);
+        reqsched_queue(s, r);
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+
+    while (t--)
+        pthread_join(threads[t], NULL);
+    talloc_free(threads);
+    free(buf);
+
+    fuse_session_reset(se);
+    return res < 0 ? -1 : 0;
+}
+
+static u64 reqsched_percentile(const u64 *hist,
+                               const struct reqsched_class *c, int pct)
+{
+    u64 want = (c->count * pct + 99) / 100, seen = 0;
+    u32 b;
+
+    for (b=0; b < REQSCHED_HIST_SIZE; b++)
+    {
+        seen += hist[b];
+        if (seen >= want)
+            return reqsched_bucket_us(b);
+    }
+    return 0;
+}
+
+void reqsched_report(struct reqsched *s, const char *name)
+{
+    struct reqsched_class *c;
+    int cls;
+
+    for (cls=0; cls < REQSCHED_NCLASSES; cls++)
+    {
+        c = &s->cls[cls];
+        if (!c->count)
+            continue;
+        fprintf(stderr, "%s: %llu %s requests, queued p50 %lluus p99 %lluus, "
+                "total p50 %lluus p99 %lluus max %lluus\n", name,
+                (unsigned long long) c->count, reqsched_class_names[cls],
+                (unsigned long long) reqsched_percentile(c->wait, c, 50),
+                (unsigned long long) reqsched_percentile(c->wait, c, 99),
+                (unsigned long long) reqsched_percentile(c->total, c, 50),
+                (unsigned long long) reqsched_percentile(c->total, c, 99),
+                (unsigned long long) c->max_us);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef _REQSCHED_H
+#define _REQSCHED_H
+
+#include <fuse/fuse_lowlevel.h>
+
+#include "config.h"
+
+/*
+ * Request scheduling, in place of fuse_session_loop_mt().  Requests are
+ * read off the channel by one thread and queued by class: file data reads
+ * are bulk, everything else (lookup, getattr, readdir, ...) is metadata.
+ * A pool of workers takes them off the queues, up to REQSCHED_META_WEIGHT
+ * metadata requests for every bulk one while both are waiting, and never
+ * more than max_bulk bulk requests at once, so that a few large streaming
+ * reads can't take every worker and the device's whole queue while ls
+ * waits behind them.  Queue wait and total latency are kept per class.
+ */
+struct reqsched;
+
+/* defaults: worker threads, concurrent bulk requests */
+#define REQSCHED_WORKERS        8
+#define REQSCHED_MAX_BULK       2
+
+#define REQSCHED_META_WEIGHT    4
+
+struct reqsched *reqsched_new(void *mem_ctx, int workers, int max_bulk);
+
+/* serve the session until it exits */
+int reqsched_loop(struct reqsched *s, struct fuse_session *se);
+
+/* print request counts and latency percentiles per class */
+void reqsched_report(struct reqsched *s, const char *name);
+
+#endif /* _REQSCHED_H */
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+#ifdef FSZOO_TRACE
+
+/* events per thread; a full ring drops new events rather than block */
+#define TRACE_RING_SIZE 4096
+#define TRACE_DRAIN_INTERVAL_NS 10000000
+
+static const char *trace_names[] = {
+#define TRACE_NAME(name) #name,
+    TRACE_POINTS(TRACE_NAME)
+#undef TRACE_NAME
+};
+
+/*
+ * Single producer, single consumer ring.  The owning thread only writes
+ * head and the drain thread only writes tail, so neither needs a lock.
+ */
+struct trace_ring
+{
+    struct trace_ring *next;
+    u32 tid;
+    u64 head;
+    u64 tail;
+    u64 dropped;
+    struct trace_event ev[TRACE_RING_SIZE];
+};
+
+/* every ring ever created; only ever pushed onto */
+static struct trace_ring *rings;
+static __thread struct trace_ring *my_ring;
+
+static int trace_fd = -1;
+static int trace_stopping;
+static pthread_t drain_thread;
+
+static struct trace_ring *trace_ring_get(void)
+{
+    struct trace_ring *r = my_ring;
+
+    if (r)
+        return r;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->tid = syscall(SYS_gettid);
+
+    r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        ;
+
+    my_ring = r;
+    return r;
+}
+
+void trace_emit(int point, u64 a, u64 b, u64 c)
+{
+    struct trace_ring *r;
+    struct trace_event *ev;
+    struct timespec ts;
+    u64 head;
+
+    if (__atomic_load_n(&trace_fd, __ATOMIC_RELAXED) < 0)
+        return;
+
+    r = trace_ring_get();
+    if (!r)
+        return;
+
+    head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+    {
+        r->dropped++;
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    ev = &r->ev[head & (TRACE_RING_SIZE - 1)];
+    ev->ts = (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ev->tid = r->tid;
+    ev->point = point;
+    ev->arg[0] = a;
+    ev->arg[1] = b;
+    ev->arg[2] = c;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_drain(void)
+{
+    struct trace_ring *r;
+    u64 head, tail, n;
+
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    {
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        tail = r->tail;
+
+        while (tail != head)
+        {
+            /* up to the end of the ring, then wrap */
+            n = min(head - tail,
+                    TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1)));
+            if (write(trace_fd, &r->ev[tail & (TRACE_RING_SIZE - 1)],
+                      n * sizeof(struct trace_event)) < 0)
+                break;
+            tail += n;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *trace_drain_thread(void *arg)
+{
+    struct timespec interval = { 0, TRACE_DRAIN_INTERVAL_NS };
+
+    while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE))
+    {
+        trace_drain();
+        nanosleep(&interval, NULL);
+    }
+    trace_drain();
+    return NULL;
+}
+
+static void trace_drain_start(void)
+{
+    __atomic_store_n(&trace_stopping, 0, __ATOMIC_RELEASE);
+    if (pthread_create(&drain_thread, NULL, trace_drain_thread, NULL))
+        trace_fd = -1;
+}
+
+static void trace_drain_join(void)
+{
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(drain_thread, NULL);
+}
+
+/* the drain thread does not survive fuse_daemonize(), restart it */
+static void trace_atfork_prepare(void)
+{
+    if (trace_fd >= 0)
+        trace_drain_join();
+}
+
+static void trace_atfork_resume(void)
+{
+    if (trace_fd >= 0)
+        trace_drain_start();
+}
+
+int trace_start(const char *path)
+{
+    struct trace_header hdr = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .npoints = TP_MAX,
+    };
+    int fd;
+    int i;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -errno;
+
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        goto err;
+    for (i=0; i < TP_MAX; i++)
+        if (write(fd, trace_names[i], strlen(trace_names[i]) + 1) < 0)
+            goto err;
+
+    trace_fd = fd;
+    trace_drain_start();
+    if (trace_fd < 0)
+        goto err;
+
+    pthread_atfork(trace_atfork_prepare, trace_atfork_resume,
+                   trace_atfork_resume);
+    return 0;
+
+err:
+    close(fd);
+    return -EIO;
+}
+
+void trace_stop(void)
+{
+    struct trace_ring *r;
+    u64 dropped = 0;
+
+    if (trace_fd < 0)
+        return;
+
+    trace_drain_join();
+
+    for (r = rings; r; r = r->next)
+        dropped += r->dropped;
+    if (dropped)
+        fprintf(stderr, "trace: dropped %llu events\n",
+                (unsigned long long) dropped);
+
+    close(trace_fd);
+    trace_fd = -1;
+}
+
+#else
+
+int trace_start(const char *path)
+{
+    fprintf(stderr, "trace: built without tracing, see FSZOO_TRACE\n");
+    return -ENOSYS;
+}
+
+void trace_stop(void)
+{
+}
+
+#endif
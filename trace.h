@@ -0,0 +1,73 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include "config.h"
+
+/*
+ * Tracepoints for the I/O, mapping, lookup and scan paths.
+ *
+ * Built with -DFSZOO_TRACE, trace() records a fixed-size binary event in
+ * a per-thread ring buffer, and a background thread drains the rings to
+ * the file given to trace_start(); trace_dump decodes it.  Built with
+ * -DFSZOO_TRACE_USDT, tracepoints are USDT probes in the "fszoo" provider
+ * for perf and bpftrace instead.  Otherwise they compile to nothing.
+ *
+ * Each tracepoint takes three integer arguments, listed beside it.
+ */
+#define TRACE_POINTS(X) \
+    X(yaffs2_probe)         /* blocks, planned extents, summary blocks */ \
+    X(yaffs2_scan_window)   /* chunks, bytes, 0 */ \
+    X(yaffs2_scan_done)     /* objects, blocks, error */ \
+    X(yaffs2_map_chunk)     /* object, logical chunk, device chunk */ \
+    X(yaffs2_preadv)        /* device offset, bytes, iovecs */ \
+    X(yaffs2_read)          /* object, offset, bytes */ \
+    X(yaffs2_lookup)        /* parent, found object or 0, 0 */ \
+    X(ext2_bread)           /* block, block size, bytes read */ \
+    X(ext2_map_block)       /* logical block, device block, levels */ \
+    X(ext2_read_inode)      /* inode, inode table block, 0 */ \
+    X(ext2_read)            /* inode, offset, bytes */ \
+    X(ext2_lookup)          /* parent, found inode or 0, 0 */ \
+    X(ext2_opendir)         /* inode, entries, error */ \
+    X(yaffs2_checkpoint)    /* blocks, objects, error */ \
+    X(reqsched_request)     /* opcode, queued us, service us */
+
+enum trace_point {
+#define TRACE_ENUM(name) TP_##name,
+    TRACE_POINTS(TRACE_ENUM)
+#undef TRACE_ENUM
+    TP_MAX
+};
+
+/* on-disk trace file: header, tracepoint names, then events */
+#define TRACE_MAGIC     "FSZOOTRC"
+#define TRACE_VERSION   1
+
+struct trace_header {
+    char magic[8];
+    u32 version;
+    u32 npoints;            /* followed by NUL terminated names */
+};
+
+struct trace_event {
+    u64 ts;                 /* CLOCK_MONOTONIC, ns */
+    u32 tid;
+    u32 point;
+    u64 arg[3];
+};
+
+#if defined(FSZOO_TRACE)
+void trace_emit(int point, u64 a, u64 b, u64 c);
+#define trace(name, a, b, c) \
+    trace_emit(TP_##name, (u64) (a), (u64) (b), (u64) (c))
+#elif defined(FSZOO_TRACE_USDT)
+#include <sys/sdt.h>
+#define trace(name, a, b, c) DTRACE_PROBE3(fszoo, name, a, b, c)
+#else
+#define trace(name, a, b, c) \
+    do { if (0) { (void) (a); (void) (b); (void) (c); } } while (0)
+#endif
+
+int trace_start(const char *path);
+void trace_stop(void);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,62 @@
+/*
+ * Decode a trace file written by an ext2_fuse or yaffs2_fuse built with
+ * tracing: one line per event with time, thread, tracepoint and args.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "trace.h"
+
+int main(int argc, char *argv[])
+{
+    struct trace_header hdr;
+    struct trace_event ev;
+    char names[TP_MAX + 64][64];
+    u64 first = 0;
+    FILE *fp;
+    int i, j, c;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace_file>\n", argv[0]);
+        return 1;
+    }
+
+    fp = fopen(argv[1], "r");
+    if (!fp)
+    {
+        perror("trace_dump");
+        return 2;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != TRACE_VERSION ||
+        hdr.npoints > sizeof(names) / sizeof(names[0]))
+    {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        return 3;
+    }
+
+    for (i=0; i < hdr.npoints; i++)
+    {
+        for (j=0; (c = fgetc(fp)) > 0; )
+            if (j < sizeof(names[i]) - 1)
+                names[i][j++] = c;
+        names[i][j] = 0;
+    }
+
+    while (fread(&ev, sizeof(ev), 1, fp) == 1)
+    {
+        if (!first)
+            first = ev.ts;
+
+        printf("%12.6f %6u %-20s %llx %llx %llx\n",
+               (ev.ts - first) / 1e9, ev.tid,
+               ev.point < hdr.npoints ? names[ev.point] : "?",
+               (unsigned long long) ev.arg[0],
+               (unsigned long long) ev.arg[1],
+               (unsigned long long) ev.arg[2]);
+    }
+    return 0;
+}
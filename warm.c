@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <talloc.h>
+
+#include "warm.h"
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+#define WARM_MAGIC          "FSZOOWRM"
+#define WARM_VERSION        1
+
+/* file data heat is kept per unit of at least this many bytes */
+#define WARM_UNIT_SHIFT     16
+#define WARM_MAX_UNITS      (4 << 20)
+
+/* a profile holds at most this much file data and metadata */
+#define WARM_MAX_DATA       (1ULL << 30)
+#define WARM_MAX_META       (64 << 10)
+
+/* replay works through the profile in pieces of this many bytes */
+#define WARM_STEP           (1 << 20)
+
+/* on disk, little endian: the header, nmeta then ndata runs */
+struct warm_header
+{
+    char magic[8];
+    u32 version;
+    u32 block_size;         /* metadata cache block size */
+    u64 dev_size;
+    u32 nmeta;
+    u32 ndata;
+};
+
+struct warm_run
+{
+    u64 off;
+    u64 len;
+};
+
+struct warm
+{
+    const char *path;
+    struct bdev *dev;
+    u64 dev_size;
+    struct bcache *bc;
+    u32 block_size;
+
+    u8 *heat;               /* per unit, saturating */
+    u32 nunits;
+    int unit_shift;
+
+    /* the profile found at startup, to replay */
+    struct warm_run *meta, *data;
+    u32 nmeta, ndata;
+
+    u64 rate;               /* bytes per second */
+    int interval;
+    pthread_t thread;
+    int running;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int warm_destroy(struct warm *w)
+{
+    warm_stop(w);
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    return 0;
+}
+
+static int warm_load(struct warm *w)
+{
+    struct warm_header hdr;
+    struct warm_run *runs;
+    FILE *fp = fopen(w->path, "r");
+    u32 i, n;
+
+    if (!fp)
+        return -errno;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, WARM_MAGIC, sizeof(hdr.magic)) ||
+        le32_to_cpu(hdr.version) != WARM_VERSION ||
+        le64_to_cpu(hdr.dev_size) != w->dev_size)
+        goto bad;
+
+    n = le32_to_cpu(hdr.nmeta) + le32_to_cpu(hdr.ndata);
+    runs = talloc_array(w, struct warm_run, n);
+    if (!runs || fread(runs, sizeof(*runs), n, fp) != n)
+        goto bad;
+    for (i=0; i < n; i++)
+    {
+        runs[i].off = le64_to_cpu(runs[i].off);
+        runs[i].len = le64_to_cpu(runs[i].len);
+    }
+
+    /* metadata only comes back into a cache of the same block size */
+    if (le32_to_cpu(hdr.block_size) == w->block_size)
+    {
+        w->meta = runs;
+        w->nmeta = le32_to_cpu(hdr.nmeta);
+    }
+    w->data = runs + le32_to_cpu(hdr.nmeta);
+    w->ndata = le32_to_cpu(hdr.ndata);
+
+    /* last time's hot data stays in the profile until beaten */
+    for (i=0; i < w->ndata; i++)
+        warm_touch(w, w->data[i].off, w->data[i].len);
+
+    fclose(fp);
+    return 0;
+
+bad:
+    fclose(fp);
+    return -EINVAL;
+}
+
+struct warm *warm_new(void *mem_ctx, const char *path, struct bdev *dev)
+{
+    struct warm *w = talloc_zero(mem_ctx, struct warm);
+
+    w->path = talloc_strdup(w, path);
+    w->dev = dev;
+    w->dev_size = bdev_size(dev);
+
+    w->unit_shift = WARM_UNIT_SHIFT;
+    while ((w->dev_size >> w->unit_shift) >= WARM_MAX_UNITS)
+        w->unit_shift++;
+    w->nunits = (w->dev_size >> w->unit_shift) + 1;
+    w->heat = talloc_zero_array(w, u8, w->nunits);
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    talloc_set_destructor(w, warm_destroy);
+    return w;
+}
+
+void warm_set_cache(struct warm *w, struct bcache *bc, u32 block_size)
+{
+    w->bc = bc;
+    w->block_size = block_size;
+}
+
+void warm_touch(struct warm *w, u64 off, u64 len)
+{
+    u64 u, last;
+    u8 h;
+
+    if (!len || off >= w->dev_size)
+        return;
+
+    last = (min(off + len, w->dev_size) - 1) >> w->unit_shift;
+    for (u = off >> w->unit_shift; u <= last; u++)
+    {
+        /* racy, but a lost count or two doesn't matter */
+        h = __atomic_load_n(&w->heat[u], __ATOMIC_RELAXED);
+        if (h < 255)
+            __atomic_store_n(&w->heat[u], h + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static int warm_blk_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void warm_put_run(FILE *fp, u64 off, u64 len)
+{
+    struct warm_run run = { cpu_to_le64(off), cpu_to_le64(len) };
+
+    fwrite(&run, sizeof(run), 1, fp);
+}
+
+/* the hottest units up to WARM_MAX_DATA, then age them all */
+static u32 warm_save_data(struct warm *w, FILE *fp)
+{
+    u64 hist[256] = { 0 };
+    u64 total = 0, start = 0;
+    u32 u, n = 0, run = 0;
+    int threshold;
+    u8 h;
+
+    for (u=0; u < w->nunits; u++)
+        hist[w->heat[u]]++;
+    for (threshold = 255; threshold > 1; threshold--)
+    {
+        total += hist[threshold] << w->unit_shift;
+        if (total + (hist[threshold - 1] << w->unit_shift) > WARM_MAX_DATA)
+            break;
+    }
+
+    for (u=0; u <= w->nunits; u++)
+    {
+        h = u < w->nunits ? __atomic_load_n(&w->heat[u], __ATOMIC_RELAXED)
+                          : 0;
+        if (h >= threshold && !run++)
+            start = u;
+        if (h < threshold && run)
+        {
+            warm_put_run(fp, start << w->unit_shift,
+                         min((u64) run << w->unit_shift,
+                             w->dev_size - (start << w->unit_shift)));
+            n++;
+            run = 0;
+        }
+
+        if (u < w->nunits)
+            __atomic_store_n(&w->heat[u], h - (h >> 2), __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/* what is in the metadata cache now, merged into runs */
+static u32 warm_save_meta(struct warm *w, FILE *fp)
+{
+    u64 *blks;
+    u32 i, j, nblks, n = 0;
+
+    if (!w->bc)
+        return 0;
+
+    blks = talloc_array(NULL, u64, WARM_MAX_META);
+    nblks = bcache_blocks(w->bc, blks, WARM_MAX_META);
+    qsort(blks, nblks, sizeof(*blks), warm_blk_cmp);
+
+    for (i=0; i < nblks; i = j)
+    {
+        for (j=i + 1; j < nblks && blks[j] == blks[j - 1] + 1; j++)
+            ;
+        warm_put_run(fp, blks[i] * w->block_size,
+                     (u64) (j - i) * w->block_size);
+        n++;
+    }
+    talloc_free(blks);
+    return n;
+}
+
+static int warm_save(struct warm *w)
+{
+    struct warm_header hdr = { WARM_MAGIC };
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", w->path);
+    FILE *fp = fopen(tmp, "w");
+    int err = 0;
+
+    if (!fp)
+    {
+        talloc_free(tmp);
+        return -errno;
+    }
+
+    /* the counts are patched in once the runs are written */
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    hdr.version = cpu_to_le32(WARM_VERSION);
+    hdr.block_size = cpu_to_le32(w->block_size);
+    hdr.dev_size = cpu_to_le64(w->dev_size);
+    hdr.nmeta = cpu_to_le32(warm_save_meta(w, fp));
+    hdr.ndata = cpu_to_le32(warm_save_data(w, fp));
+
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    if (ferror(fp))
+        err = -EIO;
+    if (fclose(fp) && !err)
+        err = -errno;
+
+    if (!err && rename(tmp, w->path))
+        err = -errno;
+    if (err)
+        unlink(tmp);
+    talloc_free(tmp);
+    return err;
+}
+
+/* wait until sent bytes are due at the replay rate; nonzero to stop */
+static int warm_pace(struct warm *w, struct timespec *start, u64 sent)
+{
+    struct timespec due = *start;
+    int stop;
+
+    if (w->rate)
+    {
+        due.tv_sec += sent / w->rate;
+        due.tv_nsec += (sent % w->rate) * 1000000000ULL / w->rate;
+        if (due.tv_nsec >= 1000000000)
+        {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop &&
+           pthread_cond_timedwait(&w->cond, &w->lock, &due) != ETIMEDOUT)
+        ;
+    stop = w->stop;
+    pthread_mutex_unlock(&w->lock);
+    return stop;
+}
+
+static void *warm_thread(void *arg)
+{
+    struct warm *w = arg;
+    struct timespec start, next;
+    u64 sent = 0, off, end, len;
+    u32 i;
+    int stop = 0;
+
+    clock_gettime(CLOCK_REALTIME, &start);
+
+    /* metadata first: it is small and every lookup wants it */
+    for (i=0; i < w->nmeta && !stop; i++)
+        for (off = w->meta[i].off, end = off + w->meta[i].len;
+             off < end && !stop; off += len)
+        {
+            len = min(end - off, WARM_STEP);
+            bcache_prefetch(w->bc, off / w->block_size, len / w->block_size);
+            stop = warm_pace(w, &start, sent += len);
+        }
+
+    for (i=0; i < w->ndata && !stop; i++)
+        for (off = w->data[i].off, end = off + w->data[i].len;
+             off < end && !stop; off += len)
+        {
+            len = min(end - off, WARM_STEP);
+            bdev_hint(w->dev, BDEV_HINT_WILLNEED, off, len);
+            stop = warm_pace(w, &start, sent += len);
+        }
+
+    while (!stop && w->interval)
+    {
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += w->interval;
+
+        pthread_mutex_lock(&w->lock);
+        while (!w->stop &&
+               pthread_cond_timedwait(&w->cond, &w->lock, &next) != ETIMEDOUT)
+            ;
+        stop = w->stop;
+        pthread_mutex_unlock(&w->lock);
+
+        if (!stop)
+            warm_save(w);
+    }
+    return NULL;
+}
+
+int warm_start(struct warm *w, u64 rate, int interval)
+{
+    int err;
+
+    warm_load(w);
+    w->rate = rate;
+    w->interval = interval;
+
+    err = pthread_create(&w->thread, NULL, warm_thread, w);
+    if (err)
+        return -err;
+    w->running = 1;
+    return 0;
+}
+
+/* stop replaying and save the profile */
+void warm_stop(struct warm *w)
+{
+    if (!w->running)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+
+    if (warm_save(w))
+        fprintf(stderr, "warm: could not save %s\n", w->path);
+}
@@ -0,0 +1,30 @@
+#ifndef _WARM_H
+#define _WARM_H
+
+#include "config.h"
+#include "bdev.h"
+#include "bcache.h"
+
+/*
+ * Cache warm-up across restarts.  While mounted, file data reads are
+ * counted per unit of the device and the metadata cache's contents are
+ * noted; the hottest of both are saved to a profile file every so often
+ * and at unmount.  At the next mount the profile is replayed in the
+ * background, in device order and at a bounded rate: metadata back into
+ * the cache, file data as WILLNEED hints to the block device.
+ */
+struct warm;
+
+/* defaults: seconds between saves, replay rate in MB/s */
+#define WARM_SAVE_INTERVAL  60
+#define WARM_RATE           64
+
+struct warm *warm_new(void *mem_ctx, const char *path, struct bdev *dev);
+void warm_set_cache(struct warm *w, struct bcache *bc, u32 block_size);
+void warm_touch(struct warm *w, u64 off, u64 len);
+
+/* replay the saved profile, then save a new one every interval seconds */
+int warm_start(struct warm *w, u64 rate, int interval);
+void warm_stop(struct warm *w);
+
+#endif /* _WARM_H */
@@ -1,610 +1,2093 @@
-#include <fuse.h>
-#include <fuse/fuse_lowlevel.h>
 #include <talloc.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <linux/fs.h>
 #include <sys/stat.h>
 #include <errno.h>
-#include <glib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/uio.h>
 
 #include "yaffs2.h"
 #include "config.h"
+#include "trace.h"
+#include "ecc.h"
+#include "bdev.h"
+#include "manifest.h"
+#include "warm.h"
+#include "fszoo.h"
 
 #define min(a,b) ((a)<(b)?(a):(b))
 #define max(a,b) ((a)>(b)?(a):(b))
 #define div_round(a,b) ((a)+(b)-1)/(b)
 
-struct yaffs2_info
+/* the mount scan reads the device in windows of about this many bytes */
+#define SCAN_WINDOW_SIZE (4 << 20)
+
+/* inodes are carved out of slabs of this many */
+#define INODE_SLAB_SIZE 1024
+
+/* file reads checked against ECC go through a buffer of this many chunks */
+#define ECC_READ_CHUNKS 32
+
+/* map a logical file chunk to its device chunk, or ~0 for a hole */
+u32 yaffs2_map_chunk(struct yaffs2_inode *inode, u32 logical_block)
 {
-    FILE *dev;
+    struct yaffs2_extent *e;
+    u32 lo = 0, hi = inode->nextents;
+    u32 mid;
 
-    /* parameters for our fake flash */
-    int mtd_page;
-    int mtd_extra;
-    int mtd_erase;
-    int chunks_per_block;
-    int nblocks;
-    int nchunks;
+    /* find the last extent starting at or before logical_block */
+    while (hi - lo > 1)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (inode->extents[mid].logical <= logical_block)
+            lo = mid;
+        else
+            hi = mid;
+    }
 
-    int block_size;
+    if (!inode->nextents)
+        return ~0;
 
-    /* object table, indexed by inode number */
-    GHashTable *object_map;
-};
+    e = &inode->extents[lo];
+    if (logical_block < e->logical || logical_block >= e->logical + e->count)
+        return ~0;
 
-/* internal I/O routines */
+    trace(yaffs2_map_chunk, inode->object_id, logical_block,
+          e->physical + (logical_block - e->logical));
+    return e->physical + (logical_block - e->logical);
+}
 
-int bread(void *buf, int blk_size, u64 blk, FILE *fp)
+void yaffs2_unpack_tags(struct yaffs2_ext_tags *t, const void *raw)
 {
-    fseeko(fp, blk * blk_size, SEEK_SET);
-    return fread(buf, blk_size, 1, fp);
+    const struct yaffs2_tags *tags = raw;
+
+    t->sequence_number = le32_to_cpu(tags->sequence_number);
+    t->object_id = le32_to_cpu(tags->object_id);
+    t->chunk_id = le32_to_cpu(tags->chunk_id);
+    t->byte_count = le32_to_cpu(tags->byte_count);
+
+    if (t->sequence_number != YAFFS_SEQUENCE_ERASED &&
+        (t->chunk_id & YAFFS_EXTRA_HEADER_INFO_FLAG))
+    {
+        t->object_id &= ~YAFFS_EXTRA_OBJECT_TYPE_MASK;
+        t->chunk_id = 0;
+    }
 }
 
-u8 *bread_m(int blk_size, u64 blk, u64 count, FILE *fp)
+static u32 object_slot(struct yaffs2_info *info, u32 ino)
 {
-    u8 *mem = talloc_size(NULL, blk_size * count);
-    bread(mem, blk_size, blk * count, fp);
-    return mem;
+    return (ino * 2654435761u) & info->objects_mask;
 }
 
-size_t device_get_size(FILE *fp)
+int yaffs2_read_inode(struct yaffs2_info *info, u32 ino,
+                      struct yaffs2_inode **ret)
 {
-    off_t here = ftello(fp);
-    off_t end;
+    struct yaffs2_inode *inode;
+    u32 slot;
 
-    fseeko(fp, 0, SEEK_END);
-    end = ftello(fp);
-    fseeko(fp, here, SEEK_SET);
+    if (!info->objects)
+        return -ENOENT;
 
-    return end;
+    for (slot = object_slot(info, ino); (inode = info->objects[slot]);
+         slot = (slot + 1) & info->objects_mask)
+    {
+        if (inode->object_id == ino)
+        {
+            *ret = inode;
+            return 0;
+        }
+    }
+    return -ENOENT;
 }
 
-u8 *yaffs2_get_block_n(struct yaffs2_info *info, struct yaffs2_inode *inode,
-                     int logical_block)
+static void insert_inode(struct yaffs2_info *info, struct yaffs2_inode *inode)
 {
-    int leaf_index = logical_block & YAFFS_LEAF_MASK;
-    int tree_index;
-    int i;
-    struct yaffs2_tree *block_tree;
+    u32 slot = object_slot(info, inode->object_id);
 
-    block_tree = inode->block_tree;
-    for (i=inode->block_tree_height; i > 0; i--)
-    {
-        tree_index = (logical_block >> ((i-1) * YAFFS_INTERNAL_BITS +
-            YAFFS_LEAF_BITS)) & YAFFS_INTERNAL_MASK;
-
-        if (!block_tree->u.i.ptrs[tree_index])
-            return NULL;
+    while (info->objects[slot])
+        slot = (slot + 1) & info->objects_mask;
+    info->objects[slot] = inode;
+}
 
-        block_tree = block_tree->u.i.ptrs[tree_index];
-    }
+/* call fn on every object */
+static void for_each_inode(struct yaffs2_info *info,
+    void (*fn)(struct yaffs2_info *, struct yaffs2_inode *))
+{
+    u32 i;
 
-    printf("read block %x for file %x at %x\n", logical_block,
-        inode->object_id, block_tree->u.l.phys[leaf_index]);
+    for (i=0; i <= info->objects_mask; i++)
+        if (info->objects[i])
+            fn(info, info->objects[i]);
+}
 
-    return bread_m(info->mtd_page + info->mtd_extra,
-        block_tree->u.l.phys[leaf_index], 1, info->dev);
+const char *yaffs2_inode_name(struct yaffs2_info *info,
+                              struct yaffs2_inode *inode)
+{
+    return info->names + inode->name;
 }
 
-int yaffs2_read_inode(struct yaffs2_info *info, u32 ino,
-                      struct yaffs2_inode **ret)
+static u32 intern_name(struct yaffs2_info *info, const char *name, u32 len)
 {
-    gboolean found;
-    gpointer key, value;
+    u32 off;
 
-    found = g_hash_table_lookup_extended(info->object_map, &ino,
-                                         &key, &value);
-    if (!found)
-        return -ENOENT;
+    while (info->names_len + len + 1 > info->names_size)
+    {
+        info->names_size = max(65536, info->names_size * 2);
+        info->names = talloc_realloc(info, info->names, char,
+                                     info->names_size);
+    }
 
-    *ret = value;
-    return 0;
+    off = info->names_len;
+    memcpy(info->names + off, name, len);
+    info->names[off + len] = 0;
+    info->names_len += len + 1;
+    return off;
 }
 
 void add_data_block(struct yaffs2_info *info, struct yaffs2_inode *inode,
                     u32 logical_block, u32 physical_block)
 {
-    int leaf_index = logical_block & YAFFS_LEAF_MASK;
-    int tree_index = logical_block >> YAFFS_LEAF_BITS;
-    int height = 0;
-    struct yaffs2_tree *block_tree;
-    int i;
+    struct yaffs2_extent *e;
 
-    /* see if the tree needs to grow */
-    while (tree_index)
+    if (inode->nextents)
     {
-        height++;
-        tree_index >>= YAFFS_INTERNAL_BITS;
+        e = &inode->extents[inode->nextents - 1];
+
+        /* the common case: the file was written front to back */
+        if (logical_block == e->logical + e->count &&
+            physical_block == e->physical + e->count)
+        {
+            e->count++;
+            return;
+        }
+
+        /* rewritten or out of order, sort it out after the scan */
+        if (logical_block < e->logical + e->count)
+            inode->extents_unsorted = 1;
     }
 
-    /* grow if needed */
-    while (inode->block_tree_height < height)
+    if (inode->nextents == inode->extents_size)
     {
-        /* leave pointers null until there is data */
-        block_tree = talloc_zero_size(inode, sizeof(struct yaffs2_tree));
-        block_tree->u.i.ptrs[0] = inode->block_tree;
-
-        inode->block_tree = block_tree;
-        inode->block_tree_height++;
+        inode->extents_size = max(4, inode->extents_size * 2);
+        inode->extents = talloc_realloc(info, inode->extents,
+            struct yaffs2_extent, inode->extents_size);
     }
 
-    /* now search down the tree for the correct leaf */
-    block_tree = inode->block_tree;
-    for (i=inode->block_tree_height; i > 0; i--)
+    e = &inode->extents[inode->nextents++];
+    e->logical = logical_block;
+    e->physical = physical_block;
+    e->count = 1;
+}
+
+struct chunk_ref
+{
+    u32 logical;
+    u32 physical;
+    u32 order;
+};
+
+static int chunk_ref_cmp(const void *a, const void *b)
+{
+    const struct chunk_ref *c1 = a, *c2 = b;
+
+    if (c1->logical != c2->logical)
+        return c1->logical < c2->logical ? -1 : 1;
+
+    /* the chunk seen later in the scan wins */
+    return c1->order > c2->order ? -1 : c1->order < c2->order;
+}
+
+/*
+ * Turn the extents collected by the scan into a sorted, non-overlapping
+ * map, trimmed to size.  Files that were written front to back are
+ * already in that shape; the others are sorted a chunk at a time.
+ */
+static void finish_chunk_map(struct yaffs2_info *info,
+                             struct yaffs2_inode *inode)
+{
+    struct chunk_ref *refs;
+    struct yaffs2_extent *e;
+    u32 nrefs = 0;
+    u32 i, j;
+
+    if (inode->extents_unsorted)
     {
-        tree_index = (logical_block >> ((i-1) * YAFFS_INTERNAL_BITS +
-            YAFFS_LEAF_BITS)) & YAFFS_INTERNAL_MASK;
+        for (i=0; i < inode->nextents; i++)
+            nrefs += inode->extents[i].count;
+
+        refs = talloc_array(NULL, struct chunk_ref, nrefs);
+        nrefs = 0;
+        for (i=0; i < inode->nextents; i++)
+        {
+            e = &inode->extents[i];
+            for (j=0; j < e->count; j++)
+            {
+                refs[nrefs].logical = e->logical + j;
+                refs[nrefs].physical = e->physical + j;
+                refs[nrefs].order = i;
+                nrefs++;
+            }
+        }
+        qsort(refs, nrefs, sizeof(*refs), chunk_ref_cmp);
 
-        if (!block_tree->u.i.ptrs[tree_index])
+        inode->nextents = 0;
+        for (i=0; i < nrefs; i++)
         {
-            block_tree->u.i.ptrs[tree_index] = talloc_zero_size(inode,
-                sizeof(struct yaffs2_tree));
+            if (i && refs[i].logical == refs[i-1].logical)
+                continue;
+            add_data_block(info, inode, refs[i].logical, refs[i].physical);
         }
-        block_tree = block_tree->u.i.ptrs[tree_index];
+        talloc_free(refs);
+        inode->extents_unsorted = 0;
+    }
+
+    if (inode->extents_size != inode->nextents)
+    {
+        inode->extents = talloc_realloc(info, inode->extents,
+            struct yaffs2_extent, inode->nextents);
+        inode->extents_size = inode->nextents;
     }
-    /* at leaf, save physical pointer */
-    block_tree->u.l.phys[leaf_index] = physical_block;
 }
 
 struct yaffs2_inode *find_or_create_inode(struct yaffs2_info *info, u32 ino)
 {
+    struct yaffs2_inode **old = info->objects;
     struct yaffs2_inode *inode;
+    u32 old_mask = info->objects_mask;
+    u32 i;
 
     if (yaffs2_read_inode(info, ino, &inode) == 0)
         return inode;
 
-    inode = talloc_zero_size(info, sizeof(*inode));
-    inode->object_id = ino;
+    /* keep the table at most 3/4 full */
+    if (!old || (info->nobjects + 1) * 4 > (old_mask + 1) * 3)
+    {
+        info->objects_mask = old ? old_mask * 2 + 1 : 1023;
+        info->objects = talloc_zero_array(info, struct yaffs2_inode *,
+                                          info->objects_mask + 1);
+        for (i=0; old && i <= old_mask; i++)
+            if (old[i])
+                insert_inode(info, old[i]);
+        talloc_free(old);
+    }
 
-    /* FIXME only for files.. */
-    inode->block_tree = talloc_zero_size(info, sizeof(struct yaffs2_tree));
+    if (!info->inode_slab || info->slab_used == INODE_SLAB_SIZE)
+    {
+        info->inode_slab = talloc_zero_array(info, struct yaffs2_inode,
+                                             INODE_SLAB_SIZE);
+        info->slab_used = 0;
+    }
+    inode = &info->inode_slab[info->slab_used++];
+    inode->object_id = ino;
 
-    /* hash the new inode */
-    g_hash_table_insert(info->object_map, &inode->object_id, inode);
+    insert_inode(info, inode);
+    info->nobjects++;
     return inode;
 }
 
-int inodes_equal(const void *i1, const void *i2)
+/* the root directory need not have a header on flash */
+static void add_root(struct yaffs2_info *info)
 {
-    const struct yaffs2_inode *inode1 = i1;
-    const struct yaffs2_inode *inode2 = i2;
+    struct yaffs2_inode *root_dir;
 
-    return inode1->object_id == inode2->object_id;
+    root_dir = find_or_create_inode(info, YAFFS_OBJECTID_ROOT);
+    root_dir->type = YAFFS_OBJECT_TYPE_DIRECTORY;
+    root_dir->mode = S_IFDIR | 0755;
 }
 
-int yaffs2_read_super(struct yaffs2_info *info)
+/*
+ * Mount scan reader.  The probe pass decides which chunks the scan has to
+ * read and records them as a plan of extents in device order.  A helper
+ * thread then reads the plan in windows of about SCAN_WINDOW_SIZE bytes,
+ * filling the next window while the scanner parses the current one, so
+ * there are only ever two windows in memory and parsing overlaps the I/O.
+ */
+struct scan_extent
 {
-    struct yaffs2_inode *root_dir, *inode, *parent;
-    struct yaffs2_object_header *object;
-    struct yaffs2_tags *tags;
-    int block, chunk;
-    int devsize;
-    char *buf;
-    int addr;
+    u64 first_chunk;
+    int nchunks;
+};
+
+struct scan_window
+{
+    u8 *buf;
+    int nchunks;            /* 0 marks the end of the plan */
+    int ready;
+};
 
-    info->object_map = g_hash_table_new(g_int_hash, inodes_equal);
+struct scan_reader
+{
+    struct yaffs2_info *info;
+    struct bdev *dev;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+
+    struct scan_window win[2];
+    int window_chunks;
+
+    /* the plan, and the reader thread's position in it */
+    struct scan_extent *plan;
+    int nextents;
+    int ext_idx;
+    int ext_ofs;
+
+    /* the scanner's position */
+    struct scan_window *w;
+    int cur;
+    int pos;
+
+    int error;
+};
 
-    devsize = device_get_size(info->dev);
+static int scan_pread(struct scan_reader *r, u8 *buf, int nchunks, u64 chunk)
+{
+    size_t len = (size_t) nchunks * r->info->block_size;
+    ssize_t ret;
 
-    info->mtd_page = 2048;
-    info->mtd_extra = 64;
-    info->mtd_erase = 131072;
-    info->block_size = info->mtd_page + info->mtd_extra;
-    info->chunks_per_block = info->mtd_erase / info->mtd_page;
+    ret = bdev_pread(r->dev, buf, len, chunk * r->info->block_size);
+    if (ret < 0)
+        return ret;
 
-    /*
-     * A 'chunk' in yaffs terminology is the MTD page size - we assume 2k.
-     * A block is the MTD erase block size.
-     */
-    info->nblocks = devsize / info->mtd_erase;
-    info->nchunks = info->nblocks * info->chunks_per_block;
+    /* short device: the tail reads as erased flash */
+    if (ret < len)
+        memset(buf + ret, 0xff, len - ret);
+    return 0;
+}
 
-    /* setup place holder for the root directory */
-    root_dir = talloc_zero_size(info, sizeof(*root_dir));
-    root_dir->object_id = YAFFS_OBJECTID_ROOT;
-    root_dir->header.mode = S_IFDIR | 0755;
-    g_hash_table_insert(info->object_map, &root_dir->object_id,
-        root_dir);
+static void *scan_reader_thread(void *arg)
+{
+    struct scan_reader *r = arg;
+    struct scan_extent *ext;
+    struct scan_window *w;
+    int i = 0;
+    int n;
 
-    /* scan the whole disk, adding inodes into memory */
-    buf = talloc_size(info, info->mtd_page + info->mtd_extra);
-    for (block = 0; block <= info->nblocks; block++)
+    for (;;)
     {
-        for (chunk = 0; chunk < info->chunks_per_block; chunk++)
-        {
-            bread(buf, info->mtd_page + info->mtd_extra,
-                  info->chunks_per_block * block + chunk, info->dev);
+        w = &r->win[i];
 
-            tags = (struct yaffs2_tags *) &buf[info->mtd_page];
-            object = (struct yaffs2_object_header *) buf;
+        /* wait for the scanner to give this buffer back */
+        pthread_mutex_lock(&r->lock);
+        while (w->ready && !r->stop)
+            pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
 
-            if (tags->sequence_number != ~0 && tags->chunk_id == 0)
-            {
-                inode = find_or_create_inode(info,
-                    le32_to_cpu(tags->object_id));
+        if (r->stop)
+            break;
 
-                if (le32_to_cpu(tags->sequence_number) >
-                    inode->sequence_number)
-                {
-                    memcpy(&inode->header, object, sizeof(*object));
-                    inode->sequence_number =
-                        le32_to_cpu(tags->sequence_number);
-
-                    /* add to parent directory's list */
-                    parent = find_or_create_inode(info,
-                            inode->header.parent_object_id);
-                    parent->children = g_list_prepend(parent->children, inode);
-                }
-            }
-            else if (tags->chunk_id > 0)
-            {
-                addr = block * info->chunks_per_block + chunk;
+        /* fill the window from as many extents as fit */
+        w->nchunks = 0;
+        while (w->nchunks < r->window_chunks && r->ext_idx < r->nextents)
+        {
+            ext = &r->plan[r->ext_idx];
+            n = min(r->window_chunks - w->nchunks, ext->nchunks - r->ext_ofs);
 
-                inode = find_or_create_inode(info,
-                    le32_to_cpu(tags->object_id));
+            r->error = scan_pread(r,
+                w->buf + (size_t) w->nchunks * r->info->block_size, n,
+                ext->first_chunk + r->ext_ofs);
+            if (r->error)
+            {
+                w->nchunks = 0;
+                break;
+            }
 
-                add_data_block(info, inode, tags->chunk_id-1, addr);
+            w->nchunks += n;
+            r->ext_ofs += n;
+            if (r->ext_ofs == ext->nchunks)
+            {
+                r->ext_idx++;
+                r->ext_ofs = 0;
             }
         }
-    }
-    talloc_free(buf);
 
-    return 0;
+        trace(yaffs2_scan_window, w->nchunks,
+              (u64) w->nchunks * r->info->block_size, 0);
+
+        pthread_mutex_lock(&r->lock);
+        w->ready = 1;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+
+        if (!w->nchunks)
+            break;
+
+        i ^= 1;
+    }
+    return NULL;
 }
 
-int yaffs2_stat(struct yaffs2_info *info, u32 ino, struct stat *st)
+static int scan_reader_start(struct scan_reader *r, struct yaffs2_info *info,
+                             struct scan_extent *plan, int nextents)
 {
-    struct yaffs2_inode *inode;
+    int window_blocks;
+    int i;
 
-    if (yaffs2_read_inode(info, ino, &inode))
-        return ENOENT;
+    memset(r, 0, sizeof(*r));
+    r->info = info;
+    r->dev = info->dev;
+    r->plan = plan;
+    r->nextents = nextents;
 
-    st->st_ino = inode->object_id;
-    st->st_mode = le16_to_cpu(inode->header.mode);
-    st->st_nlink = 2;
-    st->st_uid = le16_to_cpu(inode->header.uid);
-    st->st_gid = le16_to_cpu(inode->header.gid);
-    st->st_size = le32_to_cpu(inode->header.size);
-    st->st_atime = le32_to_cpu(inode->header.atime);
-    st->st_mtime = le32_to_cpu(inode->header.mtime);
-    st->st_ctime = le32_to_cpu(inode->header.ctime);
-    st->st_blksize = info->block_size;
-#if 0
-    st->st_blocks = le32_to_cpu(inode.i_blocks);
-#endif
+    window_blocks = max(1, SCAN_WINDOW_SIZE /
+        (info->chunks_per_block * info->block_size));
+    r->window_chunks = window_blocks * info->chunks_per_block;
+
+    for (i=0; i < 2; i++)
+        r->win[i].buf = talloc_size(info,
+            (size_t) r->window_chunks * info->block_size);
+
+    bdev_hint(r->dev, BDEV_HINT_SEQUENTIAL, 0, 0);
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    if (pthread_create(&r->thread, NULL, scan_reader_thread, r))
+        return -EIO;
     return 0;
 }
 
-/* FUSE API */
-
-static void yaffs2_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+/* wait for the next window; returns NULL at the end of the plan */
+static struct scan_window *scan_reader_next(struct scan_reader *r)
 {
-    struct yaffs2_info *info = fuse_req_userdata(req);
-    struct yaffs2_inode *dir;
-    struct yaffs2_inode *inode;
-    struct fuse_entry_param result;
-    GList *list;
-
-    if (yaffs2_read_inode(info, parent, &dir))
-        goto out;
+    struct scan_window *w = &r->win[r->cur];
 
-    /* search the directory's children for name */
-    for (list = g_list_first(dir->children); list; list = g_list_next(list))
-    {
-        inode = list->data;
+    pthread_mutex_lock(&r->lock);
+    while (!w->ready)
+        pthread_cond_wait(&r->cond, &r->lock);
+    pthread_mutex_unlock(&r->lock);
 
-        if (strcmp(inode->header.name, name) == 0)
-        {
-            result.ino = le32_to_cpu(inode->object_id);
-            yaffs2_stat(info, result.ino, &result.attr);
-            goto found;
-        }
-    }
+    return w->nchunks ? w : NULL;
+}
 
-out:
-    fuse_reply_err(req, ENOENT);
-    return;
+/* hand a parsed window back to the reader thread for refilling */
+static void scan_reader_release(struct scan_reader *r, struct scan_window *w)
+{
+    pthread_mutex_lock(&r->lock);
+    w->ready = 0;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    r->cur ^= 1;
+}
 
-found:
-    fuse_reply_entry(req, &result);
+/* returns the next planned chunk (page and OOB), or NULL when done */
+static u8 *scan_reader_chunk(struct scan_reader *r)
+{
+    if (r->w && r->pos == r->w->nchunks)
+    {
+        scan_reader_release(r, r->w);
+        r->w = NULL;
+    }
+    if (!r->w)
+    {
+        r->w = scan_reader_next(r);
+        r->pos = 0;
+        if (!r->w)
+            return NULL;
+    }
+    return r->w->buf + (size_t) r->pos++ * r->info->block_size;
 }
 
-static
-void yaffs2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static int scan_reader_stop(struct scan_reader *r)
 {
-    int err;
-    struct yaffs2_info *info = fuse_req_userdata(req);
-    struct stat st;
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    talloc_free(r->win[0].buf);
+    talloc_free(r->win[1].buf);
+    return r->error;
+}
 
-    err = yaffs2_stat(info, ino, &st);
-    if (err)
-        goto out;
+static void yaffs2_add_data_chunk(struct yaffs2_info *info, u32 object_id,
+                                  u32 chunk_id, u32 addr)
+{
+    struct yaffs2_inode *inode;
 
-    fuse_reply_attr(req, &st, 1.0);
-    return;
-out:
-    fuse_reply_err(req, err);
+    inode = find_or_create_inode(info, object_id);
+    add_data_block(info, inode, chunk_id-1, addr);
 }
 
-static void yaffs2_readlink(fuse_req_t req, fuse_ino_t ino)
+/* decode an object header chunk into the inode */
+static void load_header(struct yaffs2_info *info, struct yaffs2_inode *inode,
+                        struct yaffs2_object_header *object)
 {
-/*
-    fuse_reply_err(req, EIO);
-*/
+    u32 len = strnlen(object->name, sizeof(object->name));
+
+    /* renames are rare, keep the interned name if it is unchanged */
+    if (!inode->name ||
+        strncmp(yaffs2_inode_name(info, inode), object->name, len) ||
+        yaffs2_inode_name(info, inode)[len])
+        inode->name = intern_name(info, object->name, len);
+
+    inode->type = le32_to_cpu(object->object_type);
+    inode->parent_id = le32_to_cpu(object->parent_object_id);
+    inode->mode = le32_to_cpu(object->mode);
+    inode->uid = le32_to_cpu(object->uid);
+    inode->gid = le32_to_cpu(object->gid);
+    inode->atime = le32_to_cpu(object->atime);
+    inode->mtime = le32_to_cpu(object->mtime);
+    inode->ctime = le32_to_cpu(object->ctime);
+    inode->size = le32_to_cpu(object->size);
+
+    talloc_free(inode->alias);
+    inode->alias = NULL;
+    if (inode->type == YAFFS_OBJECT_TYPE_SYMLINK)
+        inode->alias = talloc_strndup(info, object->alias,
+                                      sizeof(object->alias));
 }
 
-static
-void yaffs2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static void yaffs2_scan_chunk(struct yaffs2_info *info, u8 *buf, u32 addr)
 {
-    struct yaffs2_info *info = fuse_req_userdata(req);
     struct yaffs2_inode *inode;
+    struct yaffs2_object_header *object;
+    struct yaffs2_ext_tags tags;
 
-    /* read the inode and store it in fi->fh */
-    if (yaffs2_read_inode(info, ino, &inode))
-        fuse_reply_err(req, ENOENT);
+    yaffs2_unpack_tags(&tags, &buf[info->tags_offset]);
+    object = (struct yaffs2_object_header *) buf;
+
+    if (tags.sequence_number == YAFFS_SEQUENCE_ERASED ||
+        tags.object_id == YAFFS_OBJECTID_SUMMARY)
+        return;
+
+    if (tags.chunk_id == 0)
+    {
+        inode = find_or_create_inode(info, tags.object_id);
+
+        if (tags.sequence_number > inode->sequence_number)
+        {
+            /* a header past correcting is dropped, as yaffs would */
+            if (info->ecc &&
+                ecc_correct_page(info->ecc, buf, buf + info->mtd_page) < 0)
+                return;
 
-    fi->fh = (uint64_t) (unsigned long) inode;
-    fuse_reply_open(req, fi);
+            load_header(info, inode, object);
+            inode->sequence_number = tags.sequence_number;
+        }
+    }
+    else
+    {
+        yaffs2_add_data_chunk(info, tags.object_id, tags.chunk_id, addr);
+    }
 }
 
-static void yaffs2_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-               struct fuse_file_info *fi)
+/* how the scan treats each erase block, as decided by the probe pass */
+enum scan_block_state
 {
-    struct yaffs2_info *info = fuse_req_userdata(req);
-    struct yaffs2_inode *inode = (struct yaffs2_inode *) (unsigned long) fi->fh;
-    u32 blk_start, blk_ofs;
-    int nblocks;
-    char *buf;
-    int bufsize = 0;
-    int i;
+    SCAN_BLOCK_ERASED,      /* skipped entirely */
+    SCAN_BLOCK_FULL,        /* every chunk is read */
+    SCAN_BLOCK_SUMMARY,     /* only object header chunks are read */
+};
 
-    buf = talloc_size(info, size);
-    blk_start = off / info->block_size;
-    blk_ofs = off % info->block_size;
+/* give up looking for summaries after this many blocks without one */
+#define SCAN_SUMMARY_PROBE_LIMIT 16
 
-    /* compute actual size to read */
-    size = min(size, le32_to_cpu(inode->header.size) - off);
-    nblocks = div_round(size + blk_ofs, info->block_size);
+static int summary_tag_is_header(struct yaffs2_summary_tags *tag)
+{
+    return le32_to_cpu(tag->object_id) != 0xffffffff &&
+           le32_to_cpu(tag->chunk_id) == 0;
+}
 
-    /* read all the associated blocks, and copy as space allows */
-    for (i=blk_start; i < blk_start + nblocks; i++)
+/*
+ * Read and validate the summary at the end of a block.  buf has room for
+ * the summary chunks; on success the tags for the first chunks_per_summary
+ * chunks are copied to sum.
+ */
+static int yaffs2_read_summary(struct yaffs2_info *info, int block,
+                               u32 seq, u8 *buf,
+                               struct yaffs2_summary_tags *sum)
+{
+    struct yaffs2_summary_header *hdr;
+    struct yaffs2_ext_tags tags;
+    int nchunks = info->chunks_per_block - info->chunks_per_summary;
+    int per_chunk = info->data_bytes - sizeof(*hdr);
+    int left = info->chunks_per_summary * sizeof(*sum);
+    u8 *dst = (u8 *) sum;
+    u32 csum = 0;
+    u64 chunk;
+    ssize_t ret;
+    int i, n;
+
+    chunk = (u64) block * info->chunks_per_block + info->chunks_per_summary;
+    ret = bdev_pread(info->dev, buf, (size_t) nchunks * info->block_size,
+                     chunk * info->block_size);
+    if (ret != (ssize_t) nchunks * info->block_size)
+        return -EIO;
+
+    for (i=0; i < nchunks && left > 0; i++)
     {
-        u8 *block = yaffs2_get_block_n(info, inode, i);
-        if (!block)
-            goto out;
-
-        memcpy(buf + bufsize, block + blk_ofs, info->block_size - blk_ofs);
-        bufsize += info->block_size - blk_ofs;
-        blk_ofs = 0;
+        if (info->ecc && ecc_correct_page(info->ecc, &buf[i * info->block_size],
+                &buf[i * info->block_size + info->mtd_page]) < 0)
+            return -EBADMSG;
+
+        hdr = (struct yaffs2_summary_header *) &buf[i * info->block_size];
+        yaffs2_unpack_tags(&tags, &buf[i * info->block_size +
+                                       info->tags_offset]);
+
+        if (tags.object_id != YAFFS_OBJECTID_SUMMARY ||
+            tags.chunk_id != i + 1 ||
+            tags.sequence_number != seq ||
+            le32_to_cpu(hdr->version) != YAFFS_SUMMARY_VERSION ||
+            le32_to_cpu(hdr->seq) != seq)
+            return -EINVAL;
+
+        n = min(left, per_chunk);
+        memcpy(dst, hdr + 1, n);
+        dst += n;
+        left -= n;
     }
-    fuse_reply_buf(req, buf, bufsize);
-    return;
 
-out:
-    fuse_reply_err(req, EIO);
+    /* the summary checksum is a plain sum of the tag bytes */
+    for (i=0; i < info->chunks_per_summary * sizeof(*sum); i++)
+        csum += ((u8 *) sum)[i];
+
+    if (left || csum != le32_to_cpu(hdr->sum))
+        return -EINVAL;
+    return 0;
 }
 
-static
-void yaffs2_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+/* the sequence number in a block's first chunk's tags, read only once */
+static int yaffs2_block_seq(struct yaffs2_info *info, u32 *seqs, int block,
+                            u32 *seq)
 {
-    struct yaffs2_inode *inode = (struct yaffs2_inode *) (unsigned long) fi->fh;
+    struct yaffs2_ext_tags tags;
+    u8 raw[YAFFS_PACKED_TAGS_SIZE];
+    ssize_t ret;
 
-    talloc_free(inode);
-    fuse_reply_err(req, 0);
+    if (!seqs[block])
+    {
+        ret = bdev_pread(info->dev, raw, sizeof(raw),
+                         (u64) block * info->chunks_per_block *
+                         info->block_size + info->tags_offset);
+        if (ret < 0)
+            return ret;
+        yaffs2_unpack_tags(&tags, raw);
+
+        /* past the end of the device reads as erased */
+        seqs[block] = ret < sizeof(raw) ? YAFFS_SEQUENCE_ERASED
+                                        : tags.sequence_number;
+    }
+    *seq = seqs[block];
+    return 0;
 }
 
-static
-void yaffs2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+static void plan_add(struct scan_extent **plan, int *nextents, u64 chunk,
+                     int nchunks)
 {
-    fuse_reply_open(req, fi);
+    struct scan_extent *last = *nextents ? &(*plan)[*nextents - 1] : NULL;
+
+    if (last && last->first_chunk + last->nchunks == chunk)
+    {
+        last->nchunks += nchunks;
+        return;
+    }
+
+    if (!(*nextents & (*nextents - 1)) && *nextents >= 16)
+        *plan = talloc_realloc(NULL, *plan, struct scan_extent,
+                               *nextents * 2);
+
+    (*plan)[*nextents].first_chunk = chunk;
+    (*plan)[*nextents].nchunks = nchunks;
+    (*nextents)++;
 }
 
-static
-void yaffs2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                  struct fuse_file_info *fi)
+/*
+ * Probe pass: look at the first chunk's tags of every block, skipping
+ * erased blocks, and at the block summary if there is one.  Builds the
+ * read plan for the scan.
+ */
+static int yaffs2_probe_blocks(struct yaffs2_info *info, u32 *seqs, u8 *state,
+                               struct yaffs2_summary_tags **summaries,
+                               struct scan_extent **plan, int *nextents)
 {
-    struct yaffs2_info *info = fuse_req_userdata(req);
-    struct yaffs2_inode *dir, *inode;
-    char *buf;
-    GList *list;
-    int i;
-    int ret;
-    int bufsize=0;
+    struct yaffs2_summary_tags *sum;
+    int probe_summaries = 1;
+    int nsummaries = 0, nfull = 0;
+    u64 chunk;
+    u32 seq;
+    u8 *buf;
+    int block, i;
+    int err;
 
-    if (yaffs2_read_inode(info, ino, &dir))
-        goto err;
+    *plan = talloc_array(NULL, struct scan_extent, 16);
+    *nextents = 0;
 
-    buf = talloc_size(info, size);
+    buf = talloc_size(NULL, (size_t) (info->chunks_per_block -
+        info->chunks_per_summary) * info->block_size);
 
-    size = min(dir->header.size, size);
+    /* these reads are strided, keep the kernel from reading around them */
+    bdev_hint(info->dev, BDEV_HINT_RANDOM, 0, 0);
 
-    list = g_list_first(dir->children);
-    for (i=0; i < size && list; i++, list = g_list_next(list))
+    for (block = 0; block < info->nblocks; block++)
     {
-        inode = list->data;
+        chunk = (u64) block * info->chunks_per_block;
+
+        err = yaffs2_block_seq(info, seqs, block, &seq);
+        if (err)
+        {
+            talloc_free(buf);
+            return err;
+        }
+
+        /* erased, or a checkpoint block, which holds no objects */
+        if (seq == YAFFS_SEQUENCE_ERASED ||
+            seq == YAFFS_SEQUENCE_CHECKPOINT_DATA)
+        {
+            state[block] = SCAN_BLOCK_ERASED;
+            continue;
+        }
 
-        if (i >= off)
+        if (probe_summaries)
         {
-            struct stat st = {
-                .st_ino = inode->object_id,
-            };
+            sum = talloc_array(summaries, struct yaffs2_summary_tags,
+                               info->chunks_per_summary);
 
-            switch (inode->header.object_type)
+            if (yaffs2_read_summary(info, block, seq, buf, sum) == 0)
             {
-                case YAFFS_OBJECT_TYPE_DIRECTORY:
-                    st.st_mode |= S_IFDIR;
-                    break;
-                case YAFFS_OBJECT_TYPE_FILE:
-                default:
-                    st.st_mode |= S_IFREG;
-                    break;
+                summaries[block] = sum;
+                state[block] = SCAN_BLOCK_SUMMARY;
+                nsummaries++;
+
+                for (i=0; i < info->chunks_per_summary; i++)
+                    if (summary_tag_is_header(&sum[i]))
+                        plan_add(plan, nextents, chunk + i, 1);
+                continue;
             }
+            talloc_free(sum);
 
-            ret = fuse_add_direntry(req, buf + bufsize, size - bufsize,
-                                    inode->header.name, &st, i+1);
-            if (ret >= size - bufsize)
-                goto done;
-
-            bufsize += ret;
+            if (!nsummaries && ++nfull >= SCAN_SUMMARY_PROBE_LIMIT)
+                probe_summaries = 0;
         }
+
+        state[block] = SCAN_BLOCK_FULL;
+        plan_add(plan, nextents, chunk, info->chunks_per_block);
     }
 
-done:
-    fuse_reply_buf(req, buf, bufsize);
-    talloc_free(buf);
-    return;
+    trace(yaffs2_probe, info->nblocks, *nextents, nsummaries);
 
-err:
-    fuse_reply_err(req, EIO);
+    talloc_free(buf);
+    return 0;
 }
 
-static void yaffs2_releasedir(fuse_req_t req, fuse_ino_t ino,
-                     struct fuse_file_info *fi)
+/*
+ * Checkpoint restore.  The checkpoint blocks are found by walking forward
+ * from block 0 to the first one, then from where each says, as yaffs
+ * does; the object records and tnodes give every object's parent, size
+ * and chunk map, so only the object header chunks are read, in device
+ * order, for names and attributes.  It is all built into a scratch copy
+ * of the mount, kept if everything checks out: the checksum, the page
+ * sequence, the record sizes, chunk numbers in range, and each header's
+ * tags agreeing with its object and its block's sequence number.
+ * Otherwise the copy is thrown away and the mount scans as usual.
+ */
+/* header reads are merged across gaps of up to this many bytes */
+#define CHECKPT_GAP_SIZE    (128 << 10)
+
+struct checkpt_reader
 {
-    fuse_reply_err(req, 0);
-}
+    struct yaffs2_info *info;
+    u32 *seqs;
+    u8 *buf;                /* the current checkpoint block */
+    int next;               /* block to look for the next one from */
+    int chunk;
+    int pos;                /* offset in the chunk's data */
+    u32 page_seq;
+    u32 sum;
+    u32 xor;
+    int nblocks;
+};
 
-static void yaffs2_statfs(fuse_req_t req, fuse_ino_t ino)
+struct checkpt_header
 {
-    struct yaffs2_info *fsi = fuse_req_userdata(req);
+    u32 chunk;
+    u32 size;
+    u32 parent_id;
+    struct yaffs2_inode *inode;
+};
 
-    struct statvfs stbuf = {
-        .f_bsize = fsi->mtd_page,
-        .f_frsize = fsi->mtd_page,
-        .f_blocks = fsi->nblocks,
-        .f_bfree = fsi->nblocks,
-        .f_bavail = fsi->nblocks,
-        .f_files = g_hash_table_size(fsi->object_map),
-        .f_ffree = ~0,
-        .f_favail = ~0,
-        .f_fsid = YAFFS_MAGIC,
-        .f_flag = 0,
-        .f_namemax = YAFFS_MAX_NAME_LENGTH,
-    };
+static int checkpt_header_cmp(const void *a, const void *b)
+{
+    const struct checkpt_header *h1 = a, *h2 = b;
 
-    fuse_reply_statfs(req, &stbuf);
+    return h1->chunk < h2->chunk ? -1 : h1->chunk > h2->chunk;
 }
 
-#if 0
-static void yaffs2_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
-                   size_t size)
+static int checkpt_next_block(struct checkpt_reader *r)
 {
-}
+    struct yaffs2_info *info = r->info;
+    size_t len = (size_t) info->chunks_per_block * info->block_size;
+    ssize_t ret;
+    u32 seq;
+    int block;
+    int err;
 
-static void yaffs2_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
-{
+    for (block = max(r->next, 0); block < info->nblocks; block++)
+    {
+        err = yaffs2_block_seq(info, r->seqs, block, &seq);
+        if (err)
+            return err;
+        if (seq != YAFFS_SEQUENCE_CHECKPOINT_DATA)
+            continue;
+
+        ret = bdev_pread(info->dev, r->buf, len, (u64) block * len);
+        if (ret != len)
+            return ret < 0 ? ret : -EINVAL;
+
+        r->nblocks++;
+        r->chunk = 0;
+        return 0;
+    }
+    return -EINVAL;
 }
 
-static void yaffs2_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
-               uint64_t idx)
+/* the next len bytes of the checkpoint stream, summed as they go */
+static int checkpt_read(struct checkpt_reader *r, void *dst, size_t len)
 {
-    /* fuse_reply_bmap(req, idx) */
-}
-#endif
+    struct yaffs2_info *info = r->info;
+    struct yaffs2_ext_tags tags;
+    u8 *p = dst, *chunk;
+    size_t i, n;
+    int err;
 
-static struct fuse_lowlevel_ops yaffs2_ops = {
-    .lookup = yaffs2_lookup,
-    .opendir = yaffs2_opendir,
-    .readdir = yaffs2_readdir,
-    .releasedir = yaffs2_releasedir,
-    .statfs = yaffs2_statfs,
-    .getattr = yaffs2_getattr,
-    .open = yaffs2_open,
-    .read = yaffs2_read,
-    .release = yaffs2_release,
-#if 0
-    .readlink = yaffs2_readlink,
-    .getxattr = yaffs2_getxattr,
-    .listxattr = yaffs2_listxattr,
-    .bmap = yaffs2_bmap
-#endif
-};
+    while (len)
+    {
+        if (r->pos == info->data_bytes)
+        {
+            if (++r->chunk == info->chunks_per_block &&
+                (err = checkpt_next_block(r)))
+                return err;
+
+            chunk = r->buf + (size_t) r->chunk * info->block_size;
+            yaffs2_unpack_tags(&tags, chunk + info->tags_offset);
+            if (tags.sequence_number != YAFFS_SEQUENCE_CHECKPOINT_DATA ||
+                tags.chunk_id != ++r->page_seq)
+                return -EINVAL;
+            if (info->ecc &&
+                ecc_correct_page(info->ecc, chunk, chunk + info->mtd_page) < 0)
+                return -EBADMSG;
+
+            r->next = tags.object_id - 1;
+            r->pos = 0;
+        }
+
+        chunk = r->buf + (size_t) r->chunk * info->block_size;
+        n = min(len, info->data_bytes - r->pos);
+        for (i=0; i < n; i++)
+        {
+            r->sum += chunk[r->pos + i];
+            r->xor ^= chunk[r->pos + i];
+        }
+        memcpy(p, chunk + r->pos, n);
+        r->pos += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
 
-int main(int argc, char *argv[])
+static int checkpt_validity(struct checkpt_reader *r, int head)
 {
-    struct yaffs2_info *ctx;
-    int i, fuse_argc=0;
-    char *device;
-    struct fuse_session *sess;
-    struct fuse_chan *chan;
-    struct fuse_args args;
-    char *mountpoint;
-    int multithreaded;
-    int foreground;
-    int res;
+    struct yaffs2_checkpt_validity v;
+    int err = checkpt_read(r, &v, sizeof(v));
 
-    ctx = talloc(NULL, struct yaffs2_info);
+    if (err)
+        return err;
+    if (le32_to_cpu(v.struct_type) != sizeof(v) ||
+        le32_to_cpu(v.magic) != YAFFS_MAGIC ||
+        le32_to_cpu(v.version) != YAFFS_CHECKPOINT_VERSION ||
+        le32_to_cpu(v.head) != head)
+        return -EINVAL;
+    return 0;
+}
 
-    /* FIXME replace this with fuse_getopt */
-    char **fuse_argv = malloc((argc + 1) * sizeof(char *));
+/* a file's level 0 tnodes, into its chunk map */
+static int checkpt_tnodes(struct checkpt_reader *r, struct yaffs2_inode *inode,
+                          int width)
+{
+    struct yaffs2_info *info = r->info;
+    u32 map[YAFFS_NTNODES_LEVEL0];
+    u32 base, val, bit;
+    int i, err;
 
-    for (i=0; i < argc; i++)
+    for (;;)
     {
-        if ((strcmp(argv[i], "-a") == 0) && i + 1 < argc)
+        if ((err = checkpt_read(r, &base, sizeof(base))))
+            return err;
+        base = le32_to_cpu(base);
+        if (base == ~0U)
+            return 0;
+
+        /* entries of width bits, packed into little endian words */
+        if ((err = checkpt_read(r, map, width * YAFFS_NTNODES_LEVEL0 / 8)))
+            return err;
+        if (base >= (~0U >> 4))
+            return -EINVAL;
+
+        for (i=0; i < YAFFS_NTNODES_LEVEL0; i++)
         {
-            i++;
-            device = argv[i];
+            bit = i * width;
+            val = le32_to_cpu(map[bit / 32]) >> (bit % 32);
+            if (bit % 32 + width > 32)
+                val |= le32_to_cpu(map[bit / 32 + 1]) << (32 - bit % 32);
+            val &= width < 32 ? (1U << width) - 1 : ~0U;
+            if (!val)
+                continue;
+
+            /* chunk ids count file chunks from 1 */
+            val -= info->chunks_per_block;
+            if (val >= info->nchunks || base + i == 0)
+                return -EINVAL;
+            add_data_block(info, inode, base * YAFFS_NTNODES_LEVEL0 + i - 1,
+                           val);
         }
-        else
-            fuse_argv[fuse_argc++] = argv[i];
     }
+}
+
+static int checkpt_objects(struct checkpt_reader *r,
+                           struct checkpt_header **headers, u32 *nheaders)
+{
+    struct yaffs2_info *info = r->info;
+    struct yaffs2_checkpt_obj obj;
+    struct yaffs2_inode *inode;
+    struct checkpt_header *h;
+    u32 size = 0, x, n = 0;
+    int width, hdr_chunk;
+    int err;
 
-    fuse_argv[fuse_argc] = NULL;
+    /* tnode entries are as wide as a device chunk number, rounded to even */
+    x = info->chunks_per_block * (info->nblocks + 1);
+    for (width = 0; width < 32 && (1ULL << width) < x; width++)
+        ;
+    width = max(16, (width + 1) & ~1);
 
-    if (!device)
+    for (;;)
     {
-        fprintf(stderr, "Usage: %s -a <device_file> <mount_point>\n", argv[0]);
-        return 1;
-    }
+        if ((err = checkpt_read(r, &obj, sizeof(obj.struct_type))))
+            return err;
+        x = le32_to_cpu(obj.struct_type);
+        if ((x != sizeof(obj) && x != sizeof(obj) - sizeof(obj.size_high)) ||
+            (size && x != size))
+            return -EINVAL;
+        size = x;
+        err = checkpt_read(r, &obj.obj_id, size - sizeof(obj.struct_type));
+        if (err)
+            return err;
+
+        if (le32_to_cpu(obj.obj_id) == ~0U)
+            break;
+
+        /* fake directories have no header; only the root is kept */
+        hdr_chunk = le32_to_cpu(obj.hdr_chunk);
+        inode = NULL;
+        if (hdr_chunk > 0 || le32_to_cpu(obj.obj_id) == YAFFS_OBJECTID_ROOT)
+            inode = find_or_create_inode(info, le32_to_cpu(obj.obj_id));
+
+        if (hdr_chunk > 0)
+        {
+            hdr_chunk -= info->chunks_per_block;
+            if (hdr_chunk < 0 || hdr_chunk >= info->nchunks)
+                return -EINVAL;
+
+            if (!(n & (n - 1)) && n >= 16)
+                *headers = talloc_realloc(NULL, *headers,
+                                          struct checkpt_header, n * 2);
+            h = &(*headers)[n++];
+            h->chunk = hdr_chunk;
+            h->size = le32_to_cpu(obj.size_or_equiv_obj);
+            h->parent_id = le32_to_cpu(obj.parent_id);
+            h->inode = inode;
+        }
 
-    FILE *fp = fopen(device, "r");
-    if (!fp)
-    {
-        perror("yaffs2_fuse");
-        return 2;
+        if ((le32_to_cpu(obj.flags) & 7) == YAFFS_OBJECT_TYPE_FILE)
+        {
+            if (!inode)
+                return -EINVAL;
+            if ((err = checkpt_tnodes(r, inode, width)))
+                return err;
+        }
     }
 
-    ctx->dev = fp;
+    *nheaders = n;
+    return 0;
+}
 
-    if (yaffs2_read_super(ctx))
+/* each object's header, checked against the checkpoint */
+static int checkpt_load_headers(struct yaffs2_info *info,
+                                struct yaffs2_block_info *blocks,
+                                struct checkpt_header *headers, u32 n)
+{
+    struct yaffs2_inode *inode;
+    struct yaffs2_ext_tags tags;
+    struct scan_reader reader;
+    struct scan_extent *plan;
+    int nextents = 0, e = -1, ofs = 0;
+    u32 i, gap;
+    u8 *buf;
+    int err = 0, ret;
+
+    qsort(headers, n, sizeof(*headers), checkpt_header_cmp);
+
+    /* short gaps between headers are read through rather than skipped */
+    gap = CHECKPT_GAP_SIZE / info->block_size;
+    plan = talloc_array(NULL, struct scan_extent, 16);
+    for (i=0; i < n; i++)
     {
-        printf ("Could not read super block\n");
-        return 3;
+        if (i && headers[i].chunk == headers[i - 1].chunk)
+        {
+            talloc_free(plan);
+            return -EINVAL;
+        }
+        if (i && headers[i].chunk - headers[i - 1].chunk <= gap)
+            plan_add(&plan, &nextents, headers[i - 1].chunk + 1,
+                     headers[i].chunk - headers[i - 1].chunk);
+        else
+            plan_add(&plan, &nextents, headers[i].chunk, 1);
     }
 
-    args.argc = fuse_argc;
-    args.argv = fuse_argv;
-    args.allocated = 0;
-
-    res = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
-    if (res == -1)
-        goto out_err;
-
-    printf ("mount %s\n", mountpoint);
-
-    chan = fuse_mount(mountpoint, &args);
-    if (!chan)
-        goto out_err;
+    err = scan_reader_start(&reader, info, plan, nextents);
+    if (err)
+    {
+        talloc_free(plan);
+        return err;
+    }
 
-    sess = fuse_lowlevel_new(&args, &yaffs2_ops, sizeof(yaffs2_ops), ctx);
-    fuse_session_add_chan(sess, chan);
+    for (i=0; i < n; i++)
+    {
+        /* pass over the gap chunks read along the way */
+        do
+        {
+            if (e < 0 || ++ofs == plan[e].nchunks)
+            {
+                e++;
+                ofs = 0;
+            }
+            buf = scan_reader_chunk(&reader);
+        } while (buf && plan[e].first_chunk + ofs < headers[i].chunk);
+        if (!buf)
+        {
+            err = -EIO;
+            break;
+        }
+
+        inode = headers[i].inode;
+        yaffs2_unpack_tags(&tags, buf + info->tags_offset);
+        if (tags.object_id != inode->object_id || tags.chunk_id != 0 ||
+            tags.sequence_number != le32_to_cpu(
+                blocks[headers[i].chunk / info->chunks_per_block].seq_number) ||
+            (info->ecc &&
+             ecc_correct_page(info->ecc, buf, buf + info->mtd_page) < 0))
+        {
+            err = -EINVAL;
+            break;
+        }
+
+        load_header(info, inode, (struct yaffs2_object_header *) buf);
+        inode->sequence_number = tags.sequence_number;
+
+        /* the checkpoint is newer than the header */
+        inode->parent_id = headers[i].parent_id;
+        if (inode->type == YAFFS_OBJECT_TYPE_FILE)
+            inode->size = headers[i].size;
+    }
+
+    /* a read error is the better answer */
+    ret = scan_reader_stop(&reader);
+    talloc_free(plan);
+    return ret ? ret : err;
+}
+
+static int yaffs2_read_checkpoint(struct yaffs2_info *info, u32 *seqs)
+{
+    struct checkpt_reader r = { 0 };
+    struct yaffs2_checkpt_dev dev;
+    struct yaffs2_block_info *blocks = NULL;
+    struct checkpt_header *headers;
+    struct yaffs2_info *fs;
+    size_t bitmap = (info->chunks_per_block + 7) / 8;
+    u32 nheaders = 0, sum;
+    u8 *bits = NULL;
+    int i;
+    int err;
+
+    /* restore into a copy, so a bad checkpoint leaves nothing behind */
+    fs = talloc(info, struct yaffs2_info);
+    *fs = *info;
+    intern_name(fs, "", 0);
+    add_root(fs);
+
+    r.info = fs;
+    r.seqs = seqs;
+    r.buf = talloc_size(fs, (size_t) info->chunks_per_block *
+                            info->block_size);
+    r.chunk = info->chunks_per_block - 1;
+    r.pos = info->data_bytes;
+    headers = talloc_array(NULL, struct checkpt_header, 16);
+
+    if ((err = checkpt_validity(&r, 1)) ||
+        (err = checkpt_read(&r, &dev, sizeof(dev))))
+        goto out;
+    if (le32_to_cpu(dev.struct_type) != sizeof(dev))
+    {
+        err = -EINVAL;
+        goto out;
+    }
+
+    blocks = talloc_array(NULL, struct yaffs2_block_info, info->nblocks);
+    bits = talloc_size(NULL, bitmap * info->nblocks);
+    if ((err = checkpt_read(&r, blocks, sizeof(*blocks) * info->nblocks)) ||
+        (err = checkpt_read(&r, bits, bitmap * info->nblocks)))
+        goto out;
+
+    /* nothing can have been written after the checkpoint */
+    for (i=0; i < info->nblocks; i++)
+        if (le32_to_cpu(blocks[i].seq_number) > le32_to_cpu(dev.seq_number))
+        {
+            err = -EINVAL;
+            goto out;
+        }
+
+    if ((err = checkpt_objects(&r, &headers, &nheaders)) ||
+        (err = checkpt_validity(&r, 0)))
+        goto out;
+
+    sum = (r.sum << 8) | (r.xor & 0xff);
+    if ((err = checkpt_read(&r, &dev.seq_number, sizeof(u32))))
+        goto out;
+    if (le32_to_cpu(dev.seq_number) != sum)
+    {
+        err = -EINVAL;
+        goto out;
+    }
+
+    err = checkpt_load_headers(fs, blocks, headers, nheaders);
+
+out:
+    trace(yaffs2_checkpoint, r.nblocks, fs->nobjects, -err);
+
+    talloc_free(r.buf);
+    talloc_free(bits);
+    talloc_free(blocks);
+    talloc_free(headers);
+
+    /* keep what was restored, which hangs off the copy */
+    if (!err)
+        *info = *fs;
+    else
+        talloc_free(fs);
+    return err;
+}
+
+/*
+ * Directories are built once the scan has settled every object's latest
+ * header: each directory gets an array of its children and a hash index
+ * over their names.
+ */
+static u32 name_hash(const char *name)
+{
+    u32 h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (u8) *name++) * 16777619u;
+    return h;
+}
+
+static struct yaffs2_inode *dir_parent(struct yaffs2_info *info,
+                                       struct yaffs2_inode *inode)
+{
+    struct yaffs2_inode *parent;
+
+    /* objects we only saw data chunks for, and the root itself */
+    if (!inode->sequence_number || inode->object_id == YAFFS_OBJECTID_ROOT)
+        return NULL;
+
+    if (yaffs2_read_inode(info, inode->parent_id, &parent))
+        return NULL;
+    return parent;
+}
+
+static void count_child(struct yaffs2_info *info, struct yaffs2_inode *inode)
+{
+    struct yaffs2_inode *parent = dir_parent(info, inode);
+
+    if (parent)
+        parent->nchildren++;
+}
+
+static void alloc_children(struct yaffs2_info *info, struct yaffs2_inode *dir)
+{
+    if (!dir->nchildren)
+        return;
+
+    dir->children = talloc_array(info, struct yaffs2_inode *, dir->nchildren);
+    dir->nchildren = 0;
+}
+
+static void add_child(struct yaffs2_info *info, struct yaffs2_inode *inode)
+{
+    struct yaffs2_inode *parent = dir_parent(info, inode);
+
+    if (parent)
+        parent->children[parent->nchildren++] = inode;
+}
+
+static void index_children(struct yaffs2_info *info, struct yaffs2_inode *dir)
+{
+    u32 size = 4;
+    u32 i, h;
+
+    if (!dir->nchildren)
+        return;
+
+    /* keep the table at most half full */
+    while (size < dir->nchildren * 2)
+        size <<= 1;
+
+    dir->child_hash = talloc_zero_array(info, u32, size);
+    dir->child_hash_mask = size - 1;
+
+    for (i=0; i < dir->nchildren; i++)
+    {
+        h = name_hash(yaffs2_inode_name(info, dir->children[i])) &
+            dir->child_hash_mask;
+        while (dir->child_hash[h])
+            h = (h + 1) & dir->child_hash_mask;
+        dir->child_hash[h] = i + 1;
+    }
+}
+
+void yaffs2_build_dirs(struct yaffs2_info *info)
+{
+    for_each_inode(info, count_child);
+    for_each_inode(info, alloc_children);
+    for_each_inode(info, add_child);
+    for_each_inode(info, index_children);
+}
+
+struct yaffs2_inode *yaffs2_find_child(struct yaffs2_info *info,
+                                       struct yaffs2_inode *dir,
+                                       const char *name)
+{
+    struct yaffs2_inode *child;
+    u32 h;
+
+    if (!dir->child_hash)
+        return NULL;
+
+    h = name_hash(name) & dir->child_hash_mask;
+    while (dir->child_hash[h])
+    {
+        child = dir->children[dir->child_hash[h] - 1];
+        if (strcmp(yaffs2_inode_name(info, child), name) == 0)
+            return child;
+        h = (h + 1) & dir->child_hash_mask;
+    }
+    return NULL;
+}
+
+/*
+ * NAND geometry probe.  Each candidate layout is scored by reading the
+ * tags of a few chunks in a handful of sample blocks, and checking that
+ * they look like yaffs2 tags and that chunks agree on their block's
+ * sequence number exactly when they share an erase block.  Only a few
+ * tag-sized reads are done per candidate.
+ */
+struct yaffs2_geometry
+{
+    int page;
+    int oob;
+    int oob_offset;         /* where the tags start in the OOB */
+    int inband;             /* tags at the end of the page, no OOB */
+    int chunks_per_block;
+};
+
+static const struct { int page, oob; } probe_layouts[] = {
+    { 2048, 64 }, { 2048, 128 },
+    { 4096, 128 }, { 4096, 218 }, { 4096, 224 }, { 4096, 256 },
+    { 8192, 256 }, { 8192, 376 }, { 8192, 436 }, { 8192, 448 },
+    { 512, 16 },
+};
+static const int probe_pages[] = { 2048, 4096, 8192, 512 };
+static const int probe_chunks_per_block[] = { 64, 128, 256, 32 };
+static const int probe_oob_offsets[] = { 0, 2 };
+
+/* blocks sampled at the start of the device, and spread across it */
+#define PROBE_HEAD_BLOCKS   4
+#define PROBE_SPREAD_BLOCKS 8
+
+static void yaffs2_set_geometry(struct yaffs2_info *info,
+                                struct yaffs2_geometry *g)
+{
+    info->mtd_page = g->page;
+    info->mtd_extra = g->inband ? 0 : g->oob;
+    info->inband = g->inband;
+    info->block_size = info->mtd_page + info->mtd_extra;
+    info->chunks_per_block = g->chunks_per_block;
+    info->mtd_erase = info->mtd_page * info->chunks_per_block;
+
+    if (g->inband)
+    {
+        info->data_bytes = g->page - YAFFS_PACKED_TAGS_SIZE;
+        info->tags_offset = info->data_bytes;
+    }
+    else
+    {
+        info->data_bytes = g->page;
+        info->tags_offset = g->page + g->oob_offset;
+    }
+}
+
+/* does candidate g agree with what was asked for on the command line? */
+static int geometry_allowed(struct yaffs2_info *info,
+                            struct yaffs2_geometry *g)
+{
+    return (!info->mtd_page || info->mtd_page == g->page) &&
+           (!info->mtd_extra || (!g->inband && info->mtd_extra == g->oob)) &&
+           (!info->mtd_erase ||
+            info->mtd_erase == g->page * g->chunks_per_block) &&
+           (!info->inband || g->inband);
+}
 
-    res = fuse_daemonize(foreground);
-    if (res == -1)
-        goto err_unmount;
+static int probe_read_tags(struct bdev *dev, struct yaffs2_geometry *g,
+                           off_t devsize, u64 chunk, struct yaffs2_ext_tags *t)
+{
+    u8 raw[YAFFS_PACKED_TAGS_SIZE];
+    off_t rec = g->inband ? g->page : g->page + g->oob;
+    off_t off;
 
-    res = fuse_set_signal_handlers(sess);
-    if (res == -1)
-        goto err_unmount;
+    off = chunk * rec + (g->inband ? g->page - YAFFS_PACKED_TAGS_SIZE :
+                                     g->page + g->oob_offset);
+    if (off + sizeof(raw) > devsize ||
+        bdev_pread(dev, raw, sizeof(raw), off) != sizeof(raw))
+        return -1;
 
-    fuse_session_loop_mt(sess);
-    talloc_free(ctx);
+    yaffs2_unpack_tags(t, raw);
     return 0;
+}
+
+static int tags_plausible(struct yaffs2_ext_tags *t,
+                          struct yaffs2_geometry *g, u64 nchunks)
+{
+    int data_bytes = g->inband ? g->page - YAFFS_PACKED_TAGS_SIZE : g->page;
+
+    if (t->sequence_number == YAFFS_SEQUENCE_CHECKPOINT_DATA)
+        return 1;
+
+    return t->sequence_number >= YAFFS_LOWEST_SEQUENCE_NUMBER &&
+           t->sequence_number <= YAFFS_HIGHEST_SEQUENCE_NUMBER &&
+           t->object_id && t->object_id <= YAFFS_OBJECTID_MAX &&
+           t->chunk_id <= nchunks &&
+           t->byte_count <= data_bytes;
+}
+
+static int score_block(struct bdev *dev, struct yaffs2_geometry *g,
+                       off_t devsize, u64 nchunks, int block)
+{
+    struct yaffs2_ext_tags first, t;
+    u64 base = (u64) block * g->chunks_per_block;
+    int probe[2] = { 1, g->chunks_per_block - 1 };
+    int score = 0;
+    int i;
+
+    if (probe_read_tags(dev, g, devsize, base, &first))
+        return 0;
+
+    if (first.sequence_number == YAFFS_SEQUENCE_ERASED)
+    {
+        /* an erased block must not have anything written after chunk 0 */
+        if (probe_read_tags(dev, g, devsize, base + 1, &t) == 0 &&
+            t.sequence_number != YAFFS_SEQUENCE_ERASED)
+            return -2;
+        return 0;
+    }
+
+    if (!tags_plausible(&first, g, nchunks))
+        return -4;
+    score += 2;
+
+    /* later chunks of the block are either unwritten or from the block */
+    for (i=0; i < 2; i++)
+    {
+        if (probe_read_tags(dev, g, devsize, base + probe[i], &t))
+            continue;
+
+        if (t.sequence_number == YAFFS_SEQUENCE_ERASED)
+            score += 1;
+        else if (tags_plausible(&t, g, nchunks) &&
+                 t.sequence_number == first.sequence_number)
+            score += 2;
+        else
+            score -= 3;
+    }
+
+    /*
+     * and the next block is not: sequence numbers are unique per block,
+     * so this is a sure sign that the erase size is too small
+     */
+    if (probe_read_tags(dev, g, devsize, base + g->chunks_per_block, &t) == 0 &&
+        t.sequence_number == first.sequence_number)
+        score -= 8;
+
+    return score;
+}
+
+static int score_geometry(struct bdev *dev, struct yaffs2_geometry *g,
+                          off_t devsize)
+{
+    off_t rec = g->inband ? g->page : g->page + g->oob;
+    int nblocks;
+    int score = 0;
+    int i;
+
+    /* images are dumped in whole pages */
+    if (devsize % rec)
+        return INT_MIN;
 
-err_unmount:
-    fuse_unmount(mountpoint, chan);
+    nblocks = devsize / (rec * g->chunks_per_block);
+    if (!nblocks)
+        return INT_MIN;
 
-out_err:
-    free(mountpoint);
+    for (i=0; i < min(PROBE_HEAD_BLOCKS, nblocks); i++)
+        score += score_block(dev, g, devsize,
+                             (u64) nblocks * g->chunks_per_block, i);
+
+    for (i=0; i < PROBE_SPREAD_BLOCKS; i++)
+    {
+        int block = (u64) nblocks * i / PROBE_SPREAD_BLOCKS;
+
+        if (block >= PROBE_HEAD_BLOCKS)
+            score += score_block(dev, g, devsize,
+                                 (u64) nblocks * g->chunks_per_block, block);
+    }
+    return score;
+}
+
+static void probe_candidate(struct yaffs2_info *info, struct bdev *dev,
+                            off_t devsize, struct yaffs2_geometry *g,
+                            struct yaffs2_geometry *best, int *best_score)
+{
+    int score;
+
+    if (!geometry_allowed(info, g))
+        return;
+
+    score = score_geometry(dev, g, devsize);
+    if (score > *best_score)
+    {
+        *best = *g;
+        *best_score = score;
+    }
+}
+
+void yaffs2_probe_geometry(struct yaffs2_info *info, off_t devsize)
+{
+    struct yaffs2_geometry g, best = {
+        .page = info->mtd_page ? info->mtd_page : 2048,
+        .oob = info->mtd_extra ? info->mtd_extra : 64,
+        .inband = info->inband,
+        .chunks_per_block = 64,
+    };
+    int best_score = 0;
+    struct bdev *dev = info->dev;
+    int i, j, k;
+
+    if (info->mtd_erase)
+        best.chunks_per_block = info->mtd_erase / best.page;
+
+    for (i=0; i < sizeof(probe_chunks_per_block) / sizeof(int); i++)
+    {
+        memset(&g, 0, sizeof(g));
+        g.chunks_per_block = probe_chunks_per_block[i];
+
+        for (j=0; j < sizeof(probe_layouts) / sizeof(probe_layouts[0]); j++)
+        {
+            g.page = probe_layouts[j].page;
+            g.oob = probe_layouts[j].oob;
+
+            for (k=0; k < sizeof(probe_oob_offsets) / sizeof(int); k++)
+            {
+                g.oob_offset = probe_oob_offsets[k];
+                probe_candidate(info, dev, devsize, &g, &best, &best_score);
+            }
+        }
+
+        g.oob = g.oob_offset = 0;
+        g.inband = 1;
+        for (j=0; j < sizeof(probe_pages) / sizeof(int); j++)
+        {
+            g.page = probe_pages[j];
+            probe_candidate(info, dev, devsize, &g, &best, &best_score);
+        }
+    }
+
+    if (best_score <= 0)
+        fprintf(stderr, "yaffs2: could not detect the NAND geometry, "
+                "assuming the defaults\n");
+
+    yaffs2_set_geometry(info, &best);
+
+    fprintf(stderr, "yaffs2: %d byte pages, %d byte OOB, %d chunks per "
+            "block, %s tags\n", info->mtd_page, info->mtd_extra,
+            info->chunks_per_block, info->inband ? "inband" : "OOB");
+}
+
+int yaffs2_read_super(struct yaffs2_info *info)
+{
+    struct yaffs2_summary_tags **summaries = NULL, *tag;
+    struct scan_reader reader;
+    struct scan_extent *plan = NULL;
+    int nextents;
+    off_t devsize;
+    u8 *state = NULL;
+    u32 *seqs;
+    u8 *buf;
+    u32 addr;
+    int block, chunk;
+    int err;
+
+    devsize = bdev_size(info->dev);
+
+    /*
+     * A 'chunk' in yaffs terminology is the MTD page size, stored in the
+     * image followed by its OOB bytes.  A block is the MTD erase block.
+     */
+    yaffs2_probe_geometry(info, devsize);
+
+    if (info->ecc_spec)
+    {
+        info->ecc = ecc_new(info, info->ecc_spec, info->mtd_page,
+                            info->mtd_extra);
+        if (!info->ecc)
+            return -EINVAL;
+    }
+
+    /* the summary takes however many chunks it needs at the block's end */
+    info->chunks_per_summary = info->chunks_per_block -
+        div_round(info->chunks_per_block * sizeof(struct yaffs2_summary_tags),
+                  info->data_bytes - sizeof(struct yaffs2_summary_header));
+
+    info->nblocks = devsize / ((off_t) info->chunks_per_block *
+                               info->block_size);
+    info->nchunks = info->nblocks * info->chunks_per_block;
+
+    /* first chunk sequence numbers, shared by the checkpoint and probe */
+    seqs = talloc_zero_array(NULL, u32, info->nblocks);
+
+    /* a clean unmount leaves a checkpoint that saves scanning */
+    if (!info->no_checkpoint && yaffs2_read_checkpoint(info, seqs) == 0)
+    {
+        err = 0;
+        goto done;
+    }
+
+    intern_name(info, "", 0);
+    add_root(info);
+
+    state = talloc_array(NULL, u8, info->nblocks);
+    summaries = talloc_zero_array(NULL, struct yaffs2_summary_tags *,
+                                  info->nblocks);
+
+    err = yaffs2_probe_blocks(info, seqs, state, summaries, &plan,
+                              &nextents);
+    if (err)
+        goto out;
+
+    /* scan the disk in device order, adding inodes into memory */
+    err = scan_reader_start(&reader, info, plan, nextents);
+    if (err)
+        goto out;
+
+    for (block = 0; block < info->nblocks; block++)
+    {
+        addr = block * info->chunks_per_block;
+
+        switch (state[block])
+        {
+            case SCAN_BLOCK_ERASED:
+                break;
+
+            case SCAN_BLOCK_FULL:
+                for (chunk = 0; chunk < info->chunks_per_block; chunk++)
+                {
+                    if (!(buf = scan_reader_chunk(&reader)))
+                        goto out_stop;
+                    yaffs2_scan_chunk(info, buf, addr + chunk);
+                }
+                break;
+
+            case SCAN_BLOCK_SUMMARY:
+                for (chunk = 0; chunk < info->chunks_per_summary; chunk++)
+                {
+                    tag = &summaries[block][chunk];
+
+                    if (summary_tag_is_header(tag))
+                    {
+                        if (!(buf = scan_reader_chunk(&reader)))
+                            goto out_stop;
+                        yaffs2_scan_chunk(info, buf, addr + chunk);
+                    }
+                    else if (le32_to_cpu(tag->object_id) != 0xffffffff)
+                    {
+                        yaffs2_add_data_chunk(info,
+                            le32_to_cpu(tag->object_id),
+                            le32_to_cpu(tag->chunk_id), addr + chunk);
+                    }
+                }
+                break;
+        }
+    }
+
+out_stop:
+    err = scan_reader_stop(&reader);
+done:
+    for_each_inode(info, finish_chunk_map);
+    yaffs2_build_dirs(info);
+
+    info->names = talloc_realloc(info, info->names, char, info->names_len);
+    info->names_size = info->names_len;
+
+    trace(yaffs2_scan_done, info->nobjects, info->nblocks, -err);
+    if (info->ecc)
+        ecc_report(info->ecc, "yaffs2");
+out:
+    talloc_free(seqs);
+    talloc_free(summaries);
+    talloc_free(state);
+    talloc_free(plan);
+    return err;
+}
+
+/*
+ * Vectored file reads.  A request is mapped to device chunks up front;
+ * runs of physically consecutive chunks are read with a single preadv()
+ * whose iovecs put the page data straight into the caller's buffer and
+ * drop the OOB (or inband tag) bytes between pages into a scratch sink.
+ */
+struct read_run
+{
+    struct iovec iov[IOV_MAX];
+    int iovcnt;
+    off_t start;            /* device offset of the run */
+    size_t len;
+    u32 next_phys;          /* chunk that would extend the run */
+};
+
+static int flush_run(struct yaffs2_info *info, struct read_run *run)
+{
+    ssize_t ret;
+
+    if (!run->iovcnt)
+        return 0;
+
+    trace(yaffs2_preadv, run->start, run->len, run->iovcnt);
+
+    ret = bdev_readv(info->dev, run->iov, run->iovcnt, run->start);
+    run->iovcnt = 0;
+
+    if (ret < 0)
+        return ret;
+    if (info->warm)
+        warm_touch(info->warm, run->start, ret);
+    return ret == run->len ? 0 : -EIO;
+}
+
+/*
+ * Checking ECC needs every chunk whole, OOB and all, so with it on runs
+ * of physically consecutive chunks are read into a bounce buffer,
+ * corrected there and copied out.
+ */
+static ssize_t yaffs2_read_data_ecc(struct yaffs2_info *info,
+                                    struct yaffs2_inode *inode,
+                                    void *buf, size_t size, off_t off)
+{
+    u8 *bounce, *cbuf;
+    u32 chunk, phys;
+    size_t pos = 0;
+    size_t skip, want;
+    ssize_t ret;
+    int err = 0;
+    int i, n;
+
+    bounce = talloc_size(NULL, (size_t) ECC_READ_CHUNKS * info->block_size);
+
+    chunk = off / info->data_bytes;
+    skip = off % info->data_bytes;
+
+    while (pos < size)
+    {
+        phys = yaffs2_map_chunk(inode, chunk);
+
+        /* chunks that were never written read as zeros */
+        if (phys == ~0)
+        {
+            want = min(info->data_bytes - skip, size - pos);
+            memset((u8 *) buf + pos, 0, want);
+            pos += want;
+            chunk++;
+            skip = 0;
+            continue;
+        }
+
+        for (n = 1; n < ECC_READ_CHUNKS &&
+                    pos + (size_t) n * info->data_bytes - skip < size &&
+                    yaffs2_map_chunk(inode, chunk + n) == phys + n; n++)
+            ;
+
+        trace(yaffs2_preadv, (off_t) phys * info->block_size,
+              (size_t) n * info->block_size, 1);
+
+        ret = bdev_pread(info->dev, bounce, (size_t) n * info->block_size,
+                         (u64) phys * info->block_size);
+        if (ret != (ssize_t) n * info->block_size)
+        {
+            err = ret < 0 ? ret : -EIO;
+            break;
+        }
+        if (info->warm)
+            warm_touch(info->warm, (u64) phys * info->block_size, ret);
+
+        for (i=0; i < n; i++, chunk++, skip = 0)
+        {
+            cbuf = bounce + (size_t) i * info->block_size;
+            if (ecc_correct_page(info->ecc, cbuf, cbuf + info->mtd_page) < 0)
+            {
+                err = -EIO;
+                goto out;
+            }
+
+            want = min(info->data_bytes - skip, size - pos);
+            memcpy((u8 *) buf + pos, cbuf + skip, want);
+            pos += want;
+        }
+    }
+
+out:
+    talloc_free(bounce);
+    return err ? err : pos;
+}
+
+ssize_t yaffs2_read_data(struct yaffs2_info *info, struct yaffs2_inode *inode,
+                         void *buf, size_t size, off_t off)
+{
+    struct read_run *run;
+    u8 *sink;
+    u32 chunk, phys;
+    size_t pos = 0;
+    size_t skip, want;
+    int gap = info->block_size - info->data_bytes;
+    int err = 0;
+
+    if (off >= inode->size)
+        return 0;
+    size = min(size, inode->size - off);
+
+    if (info->ecc)
+        return yaffs2_read_data_ecc(info, inode, buf, size, off);
+
+    run = talloc_zero(NULL, struct read_run);
+    sink = talloc_size(run, gap);
+
+    chunk = off / info->data_bytes;
+    skip = off % info->data_bytes;
+
+    for (; pos < size; chunk++, skip = 0)
+    {
+        want = min(info->data_bytes - skip, size - pos);
+        phys = yaffs2_map_chunk(inode, chunk);
+
+        /* chunks that were never written read as zeros */
+        if (phys == ~0)
+        {
+            memset((u8 *) buf + pos, 0, want);
+            pos += want;
+            continue;
+        }
+
+        if (run->iovcnt && (phys != run->next_phys ||
+                            run->iovcnt + 2 > IOV_MAX))
+        {
+            if ((err = flush_run(info, run)))
+                break;
+        }
+
+        if (!run->iovcnt)
+        {
+            run->start = (off_t) phys * info->block_size + skip;
+            run->len = 0;
+        }
+        else if (gap)
+        {
+            run->iov[run->iovcnt].iov_base = sink;
+            run->iov[run->iovcnt].iov_len = gap;
+            run->iovcnt++;
+            run->len += gap;
+        }
+
+        run->iov[run->iovcnt].iov_base = (u8 *) buf + pos;
+        run->iov[run->iovcnt].iov_len = want;
+        run->iovcnt++;
+        run->len += want;
+        run->next_phys = phys + 1;
+
+        pos += want;
+    }
+
+    if (!err)
+        err = flush_run(info, run);
+
+    talloc_free(run);
+    return err ? err : pos;
+}
+
+int yaffs2_stat(struct yaffs2_info *info, u32 ino, struct stat *st)
+{
+    struct yaffs2_inode *inode;
+
+    if (yaffs2_read_inode(info, ino, &inode))
+        return ENOENT;
+
+    st->st_ino = inode->object_id;
+    st->st_mode = inode->mode;
+    st->st_nlink = 2;
+    st->st_uid = inode->uid;
+    st->st_gid = inode->gid;
+    st->st_size = inode->size;
+    st->st_atime = inode->atime;
+    st->st_mtime = inode->mtime;
+    st->st_ctime = inode->ctime;
+    st->st_blksize = info->block_size;
+#if 0
+    st->st_blocks = le32_to_cpu(inode.i_blocks);
+#endif
     return 0;
 }
+
+/* the object's file type, as an st_mode */
+u32 yaffs2_inode_mode(struct yaffs2_inode *inode)
+{
+    switch (inode->type)
+    {
+        case YAFFS_OBJECT_TYPE_DIRECTORY:
+            return S_IFDIR;
+        case YAFFS_OBJECT_TYPE_SYMLINK:
+            return S_IFLNK;
+        case YAFFS_OBJECT_TYPE_SPECIAL:
+            return inode->mode & S_IFMT;
+        case YAFFS_OBJECT_TYPE_FILE:
+        default:
+            return S_IFREG;
+    }
+}
+
+/* manifests */
+
+static ssize_t yaffs2_manifest_read(void *fs, void *file, void *buf,
+                                    size_t len, u64 off)
+{
+    return yaffs2_read_data(fs, file, buf, len, off);
+}
+
+/* object headers can't make a loop, but a damaged image might */
+#define YAFFS2_MANIFEST_MAX_DEPTH 256
+
+static void yaffs2_manifest_dir(struct yaffs2_info *info, struct manifest *m,
+                                struct yaffs2_inode *dir, const char *path,
+                                int depth)
+{
+    struct yaffs2_inode *inode;
+    struct yaffs2_extent *x;
+    struct manifest_entry *e;
+    char *child;
+    u32 i, j;
+
+    if (depth > YAFFS2_MANIFEST_MAX_DEPTH)
+    {
+        fprintf(stderr, "yaffs2: %s/: too deep\n", path);
+        return;
+    }
+
+    for (i=0; i < dir->nchildren; i++)
+    {
+        inode = dir->children[i];
+        child = talloc_asprintf(NULL, "%s/%s", path,
+                                yaffs2_inode_name(info, inode));
+
+        if (inode->type != YAFFS_OBJECT_TYPE_FILE)
+        {
+            manifest_add(m, child, inode->size, inode->mode, NULL);
+            if (inode->type == YAFFS_OBJECT_TYPE_DIRECTORY)
+                yaffs2_manifest_dir(info, m, inode, child, depth + 1);
+            talloc_free(child);
+            continue;
+        }
+
+        e = manifest_add(m, child, inode->size, inode->mode | S_IFREG,
+                         inode);
+        for (j=0; j < inode->nextents; j++)
+        {
+            x = &inode->extents[j];
+            manifest_add_extent(e, (u64) x->logical * info->data_bytes,
+                                (u64) x->physical * info->block_size,
+                                (u64) x->count * info->block_size);
+        }
+        talloc_free(child);
+    }
+}
+
+int yaffs2_write_manifest(struct yaffs2_info *info, const char *file,
+                          const char *hash, int nthreads)
+{
+    const struct hash_algo *algo = hash_find(hash);
+    struct yaffs2_inode *root;
+    struct manifest *m;
+    FILE *out;
+    int errors;
+
+    if (!algo)
+    {
+        fprintf(stderr, "yaffs2: unknown hash %s\n", hash);
+        return 1;
+    }
+
+    if (yaffs2_read_inode(info, YAFFS_OBJECTID_ROOT, &root))
+    {
+        fprintf(stderr, "yaffs2: no root directory\n");
+        return 3;
+    }
+
+    out = strcmp(file, "-") == 0 ? stdout : fopen(file, "w");
+    if (!out)
+    {
+        perror(file);
+        return 2;
+    }
+
+    m = manifest_new(info, info->dev, algo, yaffs2_manifest_read, info);
+    manifest_add(m, "/", 0, root->mode, NULL);
+    yaffs2_manifest_dir(info, m, root, "", 0);
+
+    errors = manifest_run(m, nthreads, out);
+    if (errors)
+        fprintf(stderr, "yaffs2: %d files could not be read\n", errors);
+
+    talloc_free(m);
+    if (out != stdout)
+        fclose(out);
+    return errors ? 4 : 0;
+}
+
+/* library */
+
+static int yaffs2_fszoo_open(void *mem_ctx, struct bdev *dev,
+                             const struct fszoo_opts *opts, void **fs)
+{
+    struct yaffs2_info *info = talloc_zero(mem_ctx, struct yaffs2_info);
+    int err;
+
+    info->dev = dev;
+    info->ecc_spec = opts->ecc;
+
+    err = yaffs2_read_super(info);
+
+    /* anything scans as an empty yaffs2 image; don't claim it unasked */
+    if (!err && !opts->type && info->nobjects <= 1)
+        err = -EINVAL;
+    if (err)
+    {
+        talloc_free(info);
+        return err;
+    }
+    *fs = info;
+    return 0;
+}
+
+static int yaffs2_fszoo_lookup(void *fs, u32 dir, const char *name, u32 *ino)
+{
+    struct yaffs2_inode *inode, *child;
+
+    if (yaffs2_read_inode(fs, dir, &inode))
+        return -ENOENT;
+    if (inode->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+        return -ENOTDIR;
+
+    child = yaffs2_find_child(fs, inode, name);
+    trace(yaffs2_lookup, dir, child ? child->object_id : 0, 0);
+    if (!child)
+        return -ENOENT;
+
+    *ino = child->object_id;
+    return 0;
+}
+
+static int yaffs2_fszoo_stat(void *fs, u32 ino, struct stat *st)
+{
+    return -yaffs2_stat(fs, ino, st);
+}
+
+static int yaffs2_fszoo_readdir(void *fs, u32 ino, fszoo_dir_fn fn,
+                                void *arg)
+{
+    struct yaffs2_inode *dir, *inode;
+    struct stat st;
+    u32 i;
+
+    if (yaffs2_read_inode(fs, ino, &dir))
+        return -ENOENT;
+    if (dir->type != YAFFS_OBJECT_TYPE_DIRECTORY)
+        return -ENOTDIR;
+
+    for (i=0; i < dir->nchildren; i++)
+    {
+        inode = dir->children[i];
+        memset(&st, 0, sizeof(st));
+        st.st_ino = inode->object_id;
+        st.st_mode = yaffs2_inode_mode(inode);
+        if (fn(arg, yaffs2_inode_name(fs, inode), &st))
+            break;
+    }
+    return 0;
+}
+
+/* objects live as long as the mount, so they serve as the open file */
+static int yaffs2_fszoo_open_file(void *fs, u32 ino, void **file)
+{
+    struct yaffs2_inode *inode;
+    int err;
+
+    err = yaffs2_read_inode(fs, ino, &inode);
+    if (err)
+        return err;
+
+    *file = inode;
+    return 0;
+}
+
+static ssize_t yaffs2_fszoo_pread(void *fs, void *file, void *buf,
+                                  size_t len, u64 off)
+{
+    return yaffs2_read_data(fs, file, buf, len, off);
+}
+
+static void yaffs2_fszoo_close_file(void *fs, void *file)
+{
+}
+
+const struct fszoo_ops yaffs2_fszoo_ops = {
+    .name = "yaffs2",
+    .root = YAFFS_OBJECTID_ROOT,
+    .open = yaffs2_fszoo_open,
+    .lookup = yaffs2_fszoo_lookup,
+    .stat = yaffs2_fszoo_stat,
+    .readdir = yaffs2_fszoo_readdir,
+    .open_file = yaffs2_fszoo_open_file,
+    .pread = yaffs2_fszoo_pread,
+    .close_file = yaffs2_fszoo_close_file,
+};
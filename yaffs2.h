@@ -20,17 +20,39 @@
  */
 
 #include <linux/types.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "config.h"
+#include "bdev.h"
 #define YAFFS_MAGIC             0x5941FF53
 #define YAFFS_MAX_NAME_LENGTH   255
 #define YAFFS_MAX_ALIAS_LENGTH  159
 #define YAFFS_OBJECTID_ROOT     1
+#define YAFFS_OBJECTID_SUMMARY  0x10
+#define YAFFS_OBJECTID_MAX      0x3ffff
 
-#define YAFFS_LEAF_BITS    4
-#define YAFFS_LEAF_MASK  0xf
+#define YAFFS_LOWEST_SEQUENCE_NUMBER    0x00001000
+#define YAFFS_HIGHEST_SEQUENCE_NUMBER   0xefffff00
+#define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
+#define YAFFS_SEQUENCE_ERASED           0xffffffff
 
-#define YAFFS_INTERNAL_BITS    3
-#define YAFFS_INTERNAL_MASK  0x7
+/*
+ * Object header chunks may carry extra info packed into the tags; the
+ * chunk id then has this flag set and the object id carries the type.
+ */
+#define YAFFS_EXTRA_HEADER_INFO_FLAG    0x80000000
+#define YAFFS_EXTRA_OBJECT_TYPE_SHIFT   28
+#define YAFFS_EXTRA_OBJECT_TYPE_MASK    (0x0fU << YAFFS_EXTRA_OBJECT_TYPE_SHIFT)
+
+/* the tags proper, without ECC; also the size of inband tags */
+#define YAFFS_PACKED_TAGS_SIZE  16
+
+#define YAFFS_SUMMARY_VERSION   1
+
+#define YAFFS_CHECKPOINT_VERSION    7
+
+/* file chunk map entries per level 0 tnode */
+#define YAFFS_NTNODES_LEVEL0    16
 
 enum object_type {
 	YAFFS_OBJECT_TYPE_UNKNOWN,
@@ -75,26 +97,193 @@ struct yaffs2_object_header {
     __le32 is_shrink;
 };
 
-struct yaffs2_tree
-{
-    union {
-        struct internal {
-            struct yaffs2_tree *ptrs[8];
-        } i;
-        struct leaf {
-            u32 phys[16];
-        } l;
-    } u;
+/*
+ * Block summary, written into the last chunks of each full erase block by
+ * newer yaffs2.  Every summary chunk starts with the header, followed by
+ * its slice of the tags array, one entry per chunk before the summary.
+ */
+struct yaffs2_summary_header {
+    __le32 version;
+    __le32 block;
+    __le32 seq;
+    __le32 sum;
+};
+
+struct yaffs2_summary_tags {
+    __le32 object_id;
+    __le32 chunk_id;
+    __le32 byte_count;
+};
+
+/*
+ * Checkpoint, written on a clean unmount into blocks of its own.  Their
+ * chunks are tagged YAFFS_SEQUENCE_CHECKPOINT_DATA, with the chunk id
+ * counting pages through the checkpoint and the object id the block to
+ * look for the next checkpoint block from.  The page data is one stream:
+ * a validity marker, the device record followed by the block info and
+ * chunk bitmap of every block, an object record per object, each file's
+ * followed by its level 0 tnodes, a closing validity marker, and the
+ * checksum.  Block and chunk numbers count from 1 when the partition
+ * starts at block 0, as it does here.
+ */
+struct yaffs2_checkpt_validity {
+    __le32 struct_type;
+    __le32 magic;
+    __le32 version;
+    __le32 head;
+};
+
+struct yaffs2_checkpt_dev {
+    __le32 struct_type;
+    __le32 n_erased_blocks;
+    __le32 alloc_block;
+    __le32 alloc_page;
+    __le32 n_free_chunks;
+    __le32 n_deleted_files;
+    __le32 n_unlinked_files;
+    __le32 n_bg_deletions;
+    __le32 seq_number;
+};
+
+struct yaffs2_block_info {
+    __le32 state;           /* bitfields: page counts, state, flags */
+    __le32 seq_number;
+};
+
+/* 28 bytes, or 32 where the size is a 64 bit loff_t */
+struct yaffs2_checkpt_obj {
+    __le32 struct_type;
+    __le32 obj_id;
+    __le32 parent_id;
+    __le32 hdr_chunk;
+    __le32 flags;           /* variant type in the low 3 bits */
+    __le32 n_data_chunks;
+    __le32 size_or_equiv_obj;
+    __le32 size_high;
 };
 
 /* In-memory structures */
+
+/* a run of file chunks that was written to consecutive device chunks */
+struct yaffs2_extent {
+    u32 logical;
+    u32 physical;
+    u32 count;
+};
+
+/* cpu-endian tags, with any extra header info decoded */
+struct yaffs2_ext_tags {
+    u32 sequence_number;
+    u32 object_id;
+    u32 chunk_id;
+    u32 byte_count;
+};
+
+/*
+ * Decoded object, kept as small as possible: the name lives in the
+ * mount's shared name arena, and only symlinks keep their alias.
+ */
 struct yaffs2_inode {
-    struct yaffs2_object_header header;
     u32 object_id;
     u32 sequence_number;
+    u32 parent_id;
+    u32 name;               /* offset into the name arena */
+    u32 mode;
+    u32 uid;
+    u32 gid;
+    u32 atime;
+    u32 mtime;
+    u32 ctime;
+    u32 size;
+    u8 type;
+    u8 extents_unsorted;
+    char *alias;
 
-    GList *children;
-    struct yaffs2_tree *block_tree;
-    int block_tree_height;
+    /*
+     * directory entries, built after the scan; child_hash is an open
+     * addressed index of name hashes holding child index + 1
+     */
+    struct yaffs2_inode **children;
+    u32 nchildren;
+    u32 child_hash_mask;
+    u32 *child_hash;
+
+    /* chunk map, sorted by logical chunk once the scan is done */
+    struct yaffs2_extent *extents;
+    u32 nextents;
+    u32 extents_size;
 };
 
+/*
+ * The reader, for yaffs2_fuse and the fszoo library.  The whole image is
+ * scanned (or its checkpoint read) by yaffs2_read_super(); after that
+ * objects are only looked up in memory and file data read from the device.
+ */
+struct yaffs2_info
+{
+    struct bdev *dev;
+
+    /*
+     * parameters for our fake flash; the page, OOB and erase sizes and
+     * inband setting may be preset from the command line, anything left
+     * at zero is probed at mount
+     */
+    int mtd_page;
+    int mtd_extra;
+    int mtd_erase;
+    int inband;
+    int chunks_per_block;
+    int chunks_per_summary;
+    int nblocks;
+    int nchunks;
+
+    int block_size;         /* page plus OOB, as laid out in the image */
+    int tags_offset;        /* offset of the tags within a chunk */
+    int data_bytes;         /* file data bytes per chunk */
+
+    /* always scan, even when there is a checkpoint */
+    int no_checkpoint;
+
+    /* page ECC checked against the OOB, if asked for */
+    const char *ecc_spec;
+    struct ecc *ecc;
+
+    /* hot block profile, with --warm */
+    struct warm *warm;
+
+    /* object table, open addressed by object id */
+    struct yaffs2_inode **objects;
+    u32 objects_mask;
+    u32 nobjects;
+
+    struct yaffs2_inode *inode_slab;
+    int slab_used;
+
+    /* every object name, NUL terminated; offset 0 is the empty name */
+    char *names;
+    u32 names_len;
+    u32 names_size;
+};
+
+/* 0 or -errno */
+int yaffs2_read_super(struct yaffs2_info *info);
+int yaffs2_read_inode(struct yaffs2_info *info, u32 ino,
+                      struct yaffs2_inode **ret);
+
+/* 0 or an errno */
+int yaffs2_stat(struct yaffs2_info *info, u32 ino, struct stat *st);
+
+struct yaffs2_inode *yaffs2_find_child(struct yaffs2_info *info,
+                                       struct yaffs2_inode *dir,
+                                       const char *name);
+const char *yaffs2_inode_name(struct yaffs2_info *info,
+                              struct yaffs2_inode *inode);
+u32 yaffs2_inode_mode(struct yaffs2_inode *inode);
+
+/* bytes read, or -errno */
+ssize_t yaffs2_read_data(struct yaffs2_info *info, struct yaffs2_inode *inode,
+                         void *buf, size_t size, off_t off);
+
+/* an exit status */
+int yaffs2_write_manifest(struct yaffs2_info *info, const char *file,
+                          const char *hash, int nthreads);
@@ -0,0 +1,389 @@
+#include <fuse.h>
+#include <fuse/fuse_lowlevel.h>
+#include <talloc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "yaffs2.h"
+#include "config.h"
+#include "trace.h"
+#include "ecc.h"
+#include "bdev.h"
+#include "warm.h"
+#include "reqsched.h"
+
+/* FUSE API */
+
+static void yaffs2_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct yaffs2_info *info = fuse_req_userdata(req);
+    struct yaffs2_inode *dir;
+    struct yaffs2_inode *inode;
+    struct fuse_entry_param result = { 0 };
+
+    if (yaffs2_read_inode(info, parent, &dir))
+        goto out;
+
+    inode = yaffs2_find_child(info, dir, name);
+    trace(yaffs2_lookup, parent, inode ? inode->object_id : 0, 0);
+    if (inode)
+    {
+        result.ino = inode->object_id;
+        yaffs2_stat(info, result.ino, &result.attr);
+        goto found;
+    }
+
+out:
+    fuse_reply_err(req, ENOENT);
+    return;
+
+found:
+    fuse_reply_entry(req, &result);
+}
+
+static
+void yaffs2_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int err;
+    struct yaffs2_info *info = fuse_req_userdata(req);
+    struct stat st;
+
+    err = yaffs2_stat(info, ino, &st);
+    if (err)
+        goto out;
+
+    fuse_reply_attr(req, &st, 1.0);
+    return;
+out:
+    fuse_reply_err(req, err);
+}
+
+static void yaffs2_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+/*
+    fuse_reply_err(req, EIO);
+*/
+}
+
+static
+void yaffs2_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct yaffs2_info *info = fuse_req_userdata(req);
+    struct yaffs2_inode *inode;
+
+    /* read the inode and store it in fi->fh */
+    if (yaffs2_read_inode(info, ino, &inode))
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fi->fh = (uint64_t) (unsigned long) inode;
+    fuse_reply_open(req, fi);
+}
+
+static void yaffs2_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
+{
+    struct yaffs2_info *info = fuse_req_userdata(req);
+    struct yaffs2_inode *inode = (struct yaffs2_inode *) (unsigned long) fi->fh;
+    ssize_t ret;
+    char *buf;
+
+    trace(yaffs2_read, inode->object_id, off, size);
+
+    buf = talloc_size(info, size);
+
+    ret = yaffs2_read_data(info, inode, buf, size, off);
+    if (ret < 0)
+        fuse_reply_err(req, -ret);
+    else
+        fuse_reply_buf(req, buf, ret);
+
+    talloc_free(buf);
+}
+
+static
+void yaffs2_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    /* fi->fh points into the object table, which outlives the open */
+    fuse_reply_err(req, 0);
+}
+
+static
+void yaffs2_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_open(req, fi);
+}
+
+static
+void yaffs2_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                  struct fuse_file_info *fi)
+{
+    struct yaffs2_info *info = fuse_req_userdata(req);
+    struct yaffs2_inode *dir, *inode;
+    char *buf;
+    u32 i;
+    size_t ret;
+    size_t bufsize=0;
+
+    if (yaffs2_read_inode(info, ino, &dir))
+        goto err;
+
+    buf = talloc_size(info, size);
+
+    /* offsets are indexes into the directory's array of children */
+    for (i=off; i < dir->nchildren; i++)
+    {
+        inode = dir->children[i];
+
+        struct stat st = {
+            .st_ino = inode->object_id,
+            .st_mode = yaffs2_inode_mode(inode),
+        };
+
+        ret = fuse_add_direntry(req, buf + bufsize, size - bufsize,
+                                yaffs2_inode_name(info, inode), &st, i+1);
+        if (ret > size - bufsize)
+            goto done;
+
+        bufsize += ret;
+    }
+
+done:
+    fuse_reply_buf(req, buf, bufsize);
+    talloc_free(buf);
+    return;
+
+err:
+    fuse_reply_err(req, EIO);
+}
+
+static void yaffs2_releasedir(fuse_req_t req, fuse_ino_t ino,
+                     struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, 0);
+}
+
+static void yaffs2_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct yaffs2_info *fsi = fuse_req_userdata(req);
+
+    struct statvfs stbuf = {
+        .f_bsize = fsi->mtd_page,
+        .f_frsize = fsi->mtd_page,
+        .f_blocks = fsi->nblocks,
+        .f_bfree = fsi->nblocks,
+        .f_bavail = fsi->nblocks,
+        .f_files = fsi->nobjects,
+        .f_ffree = ~0,
+        .f_favail = ~0,
+        .f_fsid = YAFFS_MAGIC,
+        .f_flag = 0,
+        .f_namemax = YAFFS_MAX_NAME_LENGTH,
+    };
+
+    fuse_reply_statfs(req, &stbuf);
+}
+
+#if 0
+static void yaffs2_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                   size_t size)
+{
+}
+
+static void yaffs2_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+}
+
+static void yaffs2_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
+               uint64_t idx)
+{
+    /* fuse_reply_bmap(req, idx) */
+}
+#endif
+
+static struct fuse_lowlevel_ops yaffs2_ops = {
+    .lookup = yaffs2_lookup,
+    .opendir = yaffs2_opendir,
+    .readdir = yaffs2_readdir,
+    .releasedir = yaffs2_releasedir,
+    .statfs = yaffs2_statfs,
+    .getattr = yaffs2_getattr,
+    .open = yaffs2_open,
+    .read = yaffs2_read,
+    .release = yaffs2_release,
+#if 0
+    .readlink = yaffs2_readlink,
+    .getxattr = yaffs2_getxattr,
+    .listxattr = yaffs2_listxattr,
+    .bmap = yaffs2_bmap
+#endif
+};
+
+int main(int argc, char *argv[])
+{
+    struct yaffs2_info *ctx;
+    int i, fuse_argc=0;
+    char *device = NULL;
+    char *trace_file = NULL;
+    char *backend = NULL;
+    char *manifest = NULL;
+    char *hash = "sha256";
+    int nthreads = 0;
+    int warm = 0;
+    int warm_rate = WARM_RATE;
+    int workers = REQSCHED_WORKERS;
+    int max_bulk = REQSCHED_MAX_BULK;
+    struct reqsched *sched;
+    struct fuse_session *sess;
+    struct fuse_chan *chan;
+    struct fuse_args args;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int res;
+
+    ctx = talloc_zero(NULL, struct yaffs2_info);
+
+    /* FIXME replace this with fuse_getopt */
+    char **fuse_argv = malloc((argc + 1) * sizeof(char *));
+
+    for (i=0; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-a") == 0) && i + 1 < argc)
+        {
+            i++;
+            device = argv[i];
+        }
+        else if ((strcmp(argv[i], "--page") == 0) && i + 1 < argc)
+            ctx->mtd_page = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--oob") == 0) && i + 1 < argc)
+            ctx->mtd_extra = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--erase") == 0) && i + 1 < argc)
+            ctx->mtd_erase = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--inband") == 0)
+            ctx->inband = 1;
+        else if ((strcmp(argv[i], "--ecc") == 0) && i + 1 < argc)
+            ctx->ecc_spec = argv[++i];
+        else if (strcmp(argv[i], "--no-checkpoint") == 0)
+            ctx->no_checkpoint = 1;
+        else if ((strcmp(argv[i], "-b") == 0) && i + 1 < argc)
+            backend = argv[++i];
+        else if ((strcmp(argv[i], "--manifest") == 0) && i + 1 < argc)
+            manifest = argv[++i];
+        else if ((strcmp(argv[i], "--hash") == 0) && i + 1 < argc)
+            hash = argv[++i];
+        else if ((strcmp(argv[i], "-j") == 0) && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--warm") == 0)
+            warm = 1;
+        else if ((strcmp(argv[i], "--warm-rate") == 0) && i + 1 < argc)
+            warm_rate = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--workers") == 0) && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--max-bulk") == 0) && i + 1 < argc)
+            max_bulk = atoi(argv[++i]);
+        else if ((strcmp(argv[i], "--trace") == 0) && i + 1 < argc)
+            trace_file = argv[++i];
+        else
+            fuse_argv[fuse_argc++] = argv[i];
+    }
+
+    fuse_argv[fuse_argc] = NULL;
+
+    if (!device)
+    {
+        fprintf(stderr, "Usage: %s -a <device_file> [-b <backend>] "
+                "[--page <bytes>] [--oob <bytes>] [--erase <bytes>] [--inband] "
+                "[--ecc hamming|bch<t>[@<offset>]] [--no-checkpoint] "
+                "[--trace <file>] [--warm [--warm-rate <MB/s>]] "
+                "[--workers <n>] [--max-bulk <n>] <mount_point>\n"
+                "       %s -a <device_file> [<options as above>] "
+                "--manifest <file> [--hash sha256|blake3] [-j <threads>]\n",
+                argv[0], argv[0]);
+        bdev_usage(stderr);
+        return 1;
+    }
+
+    ctx->dev = bdev_open(ctx, device, backend);
+    if (!ctx->dev)
+    {
+        perror("yaffs2_fuse");
+        return 2;
+    }
+
+    if (trace_file && trace_start(trace_file))
+        fprintf(stderr, "yaffs2_fuse: not tracing to %s\n", trace_file);
+
+    if (yaffs2_read_super(ctx))
+    {
+        printf ("Could not read super block\n");
+        return 3;
+    }
+
+    if (manifest)
+    {
+        res = yaffs2_write_manifest(ctx, manifest, hash, nthreads);
+        if (ctx->ecc)
+            ecc_report(ctx->ecc, "yaffs2");
+        trace_stop();
+        talloc_free(ctx);
+        return res;
+    }
+
+    /* the profile lives next to the image */
+    if (warm)
+        ctx->warm = warm_new(ctx, talloc_asprintf(ctx, "%s.warm", device),
+                             ctx->dev);
+
+    args.argc = fuse_argc;
+    args.argv = fuse_argv;
+    args.allocated = 0;
+
+    res = fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground);
+    if (res == -1)
+        goto out_err;
+
+    printf ("mount %s\n", mountpoint);
+
+    chan = fuse_mount(mountpoint, &args);
+    if (!chan)
+        goto out_err;
+
+    sess = fuse_lowlevel_new(&args, &yaffs2_ops, sizeof(yaffs2_ops), ctx);
+    fuse_session_add_chan(sess, chan);
+
+    res = fuse_daemonize(foreground);
+    if (res == -1)
+        goto err_unmount;
+
+    res = fuse_set_signal_handlers(sess);
+    if (res == -1)
+        goto err_unmount;
+
+    /* after daemonizing, which would lose the thread */
+    if (ctx->warm &&
+        warm_start(ctx->warm, (u64) warm_rate << 20, WARM_SAVE_INTERVAL))
+        fprintf(stderr, "yaffs2_fuse: no cache warm-up\n");
+
+    sched = reqsched_new(ctx, workers, max_bulk);
+    reqsched_loop(sched, sess);
+    reqsched_report(sched, "yaffs2");
+    if (ctx->warm)
+        warm_stop(ctx->warm);
+    if (ctx->ecc)
+        ecc_report(ctx->ecc, "yaffs2");
+    trace_stop();
+    talloc_free(ctx);
+    return 0;
+
+err_unmount:
+    fuse_unmount(mountpoint, chan);
+
+out_err:
+    free(mountpoint);
+    return 0;
+}